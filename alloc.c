@@ -0,0 +1,238 @@
+#include "alloc.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALIGNMENT 16  // Alignment of every pool object
+
+typedef struct slab {
+    struct slab *next;
+    char objects[] __attribute__((aligned(ALIGNMENT)));
+} Slab;
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;            // bytes in data
+    size_t used;            // bytes of data handed out
+    char data[];
+} ArenaChunk;
+
+
+/*
+ * Initialize an empty pool of objects of object_size bytes.
+ */
+void init_pool(Pool *pool, size_t object_size) {
+    // every object must be able to hold the free list link
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    pool->object_size = (object_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->num_slabs = 0;
+    pool->in_use = 0;
+    pool->total_allocs = 0;
+}
+
+
+#ifndef POOL_USE_MALLOC
+
+/*
+ * Return an uninitialized object from pool.
+ */
+void *pool_alloc(Pool *pool) {
+    if (pool->free_list == NULL) {
+        // carve a new slab into objects and put them all on the free list
+        Slab *slab = malloc(sizeof(Slab) + pool->object_size * POOL_SLAB_OBJECTS);
+        if (slab == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->num_slabs++;
+
+        for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+            void **object = (void **)(slab->objects + i * pool->object_size);
+            *object = pool->free_list;
+            pool->free_list = object;
+        }
+    }
+
+    void **object = pool->free_list;
+    pool->free_list = *object;
+    pool->in_use++;
+    pool->total_allocs++;
+    return object;
+}
+
+
+/*
+ * Return object, which must have come from pool_alloc(pool), to pool.
+ */
+void pool_free(Pool *pool, void *object) {
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+
+/*
+ * Return the number of bytes pool has allocated from the system.
+ */
+size_t pool_bytes_reserved(const Pool *pool) {
+    return pool->num_slabs * (sizeof(Slab) + pool->object_size * POOL_SLAB_OBJECTS);
+}
+
+
+/*
+ * Return len bytes from arena, starting at an offset into the current chunk
+ * that is a multiple of align (a power of two), taking a new chunk if the
+ * current one is too full.
+ */
+static char *arena_take(Arena *arena, size_t len, size_t align) {
+    ArenaChunk *chunk = arena->chunks;
+    size_t start = chunk == NULL ? 0 : (chunk->used + align - 1) & ~(align - 1);
+    if (chunk == NULL || start > chunk->size || chunk->size - start < len) {
+        // oversized requests get a chunk of their own
+        size_t size = len > arena->chunk_size ? len : arena->chunk_size;
+        chunk = malloc(sizeof(ArenaChunk) + size);
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->num_chunks++;
+        arena->bytes_reserved += sizeof(ArenaChunk) + size;
+        start = 0;
+    }
+
+    chunk->used = start + len;
+    arena->bytes_used += len;
+    return chunk->data + start;
+}
+
+
+/*
+ * Return a copy, in arena, of the len bytes at str followed by a null
+ * terminator.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_take(arena, len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+/*
+ * Return size uninitialized bytes from arena, aligned for pointers.
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    return arena_take(arena, size, sizeof(void *));
+}
+
+
+/*
+ * Free every chunk of arena, leaving it empty.
+ */
+void free_arena(Arena *arena) {
+    while (arena->chunks != NULL) {
+        ArenaChunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    init_arena(arena, arena->chunk_size);
+}
+
+#else
+
+/*
+ * Return an uninitialized object from pool.
+ */
+void *pool_alloc(Pool *pool) {
+    void *object = malloc(pool->object_size);
+    if (object == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pool->in_use++;
+    pool->total_allocs++;
+    return object;
+}
+
+
+/*
+ * Return object, which must have come from pool_alloc(pool), to pool.
+ */
+void pool_free(Pool *pool, void *object) {
+    free(object);
+    pool->in_use--;
+}
+
+
+/*
+ * Return the number of bytes pool has allocated from the system.
+ */
+size_t pool_bytes_reserved(const Pool *pool) {
+    return pool->in_use * pool->object_size;
+}
+
+
+/*
+ * Return a copy, in arena, of the len bytes at str followed by a null
+ * terminator.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = malloc(len + 1);
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    arena->bytes_used += len + 1;
+    arena->bytes_reserved += len + 1;
+    return copy;
+}
+
+
+/*
+ * Return size uninitialized bytes from arena, aligned for pointers.
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    void *object = malloc(size);
+    if (object == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    arena->bytes_used += size;
+    arena->bytes_reserved += size;
+    return object;
+}
+
+
+/*
+ * Leave arena empty. Its allocations are not tracked, so they are not
+ * freed.
+ */
+void free_arena(Arena *arena) {
+    init_arena(arena, arena->chunk_size);
+}
+
+#endif
+
+
+/*
+ * Initialize an empty arena whose chunks hold chunk_size bytes.
+ */
+void init_arena(Arena *arena, size_t chunk_size) {
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    arena->num_chunks = 0;
+    arena->bytes_used = 0;
+    arena->bytes_reserved = 0;
+}
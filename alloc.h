@@ -0,0 +1,90 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+#define POOL_SLAB_OBJECTS 256       // Objects carved out of each pool slab
+#define ARENA_CHUNK_SIZE (64 * 1024)  // Default size of an arena chunk
+
+/*
+ * A slab allocator for objects of a single size. Objects are carved out of
+ * slabs of POOL_SLAB_OBJECTS and freed objects are kept on a free list for
+ * reuse; slabs are never returned to the system.
+ *
+ * Building alloc.c with -DPOOL_USE_MALLOC turns pools and arenas into thin
+ * wrappers around malloc/free (keeping the statistics), for comparison.
+ */
+typedef struct pool {
+    size_t object_size;     // rounded up to a multiple of the alignment
+    void *free_list;        // freed objects, linked through their first word
+    struct slab *slabs;     // every slab allocated for this pool
+    long num_slabs;
+    long in_use;            // objects handed out and not yet freed
+    long total_allocs;      // objects ever handed out
+} Pool;
+
+
+/*
+ * An append-only allocator for variable sized data (post bodies and name
+ * index towers). Memory is handed out from the current chunk and never
+ * freed individually.
+ */
+typedef struct arena {
+    struct arena_chunk *chunks;  // newest chunk first
+    size_t chunk_size;           // size of a regular chunk's data area
+    long num_chunks;
+    size_t bytes_used;           // bytes handed out
+    size_t bytes_reserved;       // bytes allocated from the system
+} Arena;
+
+
+/*
+ * Initialize an empty pool of objects of object_size bytes.
+ */
+void init_pool(Pool *pool, size_t object_size);
+
+
+/*
+ * Return an uninitialized object from pool.
+ */
+void *pool_alloc(Pool *pool);
+
+
+/*
+ * Return object, which must have come from pool_alloc(pool), to pool.
+ */
+void pool_free(Pool *pool, void *object);
+
+
+/*
+ * Return the number of bytes pool has allocated from the system.
+ */
+size_t pool_bytes_reserved(const Pool *pool);
+
+
+/*
+ * Initialize an empty arena whose chunks hold chunk_size bytes.
+ */
+void init_arena(Arena *arena, size_t chunk_size);
+
+
+/*
+ * Return a copy, in arena, of the len bytes at str followed by a null
+ * terminator.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+
+/*
+ * Return size uninitialized bytes from arena, aligned for pointers.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+
+/*
+ * Free every chunk of arena, leaving it empty. With POOL_USE_MALLOC the
+ * allocations are not tracked, so only the statistics are reset.
+ */
+void free_arena(Arena *arena);
+
+#endif
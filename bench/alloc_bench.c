@@ -0,0 +1,133 @@
+/*
+ * Allocation benchmark for the post path.
+ *
+ * Creates a ring of befriended users and makes a large number of posts of
+ * random length, then reports posts/sec, the process RSS and the allocator
+ * statistics. Built twice by the Makefile: bench/alloc_bench uses the slab
+ * pools and post arena, bench/alloc_bench_malloc the same code with
+ * alloc.c built with -DPOOL_USE_MALLOC, so the two can be compared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+
+#define MAX_CONTENTS 200
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Return the resident set size of this process in kilobytes.
+ */
+long rss_kb() {
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return -1;
+    }
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-p posts]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int num_users = 10000;
+    long num_posts = 2000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:p:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                num_posts = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < 2 || num_posts <= 0) {
+        usage(argv[0]);
+    }
+
+    srand(1);
+    long rss_start = rss_kb();
+
+    UserTable table;
+    init_user_table(&table);
+    User **users = malloc(num_users * sizeof(User *));
+    if (users == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    char name[MAX_NAME];
+    char friend_name[MAX_NAME];
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, MAX_NAME, "user%d", i);
+        create_user(name, &table);
+        users[i] = find_user(name, &table);
+    }
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, MAX_NAME, "user%d", i);
+        snprintf(friend_name, MAX_NAME, "user%d", (i + 1) % num_users);
+        make_friends(name, friend_name, &table);
+    }
+
+    // random printable contents; each post uses a random slice
+    char contents[2 * MAX_CONTENTS + 1];
+    for (int i = 0; i < 2 * MAX_CONTENTS; i++) {
+        contents[i] = 'a' + rand() % 26;
+    }
+    contents[2 * MAX_CONTENTS] = '\0';
+
+    double start = now();
+    for (long i = 0; i < num_posts; i++) {
+        int author = rand() % num_users;
+        int len = 20 + rand() % (MAX_CONTENTS - 20);
+        char *slice = contents + (2 * MAX_CONTENTS - len);
+        make_post(users[author], users[(author + 1) % num_users], slice, &table);
+    }
+    double elapsed = now() - start;
+
+#ifdef POOL_USE_MALLOC
+    char *allocator = "malloc";
+#else
+    char *allocator = "pools + arena";
+#endif
+    printf("allocator: %s\n", allocator);
+    printf("posts: %ld  seconds: %.2f  posts/sec: %.0f\n", num_posts, elapsed, num_posts / elapsed);
+    printf("rss: %ld kB (%ld kB before creating users)\n", rss_kb(), rss_start);
+    printf("post pool: %ld in use, %zu bytes reserved\n",
+           table.post_pool.in_use, pool_bytes_reserved(&table.post_pool));
+    printf("post arena: %zu bytes used, %zu bytes reserved\n",
+           table.post_arena.bytes_used, table.post_arena.bytes_reserved);
+    free(users);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Latency benchmark for feeds.
+ *
+ * Builds -u users with about -f friends each, plus -H heavy users whom
+ * -F users each befriend, then runs the same workload three ways: with
+ * every profile merged as feeds are read (fanout_limit 0), with the hybrid
+ * the server uses (fanout_limit FEED_FANOUT_LIMIT, so only the heavy
+ * users are merged on read), and with every post fanned out to the
+ * timelines of the target's friends (no limit). Each way, every user's
+ * feed is read once to build their timeline, then -p posts are made to
+ * random friends (a fifth of them to heavy users) and fanned out, then
+ * -q feeds of 20 posts are read. Reports the p50 and p99 latencies of
+ * the fan-out of a post and of a feed read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../friends.h"
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+/*
+ * Order unsigned longs ascending, for qsort.
+ */
+int compare_longs(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Emitter that only counts bytes.
+ */
+void count_bytes(void *context, const char *bytes, int len) {
+    *(long *)context += len;
+}
+
+
+/*
+ * Sort the n latencies and print their p50 and p99.
+ */
+void report(const char *what, unsigned long *latencies, int n) {
+    qsort(latencies, n, sizeof(unsigned long), compare_longs);
+    printf("  %-8s p50 %9.2f us  p99 %9.2f us\n", what, latencies[n / 2] / 1e3,
+           latencies[(long)n * 99 / 100] / 1e3);
+}
+
+
+int num_users = 20000;
+int num_friends = 50;
+int num_heavy = 10;
+int heavy_fans = 5000;
+int num_posts = 200000;
+int num_queries = 20000;
+
+
+/*
+ * Run the workload on a fresh table with the given fanout_limit.
+ */
+void run(const char *name, unsigned int fanout_limit) {
+    UserTable table;
+    init_user_table(&table);
+    table.fanout_limit = fanout_limit;
+    UserTable *tables[1] = {&table};
+
+    int total = num_users + num_heavy;
+    User **users = malloc(total * sizeof(User *));
+    if (users == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < total; i++) {
+        char name[MAX_NAME];
+        snprintf(name, MAX_NAME, "%s%d", i < num_heavy ? "heavy" : "user", i);
+        create_user(name, &table);
+        users[i] = find_user(name, &table);
+    }
+    // the same graph every time
+    unsigned int seed = 1;
+    for (int i = num_heavy; i < total; i++) {
+        for (int j = 0; j < num_friends / 2; j++) {
+            make_friends(users[i]->name, users[num_heavy + rand_r(&seed) % num_users]->name, &table);
+        }
+    }
+    for (int h = 0; h < num_heavy; h++) {
+        for (int j = 0; j < heavy_fans; j++) {
+            make_friends(users[h]->name, users[num_heavy + rand_r(&seed) % num_users]->name, &table);
+        }
+    }
+
+    long bytes = 0;
+    for (int i = 0; i < total; i++) {
+        render_feed(users[i], tables, FEED_DEFAULT_SIZE, count_bytes, &bytes);
+    }
+
+    unsigned long *latencies = malloc((num_posts > num_queries ? num_posts : num_queries) *
+                                      sizeof(unsigned long));
+    if (latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int p = 0; p < num_posts; p++) {
+        User *author = users[num_heavy + rand_r(&seed) % num_users];
+        User *target = NULL;
+        for (int h = 0; h < num_heavy && rand_r(&seed) % 5 == 0; h++) {
+            if (is_friend(author, users[h])) {
+                target = users[h];
+            }
+        }
+        if (target == NULL) {
+            target = author->friends[rand_r(&seed) % author->num_friends];
+        }
+        make_post(author, target, "a post of some words, as posts go", &table);
+
+        unsigned long start = now_ns();
+        if (!is_heavy_poster(target, &table)) {
+            for (int i = 0; i < target->num_friends; i++) {
+                push_timeline(target->friends[i], &table, target->first_post->id);
+            }
+        }
+        latencies[p] = now_ns() - start;
+    }
+    printf("%s (fanout_limit %u)\n", name, fanout_limit);
+    report("fan-out", latencies, num_posts);
+
+    for (int q = 0; q < num_queries; q++) {
+        User *user = users[num_heavy + rand_r(&seed) % num_users];
+        unsigned long start = now_ns();
+        render_feed(user, tables, FEED_DEFAULT_SIZE, count_bytes, &bytes);
+        latencies[q] = now_ns() - start;
+    }
+    report("feed", latencies, num_queries);
+    free(latencies);
+    free(users);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-f friends] [-H heavy_users] [-F heavy_fans]\n"
+                    "       [-p posts] [-q queries]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:f:H:F:p:q:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                num_friends = strtol(optarg, NULL, 10);
+                break;
+            case 'H':
+                num_heavy = strtol(optarg, NULL, 10);
+                break;
+            case 'F':
+                heavy_fans = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                num_posts = strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                num_queries = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < 1 || num_friends < 2 || num_heavy < 0 || heavy_fans < 0 || num_posts < 1 ||
+            num_queries < 1) {
+        usage(argv[0]);
+    }
+
+    run("merge on read", 0);
+    run("hybrid", FEED_FANOUT_LIMIT);
+    run("fan-out on write", UINT_MAX);
+    return 0;
+}
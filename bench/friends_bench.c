@@ -0,0 +1,240 @@
+/*
+ * Micro-benchmark for the data path in friends.c.
+ *
+ * Builds a synthetic graph of users, friendships and posts of the given
+ * size, timing each step, then times lookups and the rendering functions
+ * against it. Reports ns/op, heap allocations/op and bytes allocated/op for
+ * create_user, find_user, make_friends, make_post, list_users (and the
+ * user list and sorted pages that replace it in the server), print_user
+ * and render_cached_profile.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (see the Makefile), so calls made inside libc are not counted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+
+long allocations;
+long allocated_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// start of the measurement in progress
+double start_time;
+long start_allocations;
+long start_bytes;
+
+
+/*
+ * Start measuring.
+ */
+void begin() {
+    start_allocations = allocations;
+    start_bytes = allocated_bytes;
+    start_time = now();
+}
+
+
+/*
+ * Print what was measured since begin, spread over ops operations.
+ */
+void report(const char *label, long ops) {
+    double elapsed = now() - start_time;
+    printf("%-24s %10ld ops %12.1f ns/op %10.2f allocs/op %12.1f B/op\n", label, ops,
+           elapsed / ops * 1e9, (double)(allocations - start_allocations) / ops,
+           (double)(allocated_bytes - start_bytes) / ops);
+}
+
+
+/*
+ * Emitter that only counts bytes.
+ */
+void count_bytes(void *context, const char *bytes, int len) {
+    *(long *)context += len;
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-f friends_per_user] [-p posts_per_user] "
+            "[-n iterations]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int num_users = 100000;
+    int friends_per_user = 20;
+    int posts_per_user = 10;
+    int iterations = 1000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:f:p:n:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                friends_per_user = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                posts_per_user = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < 2 || friends_per_user < 2 || posts_per_user < 0 || iterations <= 0) {
+        usage(argv[0]);
+    }
+
+    srand(1);
+    char (*names)[MAX_NAME] = malloc(num_users * sizeof(*names));
+    char (*missing)[MAX_NAME] = malloc(num_users * sizeof(*missing));
+    int *order = malloc(num_users * sizeof(int));
+    if (names == NULL || missing == NULL || order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_users; i++) {
+        snprintf(names[i], MAX_NAME, "user%d", i);
+        snprintf(missing[i], MAX_NAME, "nobody%d", i);
+        order[i] = rand() % num_users;
+    }
+    printf("%d users, %d friends and %d posts per user\n",
+           num_users, friends_per_user, posts_per_user);
+
+    UserTable table;
+    init_user_table(&table);
+    begin();
+    for (int i = 0; i < num_users; i++) {
+        create_user(names[i], &table);
+    }
+    report("create_user", num_users);
+
+    begin();
+    for (int i = 0; i < iterations; i++) {
+        find_user(names[order[i % num_users]], &table);
+    }
+    report("find_user (hit)", iterations);
+
+    begin();
+    for (int i = 0; i < iterations; i++) {
+        find_user(missing[order[i % num_users]], &table);
+    }
+    report("find_user (miss)", iterations);
+
+    // each friendship adds a friend to both users
+    long attempts = (long)num_users * (friends_per_user / 2);
+    begin();
+    for (long i = 0; i < attempts; i++) {
+        make_friends(names[i % num_users], names[rand() % num_users], &table);
+    }
+    report("make_friends", attempts);
+
+    User **users = malloc(num_users * sizeof(User *));
+    if (users == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_users; i++) {
+        users[i] = find_user(names[i], &table);
+    }
+    long posts = (long)num_users * posts_per_user;
+    begin();
+    for (long i = 0; i < posts; i++) {
+        User *target = users[i % num_users];
+        if (target->num_friends > 0) {
+            make_post(target->friends[i % target->num_friends], target,
+                      "a post made by the benchmark", &table);
+        }
+    }
+    report("make_post", posts);
+
+    int list_iterations = iterations / num_users + 1;
+    begin();
+    for (int i = 0; i < list_iterations; i++) {
+        free(list_users(table.head));
+    }
+    report("list_users", list_iterations);
+
+    begin();
+    for (int i = 0; i < iterations; i++) {
+        int len;
+        release_rendering(acquire_user_list(&table, &len));
+    }
+    report("acquire_user_list", iterations);
+
+    // a page of 20 names starting with a random user's
+    UserTable *tables[] = {&table};
+    long page_bytes = 0;
+    begin();
+    for (int i = 0; i < iterations; i++) {
+        render_sorted_users(tables, 1, names[order[i % num_users]], 0, 20, count_bytes,
+                            &page_bytes);
+    }
+    report("render_sorted_users", iterations);
+
+    int print_iterations = iterations / (friends_per_user + posts_per_user) + 1;
+    begin();
+    for (int i = 0; i < print_iterations; i++) {
+        free(print_user(users[order[i % num_users]]));
+    }
+    report("print_user", print_iterations);
+
+    // the first pass renders every profile into the cache
+    long bytes = 0;
+    for (int i = 0; i < num_users; i++) {
+        render_cached_profile(users[i], &table, count_bytes, &bytes);
+    }
+    begin();
+    for (int i = 0; i < iterations; i++) {
+        render_cached_profile(users[order[i % num_users]], &table, count_bytes, &bytes);
+    }
+    report("render_cached_profile", iterations);
+    return 0;
+}
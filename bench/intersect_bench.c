@@ -0,0 +1,153 @@
+/*
+ * Micro-benchmark for the friend set intersection kernel behind the
+ * mutual and suggest commands.
+ *
+ * Builds a synthetic table of users, gives two of them `friends` random
+ * friends each (and a third a much smaller set, to exercise galloping),
+ * then times intersect_friends() and suggest_friends().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Return the name of the user with index i.
+ */
+char *user_name(int i, char *name) {
+    snprintf(name, MAX_NAME, "user%d", i);
+    return name;
+}
+
+
+/*
+ * Befriend the user with index i with `count` distinct random users.
+ */
+void add_random_friends(UserTable *table, int i, int count, int num_users) {
+    char name1[MAX_NAME];
+    char name2[MAX_NAME];
+    user_name(i, name1);
+    int added = 0;
+    while (added < count) {
+        if (make_friends(name1, user_name(rand() % num_users, name2), table) == 0) {
+            added++;
+        }
+    }
+}
+
+
+/*
+ * Time `iterations` intersections of user1's and user2's friends and print
+ * the result as ns/op.
+ */
+void time_intersection(const char *label, User *user1, User *user2, int iterations) {
+    // room for at least one, since malloc(0) may return NULL
+    int size = user1->num_friends + user2->num_friends;
+    User **result = malloc((size > 0 ? size : 1) * sizeof(User *));
+    if (result == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int count = 0;
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        count = intersect_friends(user1, user2, result);
+    }
+    double elapsed = now() - start;
+
+    printf("%-28s %6d x %6d friends, %5d mutual: %10.0f ns/op\n", label,
+           user1->num_friends, user2->num_friends, count, elapsed / iterations * 1e9);
+    free(result);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-f friends] [-n iterations]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int num_users = 20000;
+    int num_friends = 2000;
+    int iterations = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:f:n:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                num_friends = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < 3 || num_friends <= 0 || num_friends >= num_users || iterations <= 0) {
+        usage(argv[0]);
+    }
+
+    srand(1);
+    UserTable table;
+    init_user_table(&table);
+    char name[MAX_NAME];
+    for (int i = 0; i < num_users; i++) {
+        create_user(user_name(i, name), &table);
+    }
+
+    // give every friend of user0 a friend list of the same size, so
+    // suggest walks num_friends^2 two-hop paths
+    add_random_friends(&table, 0, num_friends, num_users);
+    add_random_friends(&table, 1, num_friends, num_users);
+    add_random_friends(&table, 2, num_friends / 64 + 1, num_users);
+    User *user0 = find_user(user_name(0, name), &table);
+    for (int i = 0; i < user0->num_friends; i++) {
+        User *friend = user0->friends[i];
+        int missing = num_friends - friend->num_friends;
+        if (missing > 0) {
+            add_random_friends(&table, friend->id, missing, num_users);
+        }
+    }
+    User *user1 = find_user(user_name(1, name), &table);
+    User *user2 = find_user(user_name(2, name), &table);
+
+    time_intersection("intersect (merge)", user0, user1, iterations);
+    time_intersection("intersect (gallop)", user2, user0, iterations);
+
+    int k = 10;
+    User *suggested[10];
+    unsigned int mutual_counts[10];
+    int suggest_iterations = iterations / 10 + 1;
+    double start = now();
+    for (int i = 0; i < suggest_iterations; i++) {
+        suggest_friends(user0, &table, k, suggested, mutual_counts);
+    }
+    double elapsed = now() - start;
+    printf("%-28s %6d friends of friends:     %10.3f ms/op (top: %s, %u mutual)\n",
+           "suggest (top 10)", num_friends, elapsed / suggest_iterations * 1e3,
+           suggested[0]->name, mutual_counts[0]);
+    return 0;
+}
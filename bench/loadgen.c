@@ -0,0 +1,696 @@
+/*
+ * Load generator for friend_server.
+ *
+ * Opens a number of connections, logs each one in as its own user and
+ * befriends it with the next few users, then keeps `depth` commands in
+ * flight per connection, writing each batch of commands with a single
+ * write(). Commands are drawn at random from a configurable mix of
+ * profile, list_users, make_friends, post and quit. Reports the number of
+ * commands per second the server completed and the p50/p99/p999 latency
+ * of each kind of command, measured from the write of its batch to the
+ * end of its reply.
+ *
+ * The replies to profile and list_users end with a '\0' byte, as do error
+ * replies. make_friends and post do not always reply, so each of them is
+ * followed by a line the server rejects, and the command is complete once
+ * the "Incorrect syntax" error for that line arrives. quit completes when
+ * the server closes the connection, which is then logged in again; the
+ * time that takes is reported as login.
+ *
+ * With -S, the server at the given path is started in a temporary
+ * directory for the run, with any arguments after "--", and stopped
+ * afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef PORT
+  #define PORT 50700
+#endif
+
+#define READ_BUFFER_SIZE 65536
+#define MAX_NAME 32
+#define SETUP_FRIENDS 8         // users each connection befriends before the run
+#define POST_MESSAGE "a post from the load generator"
+#define SENTINEL "?\r\n"        // rejected by the server, see above
+#define SENTINEL_REPLY "Incorrect syntax\r\n"
+#define TAIL_SIZE 32            // bytes of the current reply kept to match it
+#define SERVER_START_TIMEOUT 10 // seconds to wait for a started server
+
+enum {PROFILE, LIST_USERS, MAKE_FRIENDS, POST, QUIT, NUM_COMMANDS, LOGIN = NUM_COMMANDS};
+
+const char *command_names[] = {"profile", "list_users", "make_friends", "post", "quit", "login"};
+
+typedef struct conn {
+    int fd;
+    int index;
+    char name[MAX_NAME];
+    unsigned int seed;
+    int *pending;       // commands of the current batch, in order
+    int head;           // first command of the batch not yet complete
+    int count;          // commands in the current batch
+    double sent_at;     // when the current batch was written
+    char tail[TAIL_SIZE];   // the end of the reply being read
+    int tail_len;
+} Conn;
+
+// latencies of one kind of command, in microseconds
+typedef struct samples {
+    float *us;
+    long count;
+    long capacity;
+} Samples;
+
+Samples samples[NUM_COMMANDS + 1];
+int mix[NUM_COMMANDS] = {50, 10, 10, 29, 1};
+int num_conns = 16;
+int depth = 1;
+long dropped;
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Record a latency of the given kind of command.
+ */
+void record(int command, double seconds) {
+    Samples *s = &samples[command];
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity == 0 ? 4096 : 2 * s->capacity;
+        s->us = realloc(s->us, s->capacity * sizeof(float));
+        if (s->us == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->us[s->count++] = seconds * 1e6;
+}
+
+
+/*
+ * Write all len bytes of buf to fd, or exit.
+ */
+void write_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int num = write(fd, buf, len);
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        buf += num;
+        len -= num;
+    }
+}
+
+
+/*
+ * Read from fd until the line ending in "commands>\r\n" has arrived, which
+ * is the end of the login handshake.
+ */
+void wait_for_prompt(int fd) {
+    char buf[READ_BUFFER_SIZE];
+    int inbuf = 0;
+    while (1) {
+        int num = read(fd, buf + inbuf, sizeof(buf) - inbuf - 1);
+        if (num <= 0) {
+            perror("read");
+            exit(1);
+        }
+        inbuf += num;
+        buf[inbuf] = '\0';
+        if (strstr(buf, "commands>\r\n") != NULL) {
+            return;
+        }
+    }
+}
+
+
+/*
+ * Connect to host:port. Return the socket, or -1 if the connection was
+ * refused.
+ */
+int connect_to(const char *host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", host);
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+        if (errno == ECONNREFUSED) {
+            close(fd);
+            return -1;
+        }
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+
+/*
+ * Connect to host:port and log in as name.
+ */
+int connect_and_login(const char *host, int port, const char *name) {
+    int fd = connect_to(host, port);
+    if (fd == -1) {
+        fprintf(stderr, "connection to %s:%d refused\n", host, port);
+        exit(1);
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    char line[MAX_NAME + 2];
+    int len = snprintf(line, sizeof(line), "%s\r\n", name);
+    write_all(fd, line, len);
+    wait_for_prompt(fd);
+    return fd;
+}
+
+
+/*
+ * Append len bytes of a reply to the end of it kept in conn->tail.
+ */
+void append_tail(Conn *conn, const char *bytes, int len) {
+    if (len >= TAIL_SIZE) {
+        memcpy(conn->tail, bytes + len - TAIL_SIZE, TAIL_SIZE);
+        conn->tail_len = TAIL_SIZE;
+        return;
+    }
+    int keep = conn->tail_len < TAIL_SIZE - len ? conn->tail_len : TAIL_SIZE - len;
+    memmove(conn->tail, conn->tail + conn->tail_len - keep, keep);
+    memcpy(conn->tail + keep, bytes, len);
+    conn->tail_len = keep + len;
+}
+
+
+/*
+ * Return whether the reply kept in conn->tail is the error for SENTINEL.
+ */
+int is_sentinel_reply(const Conn *conn) {
+    int len = strlen(SENTINEL_REPLY);
+    return conn->tail_len >= len &&
+        memcmp(conn->tail + conn->tail_len - len, SENTINEL_REPLY, len) == 0;
+}
+
+
+/*
+ * Return a random kind of command drawn from the mix.
+ */
+int pick_command(Conn *conn) {
+    int total = 0;
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        total += mix[i];
+    }
+    int r = rand_r(&conn->seed) % total;
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        if (r < mix[i]) {
+            return i;
+        }
+        r -= mix[i];
+    }
+    return PROFILE;
+}
+
+
+/*
+ * Send the next batch of depth commands on conn. A quit ends the batch
+ * early.
+ */
+void send_batch(Conn *conn) {
+    char batch[depth * (2 * MAX_NAME + sizeof(POST_MESSAGE) + sizeof(SENTINEL) + 16)];
+    int len = 0;
+    conn->count = 0;
+    while (conn->count < depth) {
+        int command = pick_command(conn);
+        int other = rand_r(&conn->seed) % num_conns;
+        int friend = (conn->index + 1 + rand_r(&conn->seed) % SETUP_FRIENDS) % num_conns;
+        switch (command) {
+            case PROFILE:
+                len += sprintf(batch + len, "profile loadgen%d\r\n", other);
+                break;
+            case LIST_USERS:
+                len += sprintf(batch + len, "list_users\r\n");
+                break;
+            case MAKE_FRIENDS:
+                len += sprintf(batch + len, "make_friends loadgen%d\r\n" SENTINEL, other);
+                break;
+            case POST:
+                len += sprintf(batch + len, "post loadgen%d " POST_MESSAGE "\r\n" SENTINEL, friend);
+                break;
+            case QUIT:
+                len += sprintf(batch + len, "quit\r\n");
+                break;
+        }
+        conn->pending[conn->count++] = command;
+        if (command == QUIT) {
+            break;
+        }
+    }
+    conn->head = 0;
+    conn->tail_len = 0;
+    conn->sent_at = now();
+    write_all(conn->fd, batch, len);
+}
+
+
+/*
+ * Handle the end of a reply on conn. Return whether it completed the
+ * command at the head of the batch.
+ */
+int reply_arrived(Conn *conn, double at) {
+    int command = conn->pending[conn->head];
+    int sentinel = is_sentinel_reply(conn);
+    conn->tail_len = 0;
+    if ((command == MAKE_FRIENDS || command == POST) && !sentinel) {
+        // the command's own error; it completes with the sentinel's
+        return 0;
+    }
+    record(command, at - conn->sent_at);
+    conn->head++;
+    return 1;
+}
+
+
+/*
+ * Handle the bytes read from conn, sending the next batch once every
+ * command of the current one has completed.
+ */
+void handle_input(Conn *conn, const char *buf, int len) {
+    double at = now();
+    while (len > 0) {
+        const char *end = memchr(buf, '\0', len);
+        if (end == NULL) {
+            append_tail(conn, buf, len);
+            return;
+        }
+        append_tail(conn, buf, end - buf);
+        len -= end - buf + 1;
+        buf = end + 1;
+        if (conn->head < conn->count && reply_arrived(conn, at) && conn->head == conn->count) {
+            send_batch(conn);
+        }
+    }
+}
+
+
+/*
+ * Handle the server closing conn, which completes a quit at the end of the
+ * batch. Any commands before it whose replies were lost are dropped. Log in
+ * again and send the next batch.
+ */
+void connection_closed(Conn *conn, const char *host, int port) {
+    if (conn->count == 0 || conn->pending[conn->count - 1] != QUIT) {
+        fprintf(stderr, "connection %d closed by server\n", conn->index);
+        exit(1);
+    }
+    double at = now();
+    record(QUIT, at - conn->sent_at);
+    dropped += conn->count - 1 - conn->head;
+    close(conn->fd);
+
+    conn->fd = connect_and_login(host, port, conn->name);
+    record(LOGIN, now() - at);
+    send_batch(conn);
+}
+
+
+/*
+ * Befriend every connection's user with the next SETUP_FRIENDS users, so
+ * that posts to them succeed, and wait for every reply.
+ */
+void befriend_neighbours(Conn *conns) {
+    char buf[READ_BUFFER_SIZE];
+    for (int i = 0; i < num_conns; i++) {
+        Conn *conn = &conns[i];
+        for (int j = 1; j <= SETUP_FRIENDS; j++) {
+            char line[2 * MAX_NAME + sizeof(SENTINEL)];
+            int len = snprintf(line, sizeof(line), "make_friends loadgen%d\r\n" SENTINEL,
+                               (i + j) % num_conns);
+            write_all(conn->fd, line, len);
+        }
+
+        int left = SETUP_FRIENDS;
+        conn->tail_len = 0;
+        while (left > 0) {
+            int num = read(conn->fd, buf, sizeof(buf));
+            if (num <= 0) {
+                perror("read");
+                exit(1);
+            }
+            for (int j = 0; j < num; j++) {
+                if (buf[j] != '\0') {
+                    append_tail(conn, buf + j, 1);
+                } else {
+                    left -= is_sentinel_reply(conn);
+                    conn->tail_len = 0;
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Start the server at path on port, with args, in a new temporary
+ * directory that is returned in dir. Return its pid once it accepts
+ * connections.
+ */
+pid_t start_server(const char *path, char **args, int num_args, int port, char *dir) {
+    char server[PATH_MAX];
+    if (realpath(path, server) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    int fd = connect_to("127.0.0.1", port);
+    if (fd != -1) {
+        fprintf(stderr, "a server is already listening on port %d\n", port);
+        exit(1);
+    }
+    strcpy(dir, "/tmp/loadgen.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        char *argv[num_args + 2];
+        argv[0] = server;
+        memcpy(argv + 1, args, num_args * sizeof(char *));
+        argv[num_args + 1] = NULL;
+        if (chdir(dir) == -1) {
+            perror("chdir");
+            exit(1);
+        }
+        execv(server, argv);
+        perror("execv");
+        exit(1);
+    }
+
+    double deadline = now() + SERVER_START_TIMEOUT;
+    while ((fd = connect_to("127.0.0.1", port)) == -1) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "server exited during startup\n");
+            exit(1);
+        }
+        if (now() > deadline) {
+            fprintf(stderr, "server did not start listening on port %d\n", port);
+            kill(pid, SIGKILL);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    close(fd);
+    return pid;
+}
+
+
+/*
+ * Stop the server started by start_server and delete its directory.
+ */
+void stop_server(pid_t pid, const char *dir) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return;
+    }
+    struct dirent *entry;
+    char path[PATH_MAX];
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+
+/*
+ * Compare two latencies for qsort.
+ */
+int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Return the p'th quantile of n sorted latencies.
+ */
+float quantile(const float *sorted, long n, double p) {
+    long i = (long)(p * n + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+
+/*
+ * Sort the latencies in s and print a line of their count and quantiles.
+ */
+void print_latencies(const char *label, Samples *s, double elapsed) {
+    if (s->count == 0) {
+        return;
+    }
+    qsort(s->us, s->count, sizeof(float), compare_floats);
+    printf("%-13s %10ld %10.0f %9.0f %9.0f %9.0f\n", label, s->count, s->count / elapsed,
+           quantile(s->us, s->count, 0.5), quantile(s->us, s->count, 0.99),
+           quantile(s->us, s->count, 0.999));
+}
+
+
+/*
+ * Parse a mix such as "profile=50,post=50" into the mix weights. Kinds of
+ * command left out are not sent. Return -1 if it is malformed.
+ */
+int parse_mix(char *arg) {
+    int weights[NUM_COMMANDS] = {0};
+    int total = 0;
+    for (char *item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        if (eq == NULL) {
+            return -1;
+        }
+        *eq = '\0';
+        int command = 0;
+        while (command < NUM_COMMANDS && strcmp(item, command_names[command]) != 0) {
+            command++;
+        }
+        char *end;
+        long weight = strtol(eq + 1, &end, 10);
+        if (command == NUM_COMMANDS || *end != '\0' || weight < 0 || weight > 1000000) {
+            return -1;
+        }
+        weights[command] = weight;
+        total += weight;
+    }
+    if (total == 0) {
+        return -1;
+    }
+    memcpy(mix, weights, sizeof(mix));
+    return 0;
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] "
+            "[-d pipeline_depth] [-t seconds] [-m command=weight,...] "
+            "[-S server [-- server_args]]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int port = PORT;
+    double seconds = 5;
+    char *server = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:t:m:S:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                num_conns = strtol(optarg, NULL, 10);
+                break;
+            case 'd':
+                depth = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'm':
+                if (parse_mix(optarg) == -1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'S':
+                server = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_conns <= 0 || depth <= 0 || seconds <= 0 || (optind < argc && server == NULL)) {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server_pid = 0;
+    char server_dir[PATH_MAX];
+    if (server != NULL) {
+        host = "127.0.0.1";
+        server_pid = start_server(server, argv + optind, argc - optind, port, server_dir);
+    }
+
+    Conn *conns = malloc(num_conns * sizeof(Conn));
+    struct pollfd *fds = malloc(num_conns * sizeof(struct pollfd));
+    if (conns == NULL || fds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < num_conns; i++) {
+        conns[i].index = i;
+        conns[i].seed = i + 1;
+        snprintf(conns[i].name, MAX_NAME, "loadgen%d", i);
+        conns[i].fd = connect_and_login(host, port, conns[i].name);
+        conns[i].pending = malloc(depth * sizeof(int));
+        if (conns[i].pending == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        conns[i].count = 0;
+    }
+    befriend_neighbours(conns);
+
+    double start = now();
+    double end = start + seconds;
+    for (int i = 0; i < num_conns; i++) {
+        send_batch(&conns[i]);
+    }
+
+    char buf[READ_BUFFER_SIZE];
+    while (now() < end) {
+        for (int i = 0; i < num_conns; i++) {
+            fds[i].fd = conns[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, num_conns, 100) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+
+        for (int i = 0; i < num_conns; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+                continue;
+            }
+            int num = read(conns[i].fd, buf, sizeof(buf));
+            if (num <= 0) {
+                connection_closed(&conns[i], host, port);
+            } else {
+                handle_input(&conns[i], buf, num);
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    for (int i = 0; i < num_conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].pending);
+    }
+    if (server_pid != 0) {
+        stop_server(server_pid, server_dir);
+    }
+
+    // every command together, login excepted
+    Samples all = {NULL, 0, 0};
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        all.count += samples[i].count;
+    }
+    // room for at least one, since malloc(0) may return NULL
+    all.us = malloc((all.count > 0 ? all.count : 1) * sizeof(float));
+    if (all.us == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long n = 0;
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        if (samples[i].count > 0) {
+            memcpy(all.us + n, samples[i].us, samples[i].count * sizeof(float));
+            n += samples[i].count;
+        }
+    }
+
+    printf("connections: %d  depth: %d  commands: %ld  seconds: %.2f\n",
+           num_conns, depth, all.count, elapsed);
+    printf("commands/sec: %.0f\n", all.count / elapsed);
+    if (dropped > 0) {
+        printf("replies lost to quit: %ld\n", dropped);
+    }
+    printf("%-13s %10s %10s %9s %9s %9s\n", "command", "count", "per_sec",
+           "p50_us", "p99_us", "p999_us");
+    for (int i = 0; i <= NUM_COMMANDS; i++) {
+        print_latencies(command_names[i], &samples[i], elapsed);
+    }
+    print_latencies("all", &all, elapsed);
+
+    free(conns);
+    free(fds);
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Throughput benchmark for sending large profiles to a socket.
+ *
+ * Builds a user with many friends and a full first page of long posts,
+ * then sends the first page of their profile over a Unix socket pair as
+ * fast as a drain thread reads it from the other end, three ways:
+ *
+ *   print_user   render into a freshly allocated string, write() it and
+ *                free it (how the server used to reply)
+ *   copy         copy the cached rendering into a reused buffer and
+ *                write() that (how replies are queued in the output ring)
+ *   gather       sendmsg() straight from the cached rendering, with one
+ *                iovec per section and no copy in user space (how the
+ *                server sends the first page of a large profile)
+ *
+ * Reports bytes/sec and profiles/sec for each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../friends.h"
+
+#define DRAIN_BUFFER_SIZE (1 << 20)
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Write all len bytes of buf to fd.
+ */
+void write_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int num = write(fd, buf, len);
+        if (num == -1) {
+            perror("write");
+            exit(1);
+        }
+        buf += num;
+        len -= num;
+    }
+}
+
+
+/*
+ * Send all the bytes of iovcnt entries of iov to fd with sendmsg().
+ */
+void send_all(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        int num = sendmsg(fd, &msg, 0);
+        if (num == -1) {
+            perror("sendmsg");
+            exit(1);
+        }
+        // skip what was sent
+        while (msg.msg_iovlen > 0 && num >= msg.msg_iov->iov_len) {
+            num -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + num;
+            msg.msg_iov->iov_len -= num;
+        }
+    }
+}
+
+
+/*
+ * Read from the socket in arg until the other end is closed.
+ */
+void *drain(void *arg) {
+    int fd = (long)arg;
+    char *buf = malloc(DRAIN_BUFFER_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while (read(fd, buf, DRAIN_BUFFER_SIZE) > 0) {
+    }
+    free(buf);
+    return NULL;
+}
+
+
+// where copy_bytes appends next
+char *copy_end;
+
+
+/*
+ * Emitter that appends bytes at copy_end, in a buffer known to be large
+ * enough.
+ */
+void copy_bytes(void *context, const char *bytes, int len) {
+    memcpy(copy_end, bytes, len);
+    copy_end += len;
+}
+
+
+/*
+ * Send user's profile for the given number of seconds in the given way,
+ * and print the throughput.
+ */
+void run(const char *method, User *user, UserTable *table, double seconds) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain, (void *)(long)fds[1]);
+
+    char *copy = malloc(DRAIN_BUFFER_SIZE);
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    long profiles = 0;
+    long bytes = 0;
+    double start = now();
+    double elapsed;
+    do {
+        for (int i = 0; i < 64; i++) {
+            if (strcmp(method, "print_user") == 0) {
+                char *profile = print_user(user);
+                int len = strlen(profile);
+                write_all(fds[0], profile, len);
+                free(profile);
+                bytes += len;
+            } else if (strcmp(method, "copy") == 0) {
+                copy_end = copy;
+                render_cached_profile(user, table, copy_bytes, NULL);
+                write_all(fds[0], copy, copy_end - copy);
+                bytes += copy_end - copy;
+            } else {
+                Rendering *sections[PROFILE_SECTIONS];
+                struct iovec iov[PROFILE_SECTIONS];
+                acquire_cached_profile(user, table, sections);
+                for (int j = 0; j < PROFILE_SECTIONS; j++) {
+                    iov[j].iov_base = sections[j]->data;
+                    iov[j].iov_len = sections[j]->len;
+                    bytes += sections[j]->len;
+                }
+                send_all(fds[0], iov, PROFILE_SECTIONS);
+                for (int j = 0; j < PROFILE_SECTIONS; j++) {
+                    release_rendering(sections[j]);
+                }
+            }
+        }
+        profiles += 64;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    close(fds[0]);
+    pthread_join(drainer, NULL);
+    close(fds[1]);
+    free(copy);
+    printf("%-10s  %10.1f MB/s  %10.0f profiles/sec\n", method, bytes / elapsed / 1e6,
+           profiles / elapsed);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-f friends] [-s post_size] [-t seconds]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int num_friends = 500;
+    int post_size = 4000;
+    double seconds = 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:t:")) != -1) {
+        switch (opt) {
+            case 'f':
+                num_friends = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                post_size = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_friends < 1 || post_size < 1 || seconds <= 0) {
+        usage(argv[0]);
+    }
+
+    UserTable table;
+    init_user_table(&table);
+    create_user("star", &table);
+    User *star = find_user("star", &table);
+    for (int i = 0; i < num_friends; i++) {
+        char name[MAX_NAME];
+        snprintf(name, MAX_NAME, "fan%d", i);
+        create_user(name, &table);
+        make_friends("star", name, &table);
+    }
+
+    // exactly a first page of posts, so print_user sends the same bytes
+    char *contents = malloc(post_size + 1);
+    if (contents == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(contents, 'x', post_size);
+    contents[post_size] = '\0';
+    for (int i = 0; i < PROFILE_PAGE_SIZE; i++) {
+        make_post(star->friends[i % star->num_friends], star, contents, &table);
+    }
+
+    char *profile = print_user(star);
+    printf("%d friends, %d posts of %d bytes: %zu byte profile\n",
+           num_friends, PROFILE_PAGE_SIZE, post_size, strlen(profile));
+    free(profile);
+
+    run("print_user", star, &table, seconds);
+    run("copy", star, &table, seconds);
+    run("gather", star, &table, seconds);
+    return 0;
+}
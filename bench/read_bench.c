@@ -0,0 +1,240 @@
+/*
+ * Read throughput benchmark for the lock-free read path.
+ *
+ * Reader threads look users up by name and render the first page of their
+ * profiles (the work behind profile, served by the server's reader
+ * threads), while a single writer thread makes posts and friendships, as
+ * a user's owning shard would. The writer is paced so that writes are 5%
+ * of all operations. Each run is repeated with 1, 2, ... -r readers, once
+ * with readers using epoch-based reclamation and no locks, and once with
+ * every operation taking a pthread rwlock instead, for comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../friends.h"
+#include "../epoch.h"
+
+#define WRITE_PERCENT 5
+#define OPS_PER_CHECK 64    // operations between looks at the clock and
+                            // between epoch_enter/epoch_exit pairs
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+UserTable table;
+char (*names)[MAX_NAME];
+int num_users;
+int use_lock;
+pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+int running;
+long reads_done[64];
+long writes_done;
+
+
+/*
+ * Emitter that only counts bytes.
+ */
+void count_bytes(void *context, const char *bytes, int len) {
+    *(long *)context += len;
+}
+
+
+/*
+ * Render profiles of random users until running is cleared.
+ */
+void *reader(void *arg) {
+    int id = (long)arg;
+    unsigned int seed = id + 1;
+    long bytes = 0;
+    long reads = 0;
+    epoch_register();
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        if (use_lock) {
+            for (int i = 0; i < OPS_PER_CHECK; i++) {
+                pthread_rwlock_rdlock(&lock);
+                User *user = find_user(names[rand_r(&seed) % num_users], &table);
+                render_cached_profile(user, &table, count_bytes, &bytes);
+                pthread_rwlock_unlock(&lock);
+            }
+        } else {
+            epoch_enter();
+            for (int i = 0; i < OPS_PER_CHECK; i++) {
+                User *user = find_user(names[rand_r(&seed) % num_users], &table);
+                render_cached_profile(user, &table, count_bytes, &bytes);
+            }
+            epoch_exit();
+        }
+        reads += OPS_PER_CHECK;
+        __atomic_store_n(&reads_done[id], reads, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+
+/*
+ * Total reads done so far by num_readers readers.
+ */
+long total_reads(int num_readers) {
+    long total = 0;
+    for (int i = 0; i < num_readers; i++) {
+        total += __atomic_load_n(&reads_done[i], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+
+/*
+ * Make posts and friendships between random users, keeping writes at
+ * WRITE_PERCENT of all operations, until running is cleared.
+ */
+void *writer(void *arg) {
+    int num_readers = (long)arg;
+    unsigned int seed = 12345;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        long reads = total_reads(num_readers);
+        if (writes_done * (100 - WRITE_PERCENT) >= reads * WRITE_PERCENT) {
+            sched_yield();
+            continue;
+        }
+
+        if (use_lock) {
+            pthread_rwlock_wrlock(&lock);
+        }
+        User *author = find_user(names[rand_r(&seed) % num_users], &table);
+        if (rand_r(&seed) % 4 == 0) {
+            make_friends(author->name, names[rand_r(&seed) % num_users], &table);
+        } else if (author->num_friends > 0) {
+            User *target = author->friends[rand_r(&seed) % author->num_friends];
+            make_post(author, target, "a post written during the benchmark", &table);
+        }
+        if (use_lock) {
+            pthread_rwlock_unlock(&lock);
+        }
+        writes_done++;
+        if (writes_done % OPS_PER_CHECK == 0) {
+            epoch_collect();
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Run num_readers readers and the writer for the given number of seconds
+ * and print the throughput.
+ */
+void run(int num_readers, double seconds) {
+    memset(reads_done, 0, sizeof(reads_done));
+    writes_done = 0;
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+
+    pthread_t threads[64];
+    pthread_t writer_thread;
+    double start = now();
+    for (long i = 0; i < num_readers; i++) {
+        pthread_create(&threads[i], NULL, reader, (void *)i);
+    }
+    pthread_create(&writer_thread, NULL, writer, (void *)(long)num_readers);
+    usleep(seconds * 1e6);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(writer_thread, NULL);
+    double elapsed = now() - start;
+
+    long reads = total_reads(num_readers);
+    printf("%-6s readers: %2d  reads/sec: %10.0f  writes/sec: %8.0f\n",
+           use_lock ? "rwlock" : "epoch", num_readers, reads / elapsed, writes_done / elapsed);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-f friends_per_user] [-p posts_per_user] "
+            "[-r max_readers] [-t seconds]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    num_users = 10000;
+    int friends_per_user = 20;
+    int posts_per_user = 20;
+    int max_readers = 4;
+    double seconds = 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:f:p:r:t:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                friends_per_user = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                posts_per_user = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                max_readers = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < 2 || friends_per_user < 0 || posts_per_user < 0 ||
+            max_readers < 1 || max_readers > 64 || seconds <= 0) {
+        usage(argv[0]);
+    }
+
+    init_user_table(&table);
+    names = malloc(num_users * sizeof(*names));
+    if (names == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_users; i++) {
+        snprintf(names[i], MAX_NAME, "user%d", i);
+        create_user(names[i], &table);
+    }
+    srand(1);
+    for (int i = 0; i < num_users; i++) {
+        for (int j = 0; j < friends_per_user / 2; j++) {
+            make_friends(names[i], names[rand() % num_users], &table);
+        }
+    }
+    for (User *user = table.head; user != NULL; user = user->next) {
+        for (int j = 0; j < posts_per_user && user->num_friends > 0; j++) {
+            make_post(user->friends[j % user->num_friends], user, "hello from a friend", &table);
+        }
+    }
+    printf("%d users, about %d friends and %d posts each; %d%% writes\n",
+           num_users, friends_per_user, posts_per_user, WRITE_PERCENT);
+
+    for (use_lock = 0; use_lock <= 1; use_lock++) {
+        for (int num_readers = 1; num_readers <= max_readers; num_readers *= 2) {
+            run(num_readers, seconds);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Latency benchmark for searching posts.
+ *
+ * Makes -p posts (a million by default) of -w words each, drawn from a
+ * vocabulary of -v words with Zipf-distributed frequencies, as in natural
+ * text: a few words are in most posts and most words are rare. Then runs
+ * -q queries of 1, 2 and 3 words, drawn the same way, for the newest 10
+ * posts that have all of them, and reports the p50 and p99 latencies of
+ * each kind with search_posts, and for comparison with a scan of every
+ * post from the newest (fewer queries, as it is much slower).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+
+#define NUM_USERS 1000
+#define RESULTS 10
+#define SCAN_QUERIES 20     // queries per kind answered by scanning
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+// cumulative Zipf probabilities of the words of the vocabulary
+double *zipf_cdf;
+int vocabulary;
+
+
+/*
+ * Return the rank of a word picked at random by its Zipf frequency.
+ */
+int pick_word(unsigned int *seed) {
+    double u = rand_r(seed) / (RAND_MAX + 1.0);
+    int lo = 0;
+    int hi = vocabulary - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/*
+ * Store in word the word of the vocabulary of this rank.
+ */
+void word_of(int rank, char *word) {
+    // letters only, so that next_term keeps it whole
+    int len = 0;
+    do {
+        word[len++] = 'a' + rank % 26;
+        rank /= 26;
+    } while (rank > 0);
+    word[len] = '\0';
+}
+
+
+/*
+ * Order unsigned longs ascending, for qsort.
+ */
+int compare_longs(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Return whether the text has every one of the num_terms terms.
+ */
+int has_terms(const char *text, char terms[][SEARCH_MAX_TERM], int num_terms) {
+    int found = 0;
+    char term[SEARCH_MAX_TERM];
+    unsigned int seen = 0;
+    while (next_term(&text, term)) {
+        for (int i = 0; i < num_terms; i++) {
+            if (!(seen & (1u << i)) && strcmp(term, terms[i]) == 0) {
+                seen |= 1u << i;
+                found++;
+            }
+        }
+    }
+    return found == num_terms;
+}
+
+
+/*
+ * Run num_queries queries of num_terms words, by index or by scanning
+ * every post from the newest, and print the latency percentiles.
+ */
+void run(UserTable *table, int num_terms, int num_queries, int scan) {
+    unsigned long *latencies = malloc(num_queries * sizeof(unsigned long));
+    if (latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int seed = num_terms;
+    long found = 0;
+    for (int q = 0; q < num_queries; q++) {
+        char terms[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM];
+        for (int i = 0; i < num_terms; i++) {
+            word_of(pick_word(&seed), terms[i]);
+        }
+
+        unsigned long start = now_ns();
+        if (scan) {
+            int hits = 0;
+            for (long id = table->num_post_ids - 1; id >= 0 && hits < RESULTS; id--) {
+                if (has_terms(find_post(table, id)->contents, terms, num_terms)) {
+                    hits++;
+                }
+            }
+            found += hits;
+        } else {
+            const Post *hits[RESULTS];
+            found += search_posts(table, terms, num_terms, hits, RESULTS);
+        }
+        latencies[q] = now_ns() - start;
+    }
+
+    qsort(latencies, num_queries, sizeof(unsigned long), compare_longs);
+    printf("%-6s %d word%s  p50 %10.1f us  p99 %10.1f us  %5.2f hits/query\n",
+           scan ? "scan" : "index", num_terms, num_terms == 1 ? " " : "s",
+           latencies[num_queries / 2] / 1e3, latencies[num_queries * 99 / 100] / 1e3,
+           (double)found / num_queries);
+    free(latencies);
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-p posts] [-w words_per_post] [-v vocabulary] [-q queries]\n",
+            prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    long num_posts = 1000000;
+    int words_per_post = 12;
+    int num_queries = 10000;
+    vocabulary = 50000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:v:q:")) != -1) {
+        switch (opt) {
+            case 'p':
+                num_posts = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                words_per_post = strtol(optarg, NULL, 10);
+                break;
+            case 'v':
+                vocabulary = strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                num_queries = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_posts < 1 || words_per_post < 1 || vocabulary < 1 || num_queries < 1) {
+        usage(argv[0]);
+    }
+
+    zipf_cdf = malloc(vocabulary * sizeof(double));
+    if (zipf_cdf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    double total = 0;
+    for (int i = 0; i < vocabulary; i++) {
+        total += 1.0 / (i + 1);
+        zipf_cdf[i] = total;
+    }
+    for (int i = 0; i < vocabulary; i++) {
+        zipf_cdf[i] /= total;
+    }
+
+    // a ring of friends, each posting to the next
+    UserTable table;
+    init_user_table(&table);
+    User *users[NUM_USERS];
+    for (int i = 0; i < NUM_USERS; i++) {
+        char name[MAX_NAME];
+        snprintf(name, MAX_NAME, "user%d", i);
+        create_user(name, &table);
+        users[i] = find_user(name, &table);
+    }
+    for (int i = 0; i < NUM_USERS; i++) {
+        make_friends(users[i]->name, users[(i + 1) % NUM_USERS]->name, &table);
+    }
+
+    unsigned long start = now_ns();
+    unsigned int seed = 1;
+    char *contents = malloc(words_per_post * 8);
+    if (contents == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (long p = 0; p < num_posts; p++) {
+        char *end = contents;
+        for (int i = 0; i < words_per_post; i++) {
+            if (i > 0) {
+                *end++ = ' ';
+            }
+            word_of(pick_word(&seed), end);
+            end += strlen(end);
+        }
+        make_post(users[p % NUM_USERS], users[(p + 1) % NUM_USERS], contents, &table);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%ld posts of %d words from %d: %.0f posts/sec, %u terms, %lu postings, "
+           "%.1f MB of index\n", num_posts, words_per_post, vocabulary, num_posts / elapsed,
+           table.search.num_terms, table.search.postings, table.search.bytes / 1e6);
+
+    for (int num_terms = 1; num_terms <= 3; num_terms++) {
+        run(&table, num_terms, num_queries, 0);
+    }
+    for (int num_terms = 1; num_terms <= 3; num_terms++) {
+        run(&table, num_terms, SCAN_QUERIES, 1);
+    }
+    free(contents);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Startup benchmark for snapshots.
+ *
+ * Builds a large table of users, friendships and posts, logging every
+ * change as the server would, then writes a snapshot of it. Reports how
+ * long starting from the snapshot takes against replaying the same
+ * changes from the write-ahead log.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+#include "../wal.h"
+#include "../snapshot.h"
+
+#define FRIENDS_PER_USER 10
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-p posts]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int num_users = 100000;
+    long num_posts = 5000000;
+    char *wal_path = "snapshot_bench.wal";
+    char *snapshot_path = "snapshot_bench.snap";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:p:")) != -1) {
+        switch (opt) {
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                num_posts = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (num_users < FRIENDS_PER_USER + 1 || num_posts < 0) {
+        usage(argv[0]);
+    }
+
+    unlink(wal_path);
+    Wal wal;
+    wal_open(&wal, wal_path, 0, WAL_SYNC_NEVER, WAL_DEFAULT_SYNC_INTERVAL);
+
+    // users, each befriending the next FRIENDS_PER_USER / 2 around a ring,
+    // then posts between random friends
+    UserTable table;
+    init_user_table(&table);
+    char name[MAX_NAME];
+    char friend_name[MAX_NAME];
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        create_user(name, &table);
+        wal_log_user(&wal, name);
+    }
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        for (int j = 1; j <= FRIENDS_PER_USER / 2; j++) {
+            snprintf(friend_name, sizeof(friend_name), "user%d", (i + j) % num_users);
+            make_friends(name, friend_name, &table);
+            wal_log_friends(&wal, name, friend_name);
+        }
+        if (wal.len >= WAL_BUFFER_SIZE) {
+            wal_commit(&wal);
+        }
+    }
+    srand(1);
+    char contents[64];
+    for (long i = 0; i < num_posts; i++) {
+        snprintf(name, sizeof(name), "user%d", rand() % num_users);
+        User *author = find_user(name, &table);
+        User *target = author->friends[rand() % author->num_friends];
+        snprintf(contents, sizeof(contents), "post number %ld", i);
+        make_post(author, target, contents, &table);
+        wal_log_post(&wal, author->name, target->name, target->first_post->date, contents);
+        if (wal.len >= WAL_BUFFER_SIZE) {
+            wal_commit(&wal);
+        }
+    }
+    wal_commit(&wal);
+
+    double start = now();
+    if (snapshot_write(snapshot_path, &table, 1) == -1) {
+        perror("snapshot_write");
+        exit(1);
+    }
+    double write_time = now() - start;
+    printf("wrote a snapshot of %d users and %ld posts in %.2f s\n",
+           num_users, num_posts, write_time);
+
+    UserTable from_snapshot;
+    init_user_table(&from_snapshot);
+    unsigned long generation;
+    start = now();
+    Snapshot snapshot;
+    if (snapshot_open(snapshot_path, &snapshot) == -1) {
+        perror("snapshot_open");
+        exit(1);
+    }
+    long loaded = snapshot_load_users(&snapshot, &from_snapshot);
+    User **users_by_id = calloc(loaded + 1, sizeof(User *));
+    if (users_by_id == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (User *user = from_snapshot.head; user != NULL; user = user->next) {
+        users_by_id[user->id] = user;
+    }
+    snapshot_load_links(&snapshot, &from_snapshot, users_by_id, loaded);
+    free(users_by_id);
+    double load_time = now() - start;
+    printf("snapshot startup: %ld users in %.3f s\n", loaded, load_time);
+
+    UserTable from_wal;
+    init_user_table(&from_wal);
+    start = now();
+    long recovered = wal_replay(wal_path, WAL_REPLAY_USERS, &from_wal, 1, &generation);
+    recovered += wal_replay(wal_path, WAL_REPLAY_CHANGES, &from_wal, 1, &generation);
+    double replay_time = now() - start;
+    printf("log startup: %ld records in %.3f s (%.1fx the snapshot)\n",
+           recovered, replay_time, replay_time / load_time);
+
+    unlink(snapshot_path);
+    unlink(wal_path);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Recovery benchmark for the write-ahead log.
+ *
+ * Writes a log of users, friendships and posts through the wal API (by
+ * default 10 million records), then replays it into an empty table and
+ * reports the recovery time and records/sec. Records are generated
+ * directly, so the log is consistent: every friendship is between
+ * existing users and every post is between friends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../friends.h"
+#include "../wal.h"
+
+#define FRIENDS_PER_USER 10
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n records] [-u users] [-l wal_path]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    long num_records = 10000000;
+    int num_users = 100000;
+    char *path = "wal_bench.wal";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:l:")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_records = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                num_users = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    long setup = (long)num_users * (1 + FRIENDS_PER_USER / 2);
+    if (num_users < FRIENDS_PER_USER + 1 || num_records < setup) {
+        fprintf(stderr, "need at least %ld records for %d users\n", setup, num_users);
+        usage(argv[0]);
+    }
+
+    unlink(path);
+    Wal wal;
+    wal_open(&wal, path, 0, WAL_SYNC_NEVER, WAL_DEFAULT_SYNC_INTERVAL);
+
+    // users, then each befriending the next FRIENDS_PER_USER / 2 around a
+    // ring, then posts to those friends for the remaining records
+    double start = now();
+    char name[MAX_NAME];
+    char friend_name[MAX_NAME];
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        wal_log_user(&wal, name);
+    }
+    for (int i = 0; i < num_users; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        for (int j = 1; j <= FRIENDS_PER_USER / 2; j++) {
+            snprintf(friend_name, sizeof(friend_name), "user%d", (i + j) % num_users);
+            wal_log_friends(&wal, name, friend_name);
+        }
+        if (wal.len >= WAL_BUFFER_SIZE) {
+            wal_commit(&wal);
+        }
+    }
+    srand(1);
+    time_t date = time(NULL);
+    char contents[64];
+    for (long i = setup; i < num_records; i++) {
+        int author = rand() % num_users;
+        snprintf(name, sizeof(name), "user%d", author);
+        snprintf(friend_name, sizeof(friend_name), "user%d",
+                 (author + 1 + rand() % (FRIENDS_PER_USER / 2)) % num_users);
+        snprintf(contents, sizeof(contents), "post number %ld", i);
+        wal_log_post(&wal, name, friend_name, date, contents);
+        if (wal.len >= WAL_BUFFER_SIZE) {
+            wal_commit(&wal);
+        }
+    }
+    wal_commit(&wal);
+    double write_time = now() - start;
+    printf("wrote %ld records (%.1f MB) in %.2f s\n",
+           wal.records, wal.bytes / 1e6, write_time);
+
+    UserTable table;
+    init_user_table(&table);
+    start = now();
+    unsigned long generation;
+    long recovered = wal_replay(path, WAL_REPLAY_USERS, &table, 1, &generation);
+    recovered += wal_replay(path, WAL_REPLAY_CHANGES, &table, 1, &generation);
+    double replay_time = now() - start;
+    printf("recovered %ld records in %.2f s: %.0f records/sec\n",
+           recovered, replay_time, recovered / replay_time);
+
+    unlink(path);
+    return recovered == num_records ? 0 : 1;
+}
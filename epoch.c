@@ -0,0 +1,153 @@
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// the epoch a registered reader entered its traversal in, or 0 between
+// traversals; padded so readers do not share cache lines
+typedef struct reader_slot {
+    unsigned long epoch;
+    char padding[64 - sizeof(unsigned long)];
+} ReaderSlot;
+
+// memory retired by a thread, oldest first
+typedef struct retired {
+    void *ptr;
+    void (*destroy)(void *);
+    unsigned long epoch;
+    struct retired *next;
+} Retired;
+
+static unsigned long global_epoch = 1;
+static ReaderSlot reader_slots[EPOCH_MAX_READERS];
+static int num_readers;
+
+static __thread ReaderSlot *my_slot;
+static __thread Retired *retired_head;
+static __thread Retired *retired_tail;
+static __thread long retired_count;
+
+
+/*
+ * Register the calling thread as a reader. Called once per reader thread,
+ * before its first epoch_enter.
+ */
+void epoch_register(void) {
+    int index = __atomic_fetch_add(&num_readers, 1, __ATOMIC_ACQ_REL);
+    if (index >= EPOCH_MAX_READERS) {
+        fprintf(stderr, "epoch: more than %d reader threads\n", EPOCH_MAX_READERS);
+        exit(1);
+    }
+    my_slot = &reader_slots[index];
+}
+
+
+/*
+ * Begin a traversal of shared data from a registered reader thread.
+ */
+void epoch_enter(void) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&my_slot->epoch, epoch, __ATOMIC_SEQ_CST);
+    // the announcement must be visible before anything shared is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * End the traversal begun by epoch_enter. Nothing read during it may be
+ * used afterwards.
+ */
+void epoch_exit(void) {
+    __atomic_store_n(&my_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Free ptr with destroy once no reader can still reach it. Only called by
+ * the writer that unlinked ptr; each thread keeps its own retired list.
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (__atomic_load_n(&num_readers, __ATOMIC_ACQUIRE) == 0) {
+        destroy(ptr);
+        return;
+    }
+
+    Retired *node = malloc(sizeof(Retired));
+    if (node == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    node->ptr = ptr;
+    node->destroy = destroy;
+    node->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    node->next = NULL;
+    if (retired_tail == NULL) {
+        retired_head = node;
+    } else {
+        retired_tail->next = node;
+    }
+    retired_tail = node;
+    retired_count++;
+}
+
+
+/*
+ * Advance the global epoch if every reader inside a traversal entered it
+ * in the current one.
+ */
+static void try_advance(void) {
+    // pairs with the fence in epoch_enter: either the reader's slot is
+    // seen here, or the reader sees what was unlinked before this point
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    int n = __atomic_load_n(&num_readers, __ATOMIC_ACQUIRE);
+    if (n > EPOCH_MAX_READERS) {
+        n = EPOCH_MAX_READERS;
+    }
+    for (int i = 0; i < n; i++) {
+        // acquire, so that a reader's traversals before the epoch it is in
+        // now happen before anything they read is freed
+        unsigned long reader_epoch = __atomic_load_n(&reader_slots[i].epoch, __ATOMIC_ACQUIRE);
+        if (reader_epoch != 0 && reader_epoch != epoch) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Try to advance the global epoch, and free whatever the calling thread
+ * retired that is no longer reachable. Writers call this regularly.
+ */
+void epoch_collect(void) {
+    if (retired_head == NULL) {
+        return;
+    }
+    try_advance();
+
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    while (retired_head != NULL && retired_head->epoch + 2 <= epoch) {
+        Retired *node = retired_head;
+        retired_head = node->next;
+        node->destroy(node->ptr);
+        free(node);
+        retired_count--;
+    }
+    if (retired_head == NULL) {
+        retired_tail = NULL;
+    }
+}
+
+
+/*
+ * Return the number of objects the calling thread retired and has not
+ * freed yet.
+ */
+long epoch_pending(void) {
+    return retired_count;
+}
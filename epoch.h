@@ -0,0 +1,62 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#define EPOCH_MAX_READERS 256    // Reader threads that can be registered
+
+/*
+ * Epoch-based reclamation, for data that reader threads traverse without
+ * locks while its single writer replaces parts of it.
+ *
+ * A writer publishes a new version of a structure with an atomic store and
+ * hands the old one to epoch_retire instead of freeing it. Readers bracket
+ * every traversal with epoch_enter and epoch_exit. The global epoch only
+ * advances once every reader inside a traversal has seen the current one,
+ * so memory retired in epoch e cannot be reached by any reader once the
+ * epoch is e + 2, and epoch_collect frees it then.
+ *
+ * Until a reader registers, nothing can be reading concurrently, and
+ * epoch_retire frees at once.
+ */
+
+
+/*
+ * Register the calling thread as a reader. Called once per reader thread,
+ * before its first epoch_enter.
+ */
+void epoch_register(void);
+
+
+/*
+ * Begin a traversal of shared data from a registered reader thread.
+ */
+void epoch_enter(void);
+
+
+/*
+ * End the traversal begun by epoch_enter. Nothing read during it may be
+ * used afterwards.
+ */
+void epoch_exit(void);
+
+
+/*
+ * Free ptr with destroy once no reader can still reach it. Only called by
+ * the writer that unlinked ptr; each thread keeps its own retired list.
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+
+/*
+ * Try to advance the global epoch, and free whatever the calling thread
+ * retired that is no longer reachable. Writers call this regularly.
+ */
+void epoch_collect(void);
+
+
+/*
+ * Return the number of objects the calling thread retired and has not
+ * freed yet.
+ */
+long epoch_pending(void);
+
+#endif
@@ -2,458 +2,3016 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "friends.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "mailbox.h"
+#include "epoch.h"
+#include "metrics.h"
 
 #ifndef PORT
   #define PORT 50700
 #endif
 
 #define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
-#define MAX_BACKLOG 5
-#define MAX_CONNECTIONS 1024
-#define DELIM " \n"
+#define DEFAULT_MAX_LINE_LENGTH (64 * 1024)     // Longest command accepted,
+                                                // "\r\n" excluded
+#define MAX_COMMAND_ARGS 4      // Tokens in the longest command (profile)
+#define MAX_BACKLOG 128
+#define MAX_CONNECTIONS 65536
+#define MAX_EVENTS 64
+#define DEFAULT_SUGGESTIONS 5           // Suggestions listed by a bare suggest
+#define MAX_SUGGESTIONS 1000
+#define OUTPUT_HIGH_WATER (1 << 20)     // Default per-client output queue limit
+#define OUTPUT_DISCONNECT_FACTOR 4      // Queue size, in high-water marks, at
+                                        // which a client that is not reading
+                                        // is disconnected
+#define OUTPUT_COPY_LIMIT 512           // Cached renderings shorter than this
+                                        // are copied into the output queue
+                                        // instead of queued by reference
+#define OUTPUT_MAX_IOV 64               // Pieces of output per sendmsg()
+#define SNAPSHOT_POLL_INTERVAL 100      // Milliseconds between checks on a
+                                        // snapshot being written
+#define MAX_SHARDS 64
+#define MAX_READERS 64
+#define METRICS_DEFAULT_INTERVAL 15     // Seconds between writes of the
+                                        // metrics file, if there is one
+#define SEARCH_RESULTS 10       // Posts a search shows, newest first
+#define EXPIRE_BUDGET 1000      // Posts or users a retention sweep looks at
+#define EXPIRE_INTERVAL 1000    // Milliseconds between retention sweeps once
+                                // one has caught up
+
+// Kinds of command whose latency is recorded
+#define CMD_LOGIN 0
+#define CMD_LIST_USERS 1
+#define CMD_PROFILE 2
+#define CMD_MAKE_FRIENDS 3
+#define CMD_POST 4
+#define CMD_MUTUAL 5
+#define CMD_SUGGEST 6
+#define CMD_STATS 7
+#define CMD_QUIT 8
+#define CMD_SEARCH 9
+#define CMD_FEED 10
+#define CMD_INVALID 11      // anything else
+#define NUM_COMMAND_KINDS 12
+
+const char *command_kinds[NUM_COMMAND_KINDS] = {
+    "login", "list_users", "profile", "make_friends", "post", "mutual", "suggest", "stats",
+    "quit", "search", "feed", "invalid"
+};
+
+/*
+ * Output queued by reference rather than copied: the first len bytes of a
+ * cached Rendering, which the reference keeps alive until they are sent.
+ */
+typedef struct output_ref {
+    Rendering *rendering;
+    int len;
+    int sent;           // bytes of the rendering already sent
+    int ring_before;    // bytes of the out ring queued ahead of these
+} OutputRef;
 
 typedef struct client {
     char name[MAX_NAME]; // name of the client
-    // used for reading input
-    char buf[INPUT_BUFFER_SIZE];
+    // used for reading input; buf starts at INPUT_BUFFER_SIZE bytes and
+    // grows to hold a line of up to max_line_length
+    char *buf;
+    int buf_cap;
     int fd;
     int inbuf;
-    int room;
-    char *after;
+    int scanned;        // bytes of buf already searched for a newline
+    int discarding;     // dropping the rest of a line that was too long
     int where;
-    // next client in linked list
+    // output the socket has not accepted yet, as a ring buffer
+    char *out;
+    int out_cap;        // size of out, zero or a power of two
+    int out_start;      // index of the first queued byte
+    int out_len;        // number of queued bytes
+    // output queued by reference, interleaved with the out ring in the
+    // order it was queued, as a ring of refs_cap entries
+    OutputRef *refs;
+    int refs_cap;       // zero or a power of two
+    int refs_start;
+    int refs_count;
+    int ring_after_refs;    // bytes of out queued after the last ref
+    int ref_bytes;      // bytes of the refs not sent yet
+    int throttled;      // input is paused until the output queue drains
+    int closing;        // the client will be removed at the end of this tick
+    struct client *next_closing;
+    int pending_flush;  // output was queued during this tick
+    struct client *next_pending;
+    int awaiting;       // replies still expected from other shards; input
+                        // is paused until they have all arrived
+    int migrated;       // handed over to the shard that owns its user
+    int removed;        // closed while awaiting replies, freed on the last
+    struct gather *gather;  // suggestions being gathered from other shards
+    int command;        // kind of the command awaiting replies, and when
+    unsigned long command_started;  // it was read (see metrics_now)
+    // the User this client is logged in as, NULL until login
+    User *user;
+    // neighbours in the user's list of sessions
+    struct client *prev_session;
+    struct client *next_session;
+    // neighbours in the doubly linked client list
+    struct client *prev;
     struct client *next;
 } Client;
 
-Client *clients;
+/*
+ * A slice of an input line.
+ */
+typedef struct slice {
+    char *start;        // '\0'-terminated in place by parse_command
+    int len;
+} Slice;
+
+/*
+ * A command line, split in place into its tokens without copying them.
+ * The message of a post is the rest of the line after the target's name,
+ * spaces and all, so it has no limit on its number of words; so are the
+ * words of a search, after the command's name.
+ */
+typedef struct command {
+    int kind;           // CMD_LIST_USERS, ..., or CMD_INVALID
+    int argc;           // tokens, the command's name included; more than
+                        // MAX_COMMAND_ARGS if the line has too many
+    Slice args[MAX_COMMAND_ARGS];
+    Slice message;      // post and search only, empty if there is none
+} Command;
+
+// Messages between shards; a request names a user owned by the receiver
+#define MSG_MIGRATE 0       // data is a client to adopt
+#define MSG_LIST_USERS 1    // add the receiver's user list to refs, pass it on
+#define MSG_FRIEND 2        // befriend user and name
+#define MSG_FRIEND_REPLY 3  // other is the user befriended, or status why not
+#define MSG_POST 4          // post data from user to name
+#define MSG_PROFILE 5       // render a page of the profile of name
+#define MSG_MUTUAL 6        // mutual friends of name and the friends shipped
+#define MSG_GATHER 7        // copy the friend sets of the friends shipped
+#define MSG_GATHER_REPLY 8  // the friend sets, count of them in counts
+#define MSG_OUTPUT 9        // data is output (len bytes) for client
+#define MSG_READ_PROFILE 10 // a reader renders a page of the profile of name
+#define MSG_READ_LIST_USERS 11  // a reader lists the users of every shard, or
+                                // those starting with name, offset and limit
+#define MSG_SEARCH 12       // add the receiver's newest posts with the count
+                            // words in data to hits, pass it on
+#define MSG_READ_SEARCH 13  // a reader searches the posts of every shard
+#define MSG_FEED_PUSH 14    // add the sender's post post_id to the timelines
+                            // of the count users in friends
+
+/*
+ * A post found by a search on another shard, rendered there.
+ */
+typedef struct search_hit {
+    time_t date;
+    char *text;
+    int len;
+} SearchHit;
+
+typedef struct message {
+    Mail mail;                   // link in the receiver's inbox
+    int type;
+    int from;                    // shard or reader that sent the message
+    int origin;                  // shard of the client awaiting the reply
+    Client *client;              // client awaiting the reply, on the sender
+    User *user;                  // the client's user
+    User *other;
+    char name[MAX_NAME];
+    int status;
+    int reserved;                // a friend slot is held for user
+    int offset;
+    int limit;
+    char *data;
+    int len;
+    OutputRef *refs;             // output ahead of data, by reference
+    int num_refs;
+    SearchHit *hits;             // newest first, at most SEARCH_RESULTS
+    int num_hits;
+    User **friends;              // friend sets shipped between shards
+    unsigned int *friend_ids;
+    int *counts;
+    int count;
+    unsigned int post_id;
+} Message;
+
+/*
+ * Suggestions for a user whose friends are spread over several shards.
+ * The friends of each friend are copied from its shard into a proxy User,
+ * so suggest_friends can run over proxy without reading another shard's
+ * users.
+ */
+typedef struct gather {
+    int k;
+    User **friends;              // the user's friends when the request began
+    User proxy;                  // the user, with friends that are owned by
+                                 // other shards replaced by proxies
+    User *proxies;               // indexed like friends
+    Message *replies;            // holding the copied friend sets
+} Gather;
+
+/*
+ * What a shard records about the commands it serves and its clients.
+ * Only the shard's own thread touches it.
+ */
+typedef struct metrics {
+    Histogram commands[NUM_COMMAND_KINDS];  // latency of each kind, in ns
+    // of the two ways posts reach a feed, in ns: rendering feeds from
+    // timelines alone or merging profiles into them, and fanning posts out
+    Histogram feed_timeline;
+    Histogram feed_merge;
+    Histogram feed_fanout;
+    Histogram expire;                       // retention sweeps, in ns
+    unsigned long connections_accepted;
+    unsigned long connections_closed;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+} Metrics;
+
+/*
+ * The server runs one shard per thread. Each shard owns the users whose
+ * names hash to it (see shard_of), together with their log and snapshots,
+ * and serves the clients logged in as them: a client is handed over to
+ * its user's shard at login. Shards never change each other's users;
+ * changes go through messages in the owner's inbox. Apart from their
+ * immutable names and ids and the name index (see render_user_page), a
+ * shard only reads other shards' users to merge their posts into feeds,
+ * which it does inside an epoch, as a reader would.
+ */
+typedef struct shard {
+    int id;
+    pthread_t thread;
+    UserTable users;
+    Wal wal;
+    char wal_path[WAL_MAX_PATH];
+    char snapshot_path[WAL_MAX_PATH];
+    char metrics_path[WAL_MAX_PATH];
+    unsigned long oldest_segment;   // oldest log segment left at startup
+    long recovered;                 // log records replayed at startup
+    Mailbox inbox;
+    Metrics metrics;
+} Shard;
+
+/*
+ * A reader thread, which serves profile, list_users and search for every
+ * shard.
+ * Readers read users while their owners change them, without locks: see
+ * epoch.h, and the notes on User and UserTable.
+ */
+typedef struct reader {
+    int id;
+    pthread_t thread;
+    Mailbox inbox;
+} Reader;
+
+Shard *shards;
+int num_shards = 1;
+
+Reader *readers;
+int num_readers;
+
+// messages are addressed to shards by their id and to readers by
+// num_shards plus theirs; self is this thread's own address
+__thread int self;
+
+// the reader that this shard sends its next read to
+__thread int next_reader;
+
+// the shard run by this thread; the globals below are all per shard
+__thread Shard *shard;
+
+__thread Client *clients;
+__thread int num_clients;
+
+// every Client is allocated from this pool
+__thread Pool client_pool;
+
+// clients to be removed once the current batch of events is handled
+__thread Client *closing_clients;
+
+// clients with output queued during the current batch of events
+__thread Client *pending_clients;
+
+// number of queued output bytes above which a client's input is throttled
+int output_high_water = OUTPUT_HIGH_WATER;
+
+// longest line a client may send, "\r\n" excluded
+int max_line_length = DEFAULT_MAX_LINE_LENGTH;
+
+// epoll instance that every client socket is registered with
+__thread int epoll_fd;
+
+// directory of the shard's users, indexed by name
+__thread UserTable *users;
+
+// write-ahead log of every change made to users
+__thread Wal *wal;
+
+// messages to each shard, sent together at the end of each batch of events
+__thread struct message *outbox_newest[MAX_SHARDS + MAX_READERS];
+__thread struct message *outbox_oldest[MAX_SHARDS + MAX_READERS];
+__thread long messages_sent;
+__thread long messages_received;
+
+// background snapshots of users; the child writing one is snapshot_pid,
+// and the snapshot covers the log generations before snapshot_generation
+const char *snapshot_path = SNAPSHOT_DEFAULT_PATH;
+int snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;  // seconds, 0 disables
+__thread pid_t snapshot_pid;
+__thread unsigned long snapshot_generation;
+__thread unsigned long oldest_segment;  // oldest log segment not yet deleted
+__thread double snapshot_started;
+__thread double last_snapshot;
+__thread long records_at_snapshot;      // wal->records when the last one started
+__thread long snapshots_taken;
+__thread long snapshots_failed;
+__thread double last_snapshot_ms;
+
+// the shard's metrics, written out to its metrics file (if metrics_path is
+// set) every metrics_interval seconds
+__thread Metrics *metrics;
+const char *metrics_path;
+int metrics_interval = METRICS_DEFAULT_INTERVAL;
+__thread double last_metrics_dump;
+
+// retention of posts (see expire_posts): the shard sweeps its posts every
+// EXPIRE_INTERVAL milliseconds, and on every turn of the event loop while
+// the last sweep ran out of budget
+__thread double last_expire;
+__thread int expire_behind;
+
+/*
+ * Return the monotonic time in seconds.
+ */
+double monotonic_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Mark client to be removed once the current batch of events is handled.
+ * Removal is deferred so that pointers to the client held further up the
+ * stack (for example while delivering notifications) stay valid.
+ */
+void close_client(Client *client) {
+    if (client->closing) {
+        return;
+    }
+    client->closing = 1;
+    client->next_closing = closing_clients;
+    closing_clients = client;
+}
+
+
+/*
+ * Return the number of bytes queued for client, copied or by reference.
+ */
+int queued_output(const Client *client) {
+    return client->out_len + client->ref_bytes;
+}
+
+
+/*
+ * Add to iov, which has n of max entries filled, the next len bytes of
+ * the client's out ring from index *pos on, and advance *pos past them.
+ * Return the new number of entries filled.
+ */
+int gather_ring(const Client *client, int *pos, int len, struct iovec *iov, int n, int max) {
+    while (len > 0 && n < max) {
+        int piece = client->out_cap - *pos;
+        if (piece > len) {
+            piece = len;
+        }
+        iov[n].iov_base = client->out + *pos;
+        iov[n].iov_len = piece;
+        n++;
+        *pos = (*pos + piece) & (client->out_cap - 1);
+        len -= piece;
+    }
+    return n;
+}
+
+
+/*
+ * Fill up to max entries of iov with the client's queued output, in order:
+ * pieces of the out ring interleaved with the refs. Return the number of
+ * entries filled.
+ */
+int gather_output(const Client *client, struct iovec *iov, int max) {
+    int n = 0;
+    int pos = client->out_start;
+    for (int i = 0; i < client->refs_count && n < max; i++) {
+        const OutputRef *ref = &client->refs[(client->refs_start + i) & (client->refs_cap - 1)];
+        n = gather_ring(client, &pos, ref->ring_before, iov, n, max);
+        if (n < max) {
+            iov[n].iov_base = ref->rendering->data + ref->sent;
+            iov[n].iov_len = ref->len - ref->sent;
+            n++;
+        }
+    }
+    return gather_ring(client, &pos, client->ring_after_refs, iov, n, max);
+}
+
+
+/*
+ * Remove the first num bytes of the client's queued output, which have
+ * been sent, releasing the refs sent in full.
+ */
+void consume_output(Client *client, int num) {
+    while (num > 0) {
+        OutputRef *ref = client->refs_count > 0 ? &client->refs[client->refs_start] : NULL;
+        int *ring = ref != NULL ? &ref->ring_before : &client->ring_after_refs;
+        int taken = num < *ring ? num : *ring;
+        client->out_start = (client->out_start + taken) & (client->out_cap - 1);
+        client->out_len -= taken;
+        *ring -= taken;
+        num -= taken;
+        if (ref == NULL || num == 0) {
+            continue;
+        }
+
+        taken = ref->len - ref->sent;
+        if (taken > num) {
+            taken = num;
+        }
+        ref->sent += taken;
+        client->ref_bytes -= taken;
+        num -= taken;
+        if (ref->sent == ref->len) {
+            release_rendering(ref->rendering);
+            client->refs_start = (client->refs_start + 1) & (client->refs_cap - 1);
+            client->refs_count--;
+        }
+    }
+}
+
+
+/*
+ * Drop the client's queued output without sending it.
+ */
+void discard_output(Client *client) {
+    consume_output(client, queued_output(client));
+}
+
+
+/*
+ * Write as much of the client's output queue as the socket accepts.
+ * Replies may report changes, so the changes logged so far are committed
+ * before any output leaves the server.
+ * Return:  -1 if the socket failed
+ *          0 otherwise
+ */
+int flush_client(Client *client) {
+    if (wal_pending(wal)) {
+        wal_commit(wal);
+    }
+    while (queued_output(client) > 0) {
+        // ring pieces and refs go out together, without copying the refs
+        struct iovec iov[OUTPUT_MAX_IOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gather_output(client, iov, OUTPUT_MAX_IOV);
+
+        int num = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (num == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        consume_output(client, num);
+        metrics->bytes_out += num;
+    }
+    client->out_start = 0;
+    return 0;
+}
+
+
+/*
+ * Append len bytes of msg to the client's output queue, growing the ring
+ * as needed. Nothing is sent; see client_send.
+ */
+void enqueue_output(Client *client, const char *msg, int len) {
+    if (client->out_len + len > client->out_cap) {
+        int new_cap = client->out_cap == 0 ? INPUT_BUFFER_SIZE : client->out_cap;
+        while (new_cap < client->out_len + len) {
+            new_cap *= 2;
+        }
+        char *new_out = malloc(new_cap);
+        if (new_out == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+
+        // unwrap the queued bytes to the start of the new ring; an empty
+        // queue may have no ring yet
+        if (client->out_len > 0) {
+            int first = client->out_cap - client->out_start;
+            if (first > client->out_len) {
+                first = client->out_len;
+            }
+            memcpy(new_out, client->out + client->out_start, first);
+            memcpy(new_out + first, client->out, client->out_len - first);
+        }
+        free(client->out);
+        client->out = new_out;
+        client->out_cap = new_cap;
+        client->out_start = 0;
+    }
+
+    int end = (client->out_start + client->out_len) & (client->out_cap - 1);
+    int first = client->out_cap - end;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(client->out + end, msg, first);
+    memcpy(client->out, msg + first, len - first);
+    client->out_len += len;
+    client->ring_after_refs += len;
+}
+
+
+/*
+ * Append the first len bytes of rendering, and the reference to it, to the
+ * client's output queue after the bytes queued so far, growing the ring of
+ * refs as needed.
+ */
+void enqueue_ref(Client *client, Rendering *rendering, int len) {
+    if (client->refs_count == client->refs_cap) {
+        int new_cap = client->refs_cap == 0 ? 4 : client->refs_cap * 2;
+        OutputRef *new_refs = malloc(new_cap * sizeof(OutputRef));
+        if (new_refs == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < client->refs_count; i++) {
+            new_refs[i] = client->refs[(client->refs_start + i) & (client->refs_cap - 1)];
+        }
+        free(client->refs);
+        client->refs = new_refs;
+        client->refs_cap = new_cap;
+        client->refs_start = 0;
+    }
+
+    OutputRef *ref = &client->refs[(client->refs_start + client->refs_count) &
+                                   (client->refs_cap - 1)];
+    ref->rendering = rendering;
+    ref->len = len;
+    ref->sent = 0;
+    ref->ring_before = client->ring_after_refs;
+    client->ring_after_refs = 0;
+    client->refs_count++;
+    client->ref_bytes += len;
+}
+
+
+/*
+ * Prepare to queue output for client, scheduling it to be written at the
+ * end of this batch of events. Return 0 if the output is to be dropped
+ * instead, because the client is closing or has just been closed for
+ * letting its queue grow past the disconnect limit, 1 otherwise.
+ */
+int start_output(Client *client) {
+    if (client->closing) {
+        return 0;
+    }
+
+    if (queued_output(client) > output_high_water * OUTPUT_DISCONNECT_FACTOR) {
+        close_client(client);
+        return 0;
+    }
+
+    if (!client->pending_flush) {
+        client->pending_flush = 1;
+        client->next_pending = pending_clients;
+        pending_clients = client;
+    }
+    return 1;
+}
+
+
+/*
+ * Queue len bytes of msg for client. Queued output is written once per
+ * batch of events (see flush_pending_clients), so all the replies produced
+ * by a batch of pipelined commands leave in a single sendmsg(). A client
+ * that lets its queue grow past the disconnect limit (because it stopped
+ * reading) is closed.
+ */
+void client_send(Client *client, const char *msg, int len) {
+    if (!start_output(client)) {
+        return;
+    }
+    enqueue_output(client, msg, len);
+}
+
+
+/*
+ * Queue the first len bytes of rendering for client like client_send,
+ * taking over the caller's reference to it. Unless they are few, they are
+ * sent from where they are, so large cached profiles and user lists are
+ * never copied on their way to the socket.
+ */
+void client_send_ref(Client *client, Rendering *rendering, int len) {
+    if (len < OUTPUT_COPY_LIMIT) {
+        client_send(client, rendering->data, len);
+        release_rendering(rendering);
+    } else if (!start_output(client)) {
+        release_rendering(rendering);
+    } else {
+        enqueue_ref(client, rendering, len);
+    }
+}
+
+
+/*
+ * Send a formatted error message to the client.
+ */
+void error(char *msg, Client *client) {
+    client_send(client, msg, strlen(msg) + 1);
+}
+
+
+/*
+ * Return the shard that owns the user called name.
+ */
+int owner_of(const char *name) {
+    return shard_of(hash_name(name), num_shards);
+}
+
+
+/*
+ * Return 1 if name could only belong to a user owned by another shard.
+ */
+int is_remote(const char *name) {
+    return num_shards > 1 && strlen(name) < MAX_NAME && owner_of(name) != shard->id;
+}
+
+
+/*
+ * Allocate a message of the given type, with every other field zeroed.
+ */
+Message *new_message(int type) {
+    Message *msg = calloc(1, sizeof(Message));
+    if (msg == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    msg->type = type;
+    return msg;
+}
+
+
+/*
+ * Queue msg for shard to. Messages leave together at the end of the batch
+ * of events, after the changes logged during the batch are committed (see
+ * send_outboxes), so no shard acts on a change that is not yet in a log.
+ */
+void send_message(int to, Message *msg) {
+    msg->from = self;
+    if (outbox_newest[to] == NULL) {
+        msg->mail.next = NULL;
+        outbox_oldest[to] = msg;
+    } else {
+        msg->mail.next = &outbox_newest[to]->mail;
+    }
+    outbox_newest[to] = msg;
+    messages_sent++;
+}
+
+
+/*
+ * Send a request on behalf of client to shard to. The client's input is
+ * paused until the reply arrives, so its commands still complete in order.
+ */
+void send_request(int to, Message *msg, Client *client) {
+    msg->client = client;
+    msg->user = client->user;
+    msg->origin = shard->id;
+    client->awaiting++;
+    send_message(to, msg);
+}
+
+
+/*
+ * Send a read on behalf of client to the next reader in turn.
+ */
+void send_read(Message *msg, Client *client) {
+    send_request(num_shards + next_reader, msg, client);
+    next_reader = (next_reader + 1) % num_readers;
+}
+
+
+/*
+ * Turn the request msg into a reply of the given type and send it back
+ * to the shard it came from.
+ */
+void send_reply(Message *msg, int type) {
+    msg->type = type;
+    send_message(msg->origin, msg);
+}
+
+
+/*
+ * Send the client the outcome of make_friends with the user called name.
+ */
+void report_friends(Client *client, int status, const char *name) {
+    char buf[INPUT_BUFFER_SIZE];
+    switch (status) {
+        case 0:
+            strcpy(buf, "You are now friends with ");
+            strcat(buf, name);
+            strcat(buf, "\r\n");
+            client_send(client, buf, strlen(buf));
+            break;
+        case 1:
+            error("You are already friends.\r\n", client);
+            break;
+        case 2:
+            error("At least one of you entered has the max number of friends\r\n", client);
+            break;
+        case 3:
+            error("You can't friend yourself\r\n", client);
+            break;
+        case 4:
+            error("The user you entered does not exist\r\n", client);
+            break;
+    }
+}
+
+
+/*
+ * Tell every session of target that they were befriended by name.
+ */
+void notify_friended(User *target, const char *name) {
+    char friend_buf[INPUT_BUFFER_SIZE];
+    strcpy(friend_buf, "You have been friended by ");
+    strcat(friend_buf, name);
+    strcat(friend_buf, "\r\n");
+    for (Client *curr = target->sessions; curr != NULL; curr = curr->next_session) {
+        client_send(curr, friend_buf, strlen(friend_buf));
+    }
+}
+
+
+/*
+ * Show a new post from author to every session of target.
+ */
+void notify_post(User *target, const User *author, const char *contents) {
+    for (Client *curr = target->sessions; curr != NULL; curr = curr->next_session) {
+        client_send(curr, "From ", 5);
+        client_send(curr, author->name, strlen(author->name));
+        client_send(curr, ": ", 2);
+        client_send(curr, contents, strlen(contents));
+        client_send(curr, "\r\n", 2);
+    }
+}
+
+
+/*
+ * Return the error message for a failed make_post.
+ */
+char *post_error(int status) {
+    return status == 1 ? "You can only post to your friends\r\n" :
+        "The user you want to post to does not exist\r\n";
+}
+
+
+/*
+ * Set O_NONBLOCK on fd. Edge-triggered epoll requires that sockets be
+ * drained until accept() or read() reports EAGAIN, and writes must never
+ * stall the event loop.
+ */
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
+
+/*
+ * Accept every pending connection. Note that a new file descriptor is created
+ * for communication with each client. The initial socket descriptor is used
+ * to accept connections, but the new socket is used to communicate.
+ * Each new client is registered with epoll_fd (edge-triggered) with the
+ * Client itself as the event data.
+ */
+void accept_client_connection(int listenfd) {
+    while (1) {
+        struct sockaddr_in peer;
+        unsigned int peer_len = sizeof(peer);
+        peer.sin_family = AF_INET;
+
+        int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+        if (client_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // no more pending connections
+                return;
+            } else if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // out of descriptors or similar: keep serving existing clients
+            perror("accept");
+            return;
+        }
+
+        // refuse the connection if we are already at capacity
+        if (num_clients >= MAX_CONNECTIONS) {
+            close(client_socket);
+            continue;
+        }
+        set_nonblocking(client_socket);
+
+        // replies from other shards arrive in later batches than the ones
+        // before them, and must not wait behind those for an ACK
+        int on = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        // initialize new client
+
+        // allocate memory for the client from the client pool
+        Client *client = pool_alloc(&client_pool);
+
+        client->fd = client_socket;
+        client->buf = malloc(INPUT_BUFFER_SIZE);
+        if (client->buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        client->buf_cap = INPUT_BUFFER_SIZE;
+        client->inbuf = 0;
+        client->scanned = 0;
+        client->discarding = 0;
+        client->where = 0;
+        client->out = NULL;
+        client->out_cap = 0;
+        client->out_start = 0;
+        client->out_len = 0;
+        client->refs = NULL;
+        client->refs_cap = 0;
+        client->refs_start = 0;
+        client->refs_count = 0;
+        client->ring_after_refs = 0;
+        client->ref_bytes = 0;
+        client->throttled = 0;
+        client->closing = 0;
+        client->next_closing = NULL;
+        client->pending_flush = 0;
+        client->next_pending = NULL;
+        client->awaiting = 0;
+        client->migrated = 0;
+        client->removed = 0;
+        client->gather = NULL;
+        client->user = NULL;
+        client->prev_session = NULL;
+        client->next_session = NULL;
+
+        // adding the new client to the linked client list
+        client->prev = NULL;
+        client->next = clients;
+        if (clients != NULL) {
+            clients->prev = client;
+        }
+        clients = client;
+        num_clients++;
+        metrics->connections_accepted++;
+
+        // empty client name
+        for (int i = 0; i < MAX_NAME; i++){
+            client->name[i] = '\0';
+        }
+
+        // register the client for edge-triggered input and output notifications
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+
+        // ask user for User name
+        char *msg = "What is your user name?\r\n";
+        client_send(client, msg, strlen(msg));
+    }
+}
+
+
+/*
+ * Log client in as user by adding it to the user's list of sessions.
+ */
+void attach_session(Client *client, User *user) {
+    client->user = user;
+    client->prev_session = NULL;
+    client->next_session = user->sessions;
+    if (user->sessions != NULL) {
+        user->sessions->prev_session = client;
+    }
+    user->sessions = client;
+}
+
+
+/*
+ * Remove client from its user's list of sessions, if it is logged in.
+ */
+void detach_session(Client *client) {
+    if (client->user == NULL) {
+        return;
+    }
+
+    if (client->prev_session != NULL) {
+        client->prev_session->next_session = client->next_session;
+    } else {
+        client->user->sessions = client->next_session;
+    }
+    if (client->next_session != NULL) {
+        client->next_session->prev_session = client->prev_session;
+    }
+    client->user = NULL;
+}
+
+
+/*
+ * Free gather and the friend sets copied into it.
+ */
+void free_gather(Gather *gather) {
+    while (gather->replies != NULL) {
+        Message *reply = gather->replies;
+        gather->replies = (Message *)reply->mail.next;
+        free(reply->friends);
+        free(reply->friend_ids);
+        free(reply->counts);
+        free(reply);
+    }
+    free(gather->friends);
+    free(gather->proxy.friends);
+    free(gather->proxy.friend_ids);
+    free(gather->proxies);
+    free(gather);
+}
+
+
+/*
+ * Free client, which is no longer in the clients list. The input and
+ * output buffers of a migrated client belong to its new shard.
+ */
+void free_client(Client *client) {
+    if (!client->migrated) {
+        discard_output(client);
+        free(client->buf);
+        free(client->out);
+        free(client->refs);
+    }
+    if (client->gather != NULL) {
+        free_gather(client->gather);
+    }
+    pool_free(&client_pool, client);
+}
+
+
+/*
+ * Deregister client from epoll, close its socket, unlink it from the
+ * clients list and free it. Only called once the current batch of events
+ * is handled; use close_client everywhere else. A client still awaiting
+ * replies from other shards is only freed once the last one arrives.
+ */
+void remove_client(Client *client) {
+    if (!client->migrated) {
+        detach_session(client);
+
+        // best effort delivery of replies queued before a quit
+        flush_client(client);
+        metrics->connections_closed++;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+            perror("epoll_ctl");
+        }
+        close(client->fd);
+    }
+
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    num_clients--;
+
+    if (client->awaiting > 0) {
+        client->removed = 1;
+        return;
+    }
+    free_client(client);
+}
+
+
+/*
+ * Hand client over to shard to, which owns the user it is logging in as.
+ * The Client is copied into the message, unread input and queued output
+ * included, and the original is removed without closing the socket.
+ */
+void migrate_client(Client *client, int to) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    Message *msg = new_message(MSG_MIGRATE);
+    msg->data = malloc(sizeof(Client));
+    if (msg->data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(msg->data, client, sizeof(Client));
+    msg->len = sizeof(Client);
+    send_message(to, msg);
+
+    client->migrated = 1;
+    close_client(client);
+}
+
+
+/*
+ * Search the first n characters of buf for a network newline (\r\n).
+ * Return one plus the index of the '\n' of the first network newline,
+ * or -1 if no network newline is found. The return value is the index into buf
+ * where the current line ends.
+ * Definitely do not use strchr or other string functions to search here. (Why not?)
+ */
+int find_network_newline(const char *buf, int n) {
+    for (int i = 0; i + 1 < n; i++) {
+        if (buf[i] == '\r') {
+            if (buf[i+1] == '\n') {
+                return i + 2;
+            }
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Emitter that queues rendered output for the Client context.
+ */
+void emit_to_client(void *context, const char *bytes, int len) {
+    client_send(context, bytes, len);
+}
+
+
+/*
+ * A growable buffer of rendered output, for replies to other shards.
+ */
+typedef struct buffer {
+    char *data;
+    int len;
+    int cap;
+} Buffer;
+
+
+/*
+ * Emitter that appends rendered output to the Buffer context.
+ */
+void emit_to_buffer(void *context, const char *bytes, int len) {
+    Buffer *buffer = context;
+    if (buffer->len + len > buffer->cap) {
+        buffer->cap = buffer->cap == 0 ? INPUT_BUFFER_SIZE : buffer->cap;
+        while (buffer->len + len > buffer->cap) {
+            buffer->cap *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->cap);
+        if (buffer->data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(buffer->data + buffer->len, bytes, len);
+    buffer->len += len;
+}
+
+
+/*
+ * Queue a page of user's profile for client. The first page is sent by
+ * reference from the user's cached rendering; others are rendered straight
+ * into the output queue.
+ */
+void send_profile(Client *client, User *user, int offset, int limit) {
+    if (offset == 0 && limit == PROFILE_PAGE_SIZE) {
+        Rendering *sections[PROFILE_SECTIONS];
+        acquire_cached_profile(user, users, sections);
+        for (int i = 0; i < PROFILE_SECTIONS; i++) {
+            client_send_ref(client, sections[i], sections[i]->len);
+        }
+    } else {
+        render_profile(user, offset, limit, emit_to_client, client);
+    }
+    client_send(client, "", 1);
+}
+
+
+/*
+ * Add the first len bytes of rendering, and the caller's reference to it,
+ * to the output sent by reference in msg.
+ */
+void add_message_ref(Message *msg, Rendering *rendering, int len) {
+    msg->refs = realloc(msg->refs, (msg->num_refs + 1) * sizeof(OutputRef));
+    if (msg->refs == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    msg->refs[msg->num_refs].rendering = rendering;
+    msg->refs[msg->num_refs].len = len;
+    msg->num_refs++;
+}
+
+
+/*
+ * Turn the profile request msg, for the user called msg->name in table,
+ * into its reply and send it. The first page is passed by reference to the
+ * user's cached rendering, in msg->refs; anything else is rendered into
+ * msg->data.
+ */
+void reply_profile(Message *msg, UserTable *table) {
+    User *user = find_user(msg->name, table);
+    Buffer buffer = {NULL, 0, 0};
+    if (user == NULL) {
+        char *err = "User not found\r\n";
+        emit_to_buffer(&buffer, err, strlen(err));
+    } else if (msg->offset == 0 && msg->limit == PROFILE_PAGE_SIZE) {
+        Rendering *sections[PROFILE_SECTIONS];
+        acquire_cached_profile(user, table, sections);
+        for (int i = 0; i < PROFILE_SECTIONS; i++) {
+            add_message_ref(msg, sections[i], sections[i]->len);
+        }
+    } else {
+        render_profile(user, msg->offset, msg->limit, emit_to_buffer, &buffer);
+    }
+    emit_to_buffer(&buffer, "", 1);
+    msg->data = buffer.data;
+    msg->len = buffer.len;
+    send_reply(msg, MSG_OUTPUT);
+}
+
+
+/*
+ * Pass to emit the users of every shard, in name order, that start with
+ * prefix, skipping offset of them and showing at most limit (limit < 0
+ * for no limit). The name indexes of other shards are read in place, as
+ * readers do; nothing in them is ever freed.
+ */
+void render_user_page(const char *prefix, int offset, int limit, Emitter emit, void *context) {
+    UserTable *tables[MAX_SHARDS];
+    for (int i = 0; i < num_shards; i++) {
+        tables[i] = &shards[i].users;
+    }
+    render_sorted_users(tables, num_shards, prefix, offset, limit, emit, context);
+}
+
+
+/*
+ * Split the words of a search into terms, as the index splits posts.
+ * Return the number of terms, or -1 if there are more than
+ * SEARCH_MAX_QUERY_TERMS.
+ */
+int parse_search_terms(const char *text, char terms[][SEARCH_MAX_TERM]) {
+    int num_terms = 0;
+    char term[SEARCH_MAX_TERM];
+    while (next_term(&text, term)) {
+        if (num_terms == SEARCH_MAX_QUERY_TERMS) {
+            return -1;
+        }
+        strcpy(terms[num_terms++], term);
+    }
+    return num_terms;
+}
+
+
+/*
+ * Pass to emit the SEARCH_RESULTS newest posts of num_tables tables that
+ * have all num_terms terms, newest first and separated like the posts of
+ * a profile. Each table is searched for its own newest, and those are
+ * merged. Only called by the owner of the tables or from a reader's epoch.
+ */
+void render_search(UserTable *const *tables, int num_tables, char terms[][SEARCH_MAX_TERM],
+                   int num_terms, Emitter emit, void *context) {
+    const Post *newest[SEARCH_RESULTS];
+    int num_newest = 0;
+    for (int i = 0; i < num_tables; i++) {
+        const Post *hits[SEARCH_RESULTS];
+        int num_hits = search_posts(tables[i], terms, num_terms, hits, SEARCH_RESULTS);
+        for (int j = 0; j < num_hits; j++) {
+            // insert into newest, which is sorted newest first; ties stay
+            // in table order
+            int pos = num_newest;
+            while (pos > 0 && newest[pos - 1]->date < hits[j]->date) {
+                pos--;
+            }
+            if (pos == SEARCH_RESULTS) {
+                // hits are newest first, so the rest are older still
+                break;
+            }
+            if (num_newest < SEARCH_RESULTS) {
+                num_newest++;
+            }
+            memmove(&newest[pos + 1], &newest[pos], (num_newest - 1 - pos) * sizeof(Post *));
+            newest[pos] = hits[j];
+        }
+    }
+
+    for (int i = 0; i < num_newest; i++) {
+        if (i > 0) {
+            emit(context, "===\r\n", 5);
+        }
+        render_post(newest[i], emit, context);
+    }
+}
+
+
+/*
+ * Search this shard's posts for the terms in msg and merge what is found
+ * into msg's hits, rendering each post, since other shards cannot read it.
+ */
+void add_search_hits(Message *msg) {
+    const Post *posts[SEARCH_RESULTS];
+    int num_posts = search_posts(users, (char (*)[SEARCH_MAX_TERM])msg->data, msg->count, posts,
+                                 SEARCH_RESULTS);
+    if (msg->hits == NULL) {
+        msg->hits = malloc(SEARCH_RESULTS * sizeof(SearchHit));
+        if (msg->hits == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_posts; i++) {
+        int pos = msg->num_hits;
+        while (pos > 0 && msg->hits[pos - 1].date < posts[i]->date) {
+            pos--;
+        }
+        if (pos == SEARCH_RESULTS) {
+            break;
+        }
+        if (msg->num_hits == SEARCH_RESULTS) {
+            free(msg->hits[SEARCH_RESULTS - 1].text);
+        } else {
+            msg->num_hits++;
+        }
+        memmove(&msg->hits[pos + 1], &msg->hits[pos],
+                (msg->num_hits - 1 - pos) * sizeof(SearchHit));
+
+        Buffer buffer = {NULL, 0, 0};
+        render_post(posts[i], emit_to_buffer, &buffer);
+        msg->hits[pos].date = posts[i]->date;
+        msg->hits[pos].text = buffer.data;
+        msg->hits[pos].len = buffer.len;
+    }
+}
+
+
+/*
+ * Add the post just made on the profile of the local user target to the
+ * timelines of target's friends, unless target is a heavy poster: those
+ * of local friends directly, and those of other shards' friends through
+ * one message to each of the shards.
+ */
+void fan_out_post(User *target) {
+    if (is_heavy_poster(target, users)) {
+        return;
+    }
+    unsigned long started = metrics_now();
+    unsigned int post_id = target->first_post->id;
+    Message *pushes[MAX_SHARDS] = {NULL};
+    for (int i = 0; i < target->num_friends; i++) {
+        User *friend = target->friends[i];
+        int owner = shard_of(friend->hash, num_shards);
+        if (owner == shard->id) {
+            push_timeline(friend, users, post_id);
+            continue;
+        }
+        if (pushes[owner] == NULL) {
+            pushes[owner] = new_message(MSG_FEED_PUSH);
+            pushes[owner]->friends = malloc(target->num_friends * sizeof(User *));
+            if (pushes[owner]->friends == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            pushes[owner]->post_id = post_id;
+        }
+        pushes[owner]->friends[pushes[owner]->count++] = friend;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        if (pushes[i] != NULL) {
+            send_message(i, pushes[i]);
+        }
+    }
+    histogram_record(&metrics->feed_fanout, metrics_now() - started);
+}
+
+
+/*
+ * Send client the limit newest posts on the profiles of its user's
+ * friends. Friends owned by other shards are read in place, inside an
+ * epoch, as readers read them.
+ */
+void send_feed(Client *client, int limit) {
+    UserTable *tables[MAX_SHARDS];
+    for (int i = 0; i < num_shards; i++) {
+        tables[i] = &shards[i].users;
+    }
+    unsigned long started = metrics_now();
+    epoch_enter();
+    int merged = render_feed(client->user, tables, limit, emit_to_client, client);
+    epoch_exit();
+    histogram_record(merged ? &metrics->feed_merge : &metrics->feed_timeline,
+                     metrics_now() - started);
+    client_send(client, "", 1);
+}
+
+
+/*
+ * Attach a copy of user's friend set to msg, for another shard to read.
+ */
+void copy_friends(const User *user, Message *msg) {
+    msg->count = user->num_friends;
+    // room for at least one, since malloc(0) may return NULL
+    int size = msg->count > 0 ? msg->count : 1;
+    msg->friends = malloc(size * sizeof(User *));
+    msg->friend_ids = malloc(size * sizeof(unsigned int));
+    if (msg->friends == NULL || msg->friend_ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(msg->friends, user->friends, msg->count * sizeof(User *));
+    memcpy(msg->friend_ids, user->friend_ids, msg->count * sizeof(unsigned int));
+}
+
+
+/*
+ * List suggestions for client's user from the friend sets gathered from
+ * other shards, and free them.
+ */
+void finish_suggestions(Client *client) {
+    Gather *gather = client->gather;
+    char *buf = list_suggestions(&gather->proxy, users, gather->k);
+    client_send(client, buf, strlen(buf) + 1);
+    free(buf);
+    free_gather(gather);
+    client->gather = NULL;
+}
+
+
+/*
+ * Suggest k friends for client's user. The friend sets of the user's
+ * friends that other shards own are requested from them, one request per
+ * shard; the suggestions are listed once every reply has arrived.
+ */
+void start_suggestions(Client *client, int k) {
+    User *user = client->user;
+    int n = user->num_friends;
+    Gather *gather = calloc(1, sizeof(Gather));
+    if (gather == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    gather->k = k;
+    // room for at least one, since malloc(0) may return NULL
+    int size = n > 0 ? n : 1;
+    gather->friends = malloc(size * sizeof(User *));
+    gather->proxy.friends = malloc(size * sizeof(User *));
+    gather->proxy.friend_ids = malloc(size * sizeof(unsigned int));
+    gather->proxies = calloc(n + 1, sizeof(User));
+    if (gather->friends == NULL || gather->proxy.friends == NULL ||
+            gather->proxy.friend_ids == NULL || gather->proxies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(gather->friends, user->friends, n * sizeof(User *));
+    memcpy(gather->proxy.friends, user->friends, n * sizeof(User *));
+    memcpy(gather->proxy.friend_ids, user->friend_ids, n * sizeof(unsigned int));
+    strcpy(gather->proxy.name, user->name);
+    gather->proxy.id = user->id;
+    gather->proxy.num_friends = n;
+    client->gather = gather;
+
+    Message *requests[MAX_SHARDS] = {NULL};
+    for (int i = 0; i < n; i++) {
+        int owner = shard_of(user->friends[i]->hash, num_shards);
+        if (owner == shard->id) {
+            continue;
+        }
+        if (requests[owner] == NULL) {
+            requests[owner] = new_message(MSG_GATHER);
+            requests[owner]->friends = malloc(n * sizeof(User *));
+            if (requests[owner]->friends == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+        requests[owner]->friends[requests[owner]->count++] = user->friends[i];
+    }
+    for (int i = 0; i < num_shards; i++) {
+        if (requests[i] != NULL) {
+            send_request(i, requests[i], client);
+        }
+    }
+
+    if (client->awaiting == 0) {
+        finish_suggestions(client);
+    }
+}
+
+
+/*
+ * Parse arg as a decimal integer of at least min into *result.
+ * Return:  -1 if arg is not such an integer
+ *          0 otherwise
+ */
+int parse_count(const char *arg, int min, int *result) {
+    char *end;
+    errno = 0;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || errno != 0 || value < min || value > INT_MAX) {
+        return -1;
+    }
+    *result = value;
+    return 0;
+}
+
+
+/*
+ * Return the resident set size of the server in bytes, or 0 if it cannot
+ * be read.
+ */
+long resident_bytes() {
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+/*
+ * Write the HELP, TYPE and only sample of a metric of this shard.
+ */
+void write_stat(FILE *out, const char *name, const char *type, const char *help,
+                const char *labels, double value, const char *eol) {
+    metrics_describe(out, name, type, help, eol);
+    metrics_sample(out, name, labels, value, eol);
+}
+
+
+/*
+ * Write this shard's statistics in the Prometheus text format, each sample
+ * labelled with the shard, ending every line with eol.
+ */
+void write_stats(FILE *out, const char *eol) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "shard=\"%d\"", shard->id);
+
+    metrics_describe(out, "command_duration_seconds", "summary",
+                     "Time from reading a command to queueing its reply.", eol);
+    for (int kind = 0; kind < NUM_COMMAND_KINDS; kind++) {
+        char command_labels[64];
+        snprintf(command_labels, sizeof(command_labels), "%s,command=\"%s\"",
+                 labels, command_kinds[kind]);
+        metrics_summary(out, "command_duration_seconds", command_labels,
+                        &metrics->commands[kind], eol);
+    }
+    metrics_describe(out, "feed_duration_seconds", "summary",
+                     "Time to render a feed from the timeline alone, or merging profiles.", eol);
+    char feed_labels[64];
+    snprintf(feed_labels, sizeof(feed_labels), "%s,path=\"timeline\"", labels);
+    metrics_summary(out, "feed_duration_seconds", feed_labels, &metrics->feed_timeline, eol);
+    snprintf(feed_labels, sizeof(feed_labels), "%s,path=\"merge\"", labels);
+    metrics_summary(out, "feed_duration_seconds", feed_labels, &metrics->feed_merge, eol);
+    metrics_describe(out, "feed_fanout_duration_seconds", "summary",
+                     "Time to add a post to the timelines of the target's friends.", eol);
+    metrics_summary(out, "feed_fanout_duration_seconds", labels, &metrics->feed_fanout, eol);
+    metrics_describe(out, "expire_duration_seconds", "summary",
+                     "Time taken by each sweep for expired posts.", eol);
+    metrics_summary(out, "expire_duration_seconds", labels, &metrics->expire, eol);
+
+    write_stat(out, "connections", "gauge", "Clients connected to this shard.",
+               labels, num_clients, eol);
+    write_stat(out, "connections_accepted", "counter", "Connections accepted.",
+               labels, metrics->connections_accepted, eol);
+    write_stat(out, "connections_closed", "counter", "Connections closed.",
+               labels, metrics->connections_closed, eol);
+    write_stat(out, "bytes_in", "counter", "Bytes read from clients.",
+               labels, metrics->bytes_in, eol);
+    write_stat(out, "bytes_out", "counter", "Bytes written to clients.",
+               labels, metrics->bytes_out, eol);
+    write_stat(out, "resident_memory_bytes", "gauge", "Resident set size of the server.",
+               labels, resident_bytes(), eol);
+
+    write_stat(out, "profile_cache_hits", "counter", "Profiles served from the cache.",
+               labels, __atomic_load_n(&users->profile_cache_hits, __ATOMIC_RELAXED), eol);
+    write_stat(out, "profile_cache_misses", "counter", "Profiles that had to be rendered.",
+               labels, __atomic_load_n(&users->profile_cache_misses, __ATOMIC_RELAXED), eol);
+    write_stat(out, "pool_users_in_use", "gauge", "Users allocated.",
+               labels, users->user_pool.in_use, eol);
+    write_stat(out, "pool_users_reserved_bytes", "gauge", "Memory reserved for users.",
+               labels, pool_bytes_reserved(&users->user_pool), eol);
+    write_stat(out, "pool_posts_in_use", "gauge", "Posts allocated.",
+               labels, users->post_pool.in_use, eol);
+    write_stat(out, "pool_posts_reserved_bytes", "gauge", "Memory reserved for posts.",
+               labels, pool_bytes_reserved(&users->post_pool), eol);
+    write_stat(out, "pool_clients_in_use", "gauge", "Clients allocated.",
+               labels, client_pool.in_use, eol);
+    write_stat(out, "pool_clients_reserved_bytes", "gauge", "Memory reserved for clients.",
+               labels, pool_bytes_reserved(&client_pool), eol);
+    write_stat(out, "arena_posts_used_bytes", "gauge", "Post contents stored.",
+               labels, users->post_arena.bytes_used + users->compact_arena.bytes_used, eol);
+    write_stat(out, "arena_posts_reserved_bytes", "gauge", "Memory reserved for post contents.",
+               labels, users->post_arena.bytes_reserved + users->compact_arena.bytes_reserved,
+               eol);
+    write_stat(out, "posts_expired", "counter", "Posts removed by the retention limits.",
+               labels, users->posts_expired, eol);
+    write_stat(out, "expired_reclaimed_bytes", "counter",
+               "Memory freed from expired posts and compacted post arenas.",
+               labels, users->bytes_reclaimed, eol);
+    write_stat(out, "arena_posts_compactions", "counter",
+               "Post arenas replaced by a copy of their live contents.",
+               labels, users->compactions, eol);
+    write_stat(out, "search_terms", "gauge", "Distinct words in the search index.",
+               labels, users->search.num_terms, eol);
+    write_stat(out, "search_postings", "gauge", "Post ids in the search index's lists.",
+               labels, users->search.postings, eol);
+    write_stat(out, "search_index_bytes", "gauge", "Memory taken by the search index.",
+               labels, users->search.bytes, eol);
+
+    write_stat(out, "wal_records", "counter", "Records appended to the log.",
+               labels, wal->records, eol);
+    write_stat(out, "wal_commits", "counter", "Batches of records written to the log.",
+               labels, wal->commits, eol);
+    write_stat(out, "wal_syncs", "counter", "Syncs of the log to disk.",
+               labels, wal->syncs, eol);
+    write_stat(out, "wal_bytes", "counter", "Bytes written to the log.",
+               labels, wal->bytes, eol);
+    write_stat(out, "wal_generation", "gauge", "Generation of the current log.",
+               labels, wal->generation, eol);
+    write_stat(out, "snapshots_taken", "counter", "Snapshots written.",
+               labels, snapshots_taken, eol);
+    write_stat(out, "snapshots_failed", "counter", "Snapshots that failed.",
+               labels, snapshots_failed, eol);
+    write_stat(out, "snapshot_in_progress", "gauge", "1 while a snapshot is being written.",
+               labels, snapshot_pid != 0, eol);
+    write_stat(out, "last_snapshot_ms", "gauge", "Time the last snapshot took to write.",
+               labels, last_snapshot_ms, eol);
+
+    write_stat(out, "shards", "gauge", "Event loop threads.", labels, num_shards, eol);
+    write_stat(out, "messages_sent", "counter", "Messages sent to other threads.",
+               labels, messages_sent, eol);
+    write_stat(out, "messages_received", "counter", "Messages received from other threads.",
+               labels, messages_received, eol);
+    write_stat(out, "readers", "gauge", "Reader threads.", labels, num_readers, eol);
+    write_stat(out, "epoch_retired_pending", "gauge", "Retired objects not yet freed.",
+               labels, epoch_pending(), eol);
+}
+
+
+/*
+ * Return the kind of command (CMD_LIST_USERS, ...) named by the len bytes
+ * at name, switching on the length so that at most two names are compared.
+ */
+int command_kind(const char *name, int len) {
+    switch (len) {
+        case 4:
+            if (memcmp(name, "post", 4) == 0) {
+                return CMD_POST;
+            } else if (memcmp(name, "quit", 4) == 0) {
+                return CMD_QUIT;
+            } else if (memcmp(name, "feed", 4) == 0) {
+                return CMD_FEED;
+            }
+            break;
+        case 5:
+            if (memcmp(name, "stats", 5) == 0) {
+                return CMD_STATS;
+            }
+            break;
+        case 6:
+            if (memcmp(name, "mutual", 6) == 0) {
+                return CMD_MUTUAL;
+            } else if (memcmp(name, "search", 6) == 0) {
+                return CMD_SEARCH;
+            }
+            break;
+        case 7:
+            if (memcmp(name, "profile", 7) == 0) {
+                return CMD_PROFILE;
+            } else if (memcmp(name, "suggest", 7) == 0) {
+                return CMD_SUGGEST;
+            }
+            break;
+        case 10:
+            if (memcmp(name, "list_users", 10) == 0) {
+                return CMD_LIST_USERS;
+            }
+            break;
+        case 12:
+            if (memcmp(name, "make_friends", 12) == 0) {
+                return CMD_MAKE_FRIENDS;
+            }
+            break;
+    }
+    return CMD_INVALID;
+}
+
+
+/*
+ * Return whether c separates the tokens of a command.
+ */
+int is_separator(char c) {
+    return c == ' ' || c == '\n';
+}
+
+
+/*
+ * Split line into cmd in place, terminating each token with a '\0'.
+ * Nothing is allocated or copied.
+ * Return the number of tokens (cmd->argc).
+ */
+int parse_command(char *line, Command *cmd) {
+    char *p = line;
+    cmd->kind = CMD_INVALID;
+    cmd->argc = 0;
+    cmd->message.start = NULL;
+    cmd->message.len = 0;
+    while (1) {
+        while (is_separator(*p)) {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if ((cmd->kind == CMD_POST && cmd->argc == 2) ||
+                (cmd->kind == CMD_SEARCH && cmd->argc == 1)) {
+            cmd->message.start = p;
+            cmd->message.len = strlen(p);
+            break;
+        }
+        if (cmd->argc == MAX_COMMAND_ARGS) {
+            // more than any command takes
+            cmd->argc++;
+            break;
+        }
+
+        Slice *arg = &cmd->args[cmd->argc];
+        arg->start = p;
+        while (*p != '\0' && !is_separator(*p)) {
+            p++;
+        }
+        arg->len = p - arg->start;
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+        if (cmd->argc == 0) {
+            cmd->kind = command_kind(arg->start, arg->len);
+        }
+        cmd->argc++;
+    }
+    return cmd->argc;
+}
+
+
+/* 
+ * Read and process commands
+ * Return:  -1 for quit command
+ *          0 otherwise
+ */
+int process_args(Command *cmd, UserTable *users, User *user, Client *client) {
+    // the user most commands are about
+    char *name = cmd->argc >= 2 ? cmd->args[1].start : NULL;
+
+    if (cmd->kind == CMD_QUIT && cmd->argc == 1) {
+        return -1;
+    } else if (cmd->kind == CMD_LIST_USERS && cmd->argc <= 4) {
+        // list_users [prefix] [offset limit]
+        char *prefix = cmd->argc % 2 == 0 ? name : "";
+        int offset = 0;
+        int limit = -1;
+        if (cmd->argc >= 3 &&
+                (parse_count(cmd->args[cmd->argc - 2].start, 0, &offset) == -1 ||
+                 parse_count(cmd->args[cmd->argc - 1].start, 1, &limit) == -1)) {
+            error("Incorrect syntax\r\n", client);
+            return 0;
+        }
+        if (strlen(prefix) >= MAX_NAME) {
+            // no name is that long
+            client_send(client, "", 1);
+            return 0;
+        }
+
+        if (num_readers > 0) {
+            Message *msg = new_message(MSG_READ_LIST_USERS);
+            strcpy(msg->name, prefix);
+            msg->offset = offset;
+            msg->limit = limit;
+            send_read(msg, client);
+            return 0;
+        }
+        if (prefix[0] != '\0' || limit >= 0) {
+            render_user_page(prefix, offset, limit, emit_to_client, client);
+        } else if (num_shards > 1) {
+            // collected from every shard in turn, starting with the first
+            send_request(0, new_message(MSG_LIST_USERS), client);
+            return 0;
+        } else {
+            int len;
+            Rendering *list = acquire_user_list(users, &len);
+            client_send_ref(client, list, len);
+        }
+        client_send(client, "", 1);
+    } else if (cmd->kind == CMD_MAKE_FRIENDS && cmd->argc == 2) {
+        if (is_remote(name)) {
+            // the other shard adds its half of the friendship and reports
+            // back; a slot is held for the friend meanwhile, unless the
+            // user is full, in which case the other shard only checks
+            // whether they are already friends
+            Message *msg = new_message(MSG_FRIEND);
+            strcpy(msg->name, name);
+            unsigned int max = users->max_friends;
+            if (max == 0 || user->num_friends + user->reserved_friends < max) {
+                user->reserved_friends++;
+                msg->reserved = 1;
+            }
+            send_request(owner_of(name), msg, client);
+            return 0;
+        }
+
+        int status = make_friends(user->name, name, users);
+        if (status == 0) {
+            wal_log_friends(wal, user->name, name);
+            // printing out message for all instances of the user that was friended
+            notify_friended(find_user(name, users), user->name);
+        }
+        report_friends(client, status, name);
+    } else if (cmd->kind == CMD_POST && cmd->argc == 2 && cmd->message.len > 0) {
+        // the message is read straight from the input line, and only
+        // copied into the post's storage
+        char *contents = cmd->message.start;
+
+        if (is_remote(name)) {
+            Message *msg = new_message(MSG_POST);
+            strcpy(msg->name, name);
+            msg->data = strdup(contents);
+            send_request(owner_of(name), msg, client);
+            return 0;
+        }
+
+        User *author = user;
+        User *target = find_user(name, users);
+        int status = make_post(author, target, contents, users);
+        if (status == 0) {
+            wal_log_post(wal, author->name, target->name, target->first_post->date, contents);
+            fan_out_post(target);
+            // printing out post for all instances of the user to whom the post was sent
+            notify_post(target, author, contents);
+        } else {
+            error(post_error(status), client);
+        }
+    } else if (cmd->kind == CMD_SEARCH && cmd->argc == 1) {
+        char terms[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM];
+        int num_terms = cmd->message.len > 0 ? parse_search_terms(cmd->message.start, terms) : 0;
+        if (num_terms < 1) {
+            error("Incorrect syntax\r\n", client);
+            return 0;
+        }
+
+        if (num_readers > 0 || num_shards > 1) {
+            // every shard is searched, by a reader or by each in turn
+            Message *msg = new_message(num_readers > 0 ? MSG_READ_SEARCH : MSG_SEARCH);
+            msg->data = malloc(sizeof(terms));
+            if (msg->data == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            memcpy(msg->data, terms, num_terms * SEARCH_MAX_TERM);
+            msg->count = num_terms;
+            if (num_readers > 0) {
+                send_read(msg, client);
+            } else {
+                send_request(0, msg, client);
+            }
+            return 0;
+        }
+        render_search(&users, 1, terms, num_terms, emit_to_client, client);
+        client_send(client, "", 1);
+    } else if (cmd->kind == CMD_FEED && cmd->argc <= 2) {
+        int limit = FEED_DEFAULT_SIZE;
+        if (cmd->argc == 2 &&
+                (parse_count(cmd->args[1].start, 1, &limit) == -1 || limit > FEED_TIMELINE_SIZE)) {
+            error("Incorrect syntax\r\n", client);
+            return 0;
+        }
+        send_feed(client, limit);
+    } else if (cmd->kind == CMD_STATS && cmd->argc == 1) {
+        char *buf;
+        size_t len;
+        FILE *out = open_memstream(&buf, &len);
+        if (out == NULL) {
+            perror("open_memstream");
+            exit(1);
+        }
+        write_stats(out, "\r\n");
+        fclose(out);
+        // the stream leaves a '\0' after the text, which ends the reply
+        client_send(client, buf, len + 1);
+        free(buf);
+    } else if (cmd->kind == CMD_MUTUAL && cmd->argc == 2) {
+        if (is_remote(name)) {
+            // the other shard intersects a copy of the user's friends
+            Message *msg = new_message(MSG_MUTUAL);
+            strcpy(msg->name, name);
+            copy_friends(user, msg);
+            send_request(owner_of(name), msg, client);
+            return 0;
+        }
+        User *other = find_user(name, users);
+        if (other == NULL) {
+            error("The user you entered does not exist\r\n", client);
+        } else {
+            char *buf = list_mutual_friends(user, other);
+            client_send(client, buf, strlen(buf) + 1);
+            free(buf);
+        }
+    } else if (cmd->kind == CMD_SUGGEST && cmd->argc <= 2) {
+        int k = DEFAULT_SUGGESTIONS;
+        if (cmd->argc == 2 &&
+                (parse_count(cmd->args[1].start, 1, &k) == -1 || k > MAX_SUGGESTIONS)) {
+            error("Incorrect syntax\r\n", client);
+            return 0;
+        }
+        if (num_shards > 1) {
+            start_suggestions(client, k);
+            return 0;
+        }
+        char *buf = list_suggestions(user, users, k);
+        client_send(client, buf, strlen(buf) + 1);
+        free(buf);
+    } else if (cmd->kind == CMD_PROFILE && cmd->argc >= 2 && cmd->argc <= 4) {
+        int offset = 0;
+        int limit = PROFILE_PAGE_SIZE;
+        if ((cmd->argc >= 3 && parse_count(cmd->args[2].start, 0, &offset) == -1) ||
+                (cmd->argc == 4 && parse_count(cmd->args[3].start, 1, &limit) == -1)) {
+            error("Incorrect syntax\r\n", client);
+            return 0;
+        }
+
+        if (num_readers > 0 && cmd->args[1].len < MAX_NAME) {
+            Message *msg = new_message(MSG_READ_PROFILE);
+            strcpy(msg->name, name);
+            msg->offset = offset;
+            msg->limit = limit;
+            send_read(msg, client);
+            return 0;
+        }
+        if (is_remote(name)) {
+            Message *msg = new_message(MSG_PROFILE);
+            strcpy(msg->name, name);
+            msg->offset = offset;
+            msg->limit = limit;
+            send_request(owner_of(name), msg, client);
+            return 0;
+        }
+
+        User *user = find_user(name, users);
+        if (user == NULL) {
+            error("User not found\r\n", client);
+        } else {
+            send_profile(client, user, offset, limit);
+        }
+    } else {
+        error("Incorrect syntax\r\n", client);
+    }
+    return 0;
+}
+
+
+/*
+ * Handle one complete line of input from client, with the "\r\n" removed.
+ * Return:  -1 for quit command
+ *          0 otherwise
+ */
+int process_line(Client *client, char *line) {
+    unsigned long started = metrics_now();
+
+    // if client is not logged in, either initialise client or search for client
+    if (client->user == NULL) {
+
+        // check if client is already in the User's list
+        User *user = find_user(line, users);
+
+        // client found in list of User's
+        if (user != NULL) {
+
+            // copy clients name
+            strncpy(client->name, line, sizeof(client->name) - 1);
+
+            // welcome message
+            char *msg = "Welcome back.\r\n";
+            client_send(client, msg, strlen(msg));
+        }
+
+        // initialising User name
+        else {
+
+            // if the name is too long, then truncate it
+            if (strlen(line) > MAX_NAME - 1) {
+                char *msg = "Username too long, truncated to 31 chars.\r\n";
+                client_send(client, msg, strlen(msg));
+            }
+
+            // otherwise, simply welcome user
+            else {
+                char *msg = "Welcome.\r\n";
+                client_send(client, msg, strlen(msg));
+            }
+
+            // updating client info
+            strncpy(client->name, line, sizeof(client->name) - 1);
+
+            // create the new user
+            create_user(client->name, users);
+            wal_log_user(wal, client->name);
+        }
+
+        // log the client in so that it receives the user's notifications
+        attach_session(client, find_user(client->name, users));
+
+        // ask user for commands
+        char *msg = "Go ahead and enter user commands>\r\n";
+        client_send(client, msg, strlen(msg));
+        histogram_record(&metrics->commands[CMD_LOGIN], metrics_now() - started);
+        return 0;
+    }
+
+    // if client is logged in, call process_args on the parsed command
+    Command cmd;
+    if (parse_command(line, &cmd) == 0) {
+        return 0;
+    }
+    client->command = cmd.kind;
+    client->command_started = started;
+    int result = process_args(&cmd, users, client->user, client);
+
+    // a command passed to another thread is recorded when its replies
+    // have arrived (see reply_arrived)
+    if (client->awaiting == 0) {
+        histogram_record(&metrics->commands[client->command], metrics_now() - started);
+    }
+    return result;
+}
+
+
+/*
+ * Resize client's input buffer to capacity bytes, which must hold what
+ * is buffered.
+ */
+void resize_input(Client *client, int capacity) {
+    char *buf = realloc(client->buf, capacity);
+    if (buf == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    client->buf = buf;
+    client->buf_cap = capacity;
+}
+
+
+/*
+ * Make room in client's full input buffer, which holds part of a single
+ * line. The buffer doubles until it can hold a line of max_line_length
+ * and its "\r\n"; a line longer than that is rejected, and its bytes are
+ * dropped as they arrive until it ends, so the client is never stalled
+ * and the buffer never grows past the limit.
+ */
+void make_input_room(Client *client) {
+    int limit = max_line_length + 2;
+    if (client->buf_cap < limit && !client->discarding) {
+        resize_input(client, client->buf_cap * 2 < limit ? client->buf_cap * 2 : limit);
+        return;
+    }
+
+    if (!client->discarding) {
+        error("Line too long\r\n", client);
+        client->discarding = 1;
+    }
+    // keep a last '\r', which may begin the newline that ends the line
+    int keep = client->buf[client->inbuf - 1] == '\r';
+    client->buf[0] = client->buf[client->inbuf - 1];
+    client->inbuf = keep;
+    client->scanned = 0;
+}
+
+
+/*
+ * Handle every complete line in the client's buffer, then move any partial
+ * line to the front of the buffer. Replies are only queued here; they go
+ * out together when the event loop flushes the client.
+ * Return:  -1 if the client quit
+ *          0 otherwise
+ */
+int process_buffered_lines(Client *client) {
+    int start = 0;
+    int result = 0;
+    int owner = -1;     // shard to hand the client over to
+    while (!client->closing && client->awaiting == 0) {
+        // stop handling commands while the client is not reading our
+        // replies; input resumes once the output queue drains
+        if (queued_output(client) > output_high_water) {
+            client->throttled = 1;
+            break;
+        }
+
+        // where is now the index into buf immediately after the next
+        // network newline; the search resumes where the last one ended
+        int from = client->scanned > start ? client->scanned : start;
+        int end = find_network_newline(client->buf + from, client->inbuf - from);
+        if (end <= 0) {
+            // the last byte may be the '\r' of a newline still to come
+            client->scanned = client->inbuf > from ? client->inbuf - 1 : from;
+            break;
+        }
+        client->where = from - start + end;
+
+        // the end of a line that was too long is dropped with it
+        if (client->discarding) {
+            client->discarding = 0;
+            start += client->where;
+            continue;
+        }
+
+        // Remove the "\r\n" from the end of the full line
+        char *line = client->buf + start;
+        line[client->where - 2] = '\0';
+
+        // a login is handled by the shard that owns the user, with the
+        // name still at the front of the buffer
+        if (client->user == NULL && num_shards > 1) {
+            char name[MAX_NAME];
+            strncpy(name, line, MAX_NAME - 1);
+            name[MAX_NAME - 1] = '\0';
+            if (owner_of(name) != shard->id) {
+                line[client->where - 2] = '\r';
+                owner = owner_of(name);
+                break;
+            }
+        }
+        start += client->where;
+
+        if (process_line(client, line) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    // You want to move the stuff after the full lines to the beginning
+    // of the buffer.
+    if (start > 0) {
+        client->inbuf -= start;
+        client->scanned = client->scanned > start ? client->scanned - start : 0;
+        memmove(client->buf, client->buf + start, client->inbuf);
+    }
+
+    // a buffer grown for a long line goes back to its usual size
+    if (client->buf_cap > INPUT_BUFFER_SIZE && client->inbuf < INPUT_BUFFER_SIZE) {
+        resize_input(client, INPUT_BUFFER_SIZE);
+    }
+
+    if (owner != -1) {
+        migrate_client(client, owner);
+    }
+    return result;
+}
+
+
+/*
+ * Read and process buffered client messages from the client's socket.
+ * The socket is registered edge-triggered, so keep reading until the
+ * kernel reports that no more data is available. Every complete line is
+ * handled after each read, so pipelined commands never wait for another
+ * readiness event.
+ * Return:  -1 if the client quit or disconnected and should be removed
+ *          0 otherwise
+ */
+int read_from_client(Client *client) {
+    while (1) {
+        // lines left over from before the client was throttled come first
+        if (process_buffered_lines(client) == -1) {
+            return -1;
+        }
+        if (client->closing || client->throttled || client->awaiting > 0) {
+            return 0;
+        }
+
+        // the buffer is full without a complete line: make room for a
+        // longer one, or drop a line that is too long
+        if (client->inbuf == client->buf_cap) {
+            make_input_room(client);
+        }
+
+        // This part of the code was taken from lab11
+        // Receive messages
+        int nbytes = read(client->fd, client->buf + client->inbuf,
+                          client->buf_cap - client->inbuf);
+
+        // checking if the read worked as intended
+        if (nbytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // socket drained
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != ECONNRESET) {
+                perror("read");
+            }
+            return -1;
+        }
+
+        // peer closed the connection
+        if (nbytes == 0) {
+            return -1;
+        }
+
+        // update inbuf (how many bytes were just added?)
+        client->inbuf += nbytes;
+        metrics->bytes_in += nbytes;
+    }
+}
+
+
+/*
+ * Note that one of the replies client was awaiting has arrived, and
+ * resume its input once they all have.
+ */
+void reply_arrived(Client *client) {
+    client->awaiting--;
+    if (client->awaiting > 0) {
+        return;
+    }
+    histogram_record(&metrics->commands[client->command],
+                     metrics_now() - client->command_started);
+    if (client->removed) {
+        free_client(client);
+    } else if (!client->closing && !client->throttled) {
+        if (read_from_client(client) == -1) {
+            close_client(client);
+        }
+    }
+}
+
+
+/*
+ * Adopt the client handed over in msg, and handle its login.
+ */
+void adopt_client(Message *msg) {
+    Client *client = pool_alloc(&client_pool);
+    memcpy(client, msg->data, sizeof(Client));
+    free(msg->data);
+
+    client->closing = 0;
+    client->next_closing = NULL;
+    client->pending_flush = 0;
+    client->next_pending = NULL;
+    client->migrated = 0;
+
+    client->prev = NULL;
+    client->next = clients;
+    if (clients != NULL) {
+        clients->prev = client;
+    }
+    clients = client;
+    num_clients++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    if (queued_output(client) > 0) {
+        client->pending_flush = 1;
+        client->next_pending = pending_clients;
+        pending_clients = client;
+    }
+    if (read_from_client(client) == -1) {
+        close_client(client);
+    }
+}
+
+
+/*
+ * Add this shard's user list to the lists being collected in msg, by
+ * reference, and pass it on to the next shard, or back to the client
+ * after the last one.
+ */
+void handle_list_users(Message *msg) {
+    int len;
+    Rendering *list = acquire_user_list(users, &len);
+    add_message_ref(msg, list, len);
+
+    if (shard->id + 1 < num_shards) {
+        send_message(shard->id + 1, msg);
+    } else {
+        Buffer buffer = {NULL, 0, 0};
+        emit_to_buffer(&buffer, "", 1);
+        msg->data = buffer.data;
+        msg->len = buffer.len;
+        send_reply(msg, MSG_OUTPUT);
+    }
+}
+
+
+/*
+ * Add this shard's newest posts with the words of msg to its hits, and
+ * pass it on to the next shard, or send the hits back to the client after
+ * the last one.
+ */
+void handle_search(Message *msg) {
+    add_search_hits(msg);
+
+    if (shard->id + 1 < num_shards) {
+        send_message(shard->id + 1, msg);
+        return;
+    }
+    Buffer buffer = {NULL, 0, 0};
+    for (int i = 0; i < msg->num_hits; i++) {
+        if (i > 0) {
+            emit_to_buffer(&buffer, "===\r\n", 5);
+        }
+        emit_to_buffer(&buffer, msg->hits[i].text, msg->hits[i].len);
+        free(msg->hits[i].text);
+    }
+    emit_to_buffer(&buffer, "", 1);
+    free(msg->hits);
+    msg->hits = NULL;
+    msg->num_hits = 0;
+    free(msg->data);
+    msg->data = buffer.data;
+    msg->len = buffer.len;
+    send_reply(msg, MSG_OUTPUT);
+}
+
+
+/*
+ * Add a post of the sending shard to the timelines of the local users in
+ * msg->friends.
+ */
+void handle_feed_push(Message *msg) {
+    const UserTable *table = &shards[msg->from].users;
+    for (int i = 0; i < msg->count; i++) {
+        push_timeline(msg->friends[i], table, msg->post_id);
+    }
+    free(msg->friends);
+    free(msg);
+}
+
+
+/*
+ * Add msg->user to the friends of the local user msg->name, if the
+ * requester holds a slot for them, and report back.
+ */
+void handle_friend(Message *msg) {
+    User *other = find_user(msg->name, users);
+    if (other == NULL) {
+        msg->status = 4;
+    } else if (is_friend(other, msg->user)) {
+        msg->status = 1;
+    } else if (!msg->reserved) {
+        msg->status = 2;
+    } else {
+        msg->status = add_friend(other, msg->user, users->max_friends);
+    }
+    if (msg->status == 0) {
+        wal_log_friend(wal, other->name, msg->user->name);
+        notify_friended(other, msg->user->name);
+    }
+    msg->other = other;
+    send_reply(msg, MSG_FRIEND_REPLY);
+}
+
+
+/*
+ * Complete a make_friends request with a user owned by another shard.
+ */
+void handle_friend_reply(Message *msg) {
+    User *user = msg->user;
+    if (msg->reserved) {
+        user->reserved_friends--;
+    }
+    if (msg->status == 0 && add_friend(user, msg->other, 0) == 0) {
+        wal_log_friend(wal, user->name, msg->other->name);
+    }
+    if (!msg->client->removed) {
+        report_friends(msg->client, msg->status,
+                       msg->other != NULL ? msg->other->name : msg->name);
+    }
+    reply_arrived(msg->client);
+    free(msg);
+}
+
+
+/*
+ * Post msg->data from msg->user to the local user msg->name.
+ */
+void handle_post(Message *msg) {
+    User *target = find_user(msg->name, users);
+    int status = make_post(msg->user, target, msg->data, users);
+    if (status == 0) {
+        wal_log_post(wal, msg->user->name, target->name, target->first_post->date, msg->data);
+        fan_out_post(target);
+        notify_post(target, msg->user, msg->data);
+        free(msg->data);
+        msg->data = NULL;
+        msg->len = 0;
+    } else {
+        free(msg->data);
+        msg->data = strdup(post_error(status));
+        if (msg->data == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        msg->len = strlen(msg->data) + 1;
+    }
+    send_reply(msg, MSG_OUTPUT);
+}
+
+
+/*
+ * Render a page of the profile of the local user msg->name.
+ */
+void handle_profile(Message *msg) {
+    reply_profile(msg, users);
+}
+
+
+/*
+ * List the mutual friends of msg->user, whose friends were copied into
+ * msg, and the local user msg->name.
+ */
+void handle_mutual(Message *msg) {
+    User *other = find_user(msg->name, users);
+    if (other == NULL) {
+        msg->data = strdup("The user you entered does not exist\r\n");
+    } else {
+        User proxy;
+        memset(&proxy, 0, sizeof(proxy));
+        strcpy(proxy.name, msg->user->name);
+        proxy.id = msg->user->id;
+        proxy.friends = msg->friends;
+        proxy.friend_ids = msg->friend_ids;
+        proxy.num_friends = msg->count;
+        msg->data = list_mutual_friends(&proxy, other);
+    }
+    if (msg->data == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    msg->len = strlen(msg->data) + 1;
+    free(msg->friends);
+    free(msg->friend_ids);
+    msg->friends = NULL;
+    msg->friend_ids = NULL;
+    send_reply(msg, MSG_OUTPUT);
+}
+
+
+/*
+ * Copy the friend sets of the local users listed in msg->friends.
+ */
+void handle_gather(Message *msg) {
+    int total = 0;
+    for (int i = 0; i < msg->count; i++) {
+        total += msg->friends[i]->num_friends;
+    }
+    // room for at least one of each, since malloc(0) may return NULL
+    int size = total > 0 ? total : 1;
+    User **friends = malloc(size * sizeof(User *));
+    unsigned int *friend_ids = malloc(size * sizeof(unsigned int));
+    msg->counts = malloc((msg->count > 0 ? msg->count : 1) * sizeof(int));
+    if (friends == NULL || friend_ids == NULL || msg->counts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int n = 0;
+    for (int i = 0; i < msg->count; i++) {
+        User *friend = msg->friends[i];
+        memcpy(friends + n, friend->friends, friend->num_friends * sizeof(User *));
+        memcpy(friend_ids + n, friend->friend_ids, friend->num_friends * sizeof(unsigned int));
+        msg->counts[i] = friend->num_friends;
+        n += friend->num_friends;
+    }
+    free(msg->friends);
+    msg->friends = friends;
+    msg->friend_ids = friend_ids;
+    send_reply(msg, MSG_GATHER_REPLY);
+}
+
+
+/*
+ * Fill in the proxies for the friends whose sets msg carries, and list
+ * the suggestions once the last set has arrived.
+ */
+void handle_gather_reply(Message *msg) {
+    Client *client = msg->client;
+    Gather *gather = client->gather;
+    User **friends = msg->friends;
+    unsigned int *friend_ids = msg->friend_ids;
+    int j = 0;
+    for (int i = 0; i < gather->proxy.num_friends; i++) {
+        User *friend = gather->friends[i];
+        if (shard_of(friend->hash, num_shards) != (unsigned int)msg->from) {
+            continue;
+        }
+        User *proxy = &gather->proxies[i];
+        strcpy(proxy->name, friend->name);
+        proxy->id = friend->id;
+        proxy->friends = friends;
+        proxy->friend_ids = friend_ids;
+        proxy->num_friends = msg->counts[j];
+        friends += msg->counts[j];
+        friend_ids += msg->counts[j];
+        j++;
+        gather->proxy.friends[i] = proxy;
+    }
+
+    // the copied sets are freed with the gather
+    msg->mail.next = gather->replies == NULL ? NULL : &gather->replies->mail;
+    gather->replies = msg;
+
+    if (client->awaiting == 1 && !client->removed) {
+        finish_suggestions(client);
+    }
+    reply_arrived(client);
+}
+
+
+/*
+ * Send client the output of a request to another shard.
+ */
+void handle_output(Message *msg) {
+    for (int i = 0; i < msg->num_refs; i++) {
+        if (msg->client->removed) {
+            release_rendering(msg->refs[i].rendering);
+        } else {
+            client_send_ref(msg->client, msg->refs[i].rendering, msg->refs[i].len);
+        }
+    }
+    free(msg->refs);
+    if (msg->len > 0 && !msg->client->removed) {
+        client_send(msg->client, msg->data, msg->len);
+    }
+    free(msg->data);
+    reply_arrived(msg->client);
+    free(msg);
+}
+
+
+/*
+ * Handle every message in this shard's inbox.
+ */
+void handle_messages() {
+    Mail *mail = mailbox_take(&shard->inbox);
+    while (mail != NULL) {
+        Message *msg = (Message *)mail;
+        mail = mail->next;
+        messages_received++;
+
+        switch (msg->type) {
+            case MSG_MIGRATE:
+                adopt_client(msg);
+                free(msg);
+                break;
+            case MSG_LIST_USERS:
+                handle_list_users(msg);
+                break;
+            case MSG_SEARCH:
+                handle_search(msg);
+                break;
+            case MSG_FEED_PUSH:
+                handle_feed_push(msg);
+                break;
+            case MSG_FRIEND:
+                handle_friend(msg);
+                break;
+            case MSG_FRIEND_REPLY:
+                handle_friend_reply(msg);
+                break;
+            case MSG_POST:
+                handle_post(msg);
+                break;
+            case MSG_PROFILE:
+                handle_profile(msg);
+                break;
+            case MSG_MUTUAL:
+                handle_mutual(msg);
+                break;
+            case MSG_GATHER:
+                handle_gather(msg);
+                break;
+            case MSG_GATHER_REPLY:
+                handle_gather_reply(msg);
+                break;
+            case MSG_OUTPUT:
+                handle_output(msg);
+                break;
+        }
+    }
+}
 
-User *user_list_ptr;
 
-/* 
- * Print a formatted error message to stderr.
+/*
+ * Post the messages queued for each shard and reader during this batch
+ * of events.
  */
-void error(char *msg, int fd) {
-    int num = write(fd, msg, strlen(msg) + 1);
-
-    // checking if write worked as intended
-    if (num == -1) {
-        perror("write");
-        exit(1);
+void send_outboxes() {
+    for (int i = 0; i < num_shards + num_readers; i++) {
+        if (outbox_newest[i] != NULL) {
+            Mailbox *inbox = i < num_shards ? &shards[i].inbox : &readers[i - num_shards].inbox;
+            mailbox_post(inbox, &outbox_newest[i]->mail, &outbox_oldest[i]->mail);
+            outbox_newest[i] = NULL;
+            outbox_oldest[i] = NULL;
+        }
     }
 }
 
 
 /*
- * Accept a connection. Note that a new file descriptor is created for
- * communication with the client. The initial socket descriptor is used
- * to accept connections, but the new socket is used to communicate.
- * Return the new client's file descriptor.
+ * Render a page of the profile of msg->name, on a reader.
  */
-void accept_client_connection(int listenfd) {
-    struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
-    peer.sin_family = AF_INET;
+void handle_read_profile(Message *msg) {
+    reply_profile(msg, &shards[owner_of(msg->name)].users);
+}
 
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
-    if (client_socket < 0) {
-        perror("accept");
-        exit(1);
+
+/*
+ * List the users of every shard, in shard order, or the page of them in
+ * name order that msg asks for (see render_user_page), on a reader.
+ */
+void handle_read_list_users(Message *msg) {
+    Buffer buffer = {NULL, 0, 0};
+    if (msg->name[0] == '\0' && msg->limit < 0) {
+        for (int i = 0; i < num_shards; i++) {
+            int len;
+            Rendering *list = acquire_user_list(&shards[i].users, &len);
+            add_message_ref(msg, list, len);
+        }
+    } else {
+        render_user_page(msg->name, msg->offset, msg->limit, emit_to_buffer, &buffer);
     }
+    emit_to_buffer(&buffer, "", 1);
+    msg->data = buffer.data;
+    msg->len = buffer.len;
+    send_reply(msg, MSG_OUTPUT);
+}
 
-    // initialize new client
 
-    // dynamically allocate memory for the client
-    Client *client = malloc(sizeof(Client));
-    if (!client) {
-    	perror("malloc");
-    	exit(1);
+/*
+ * Search the posts of every shard for the words of msg, on a reader.
+ */
+void handle_read_search(Message *msg) {
+    UserTable *tables[MAX_SHARDS];
+    for (int i = 0; i < num_shards; i++) {
+        tables[i] = &shards[i].users;
     }
+    Buffer buffer = {NULL, 0, 0};
+    render_search(tables, num_shards, (char (*)[SEARCH_MAX_TERM])msg->data, msg->count,
+                  emit_to_buffer, &buffer);
+    emit_to_buffer(&buffer, "", 1);
+    free(msg->data);
+    msg->data = buffer.data;
+    msg->len = buffer.len;
+    send_reply(msg, MSG_OUTPUT);
+}
 
-    client->fd = client_socket;
-    client->inbuf = 0;
-    client->room = 0;
-    client->after = client->buf;
-    client->where = 0;
 
-    // adding the new client to the linked client list
-    client->next = clients;
-    clients = client;
+/*
+ * Serve the reads sent to reader r until the server exits. The renderings
+ * a reader caches replace older ones, which it retires like a writer.
+ */
+void *run_reader(void *arg) {
+    Reader *reader = arg;
+    self = num_shards + reader->id;
+    epoch_register();
+
+    struct pollfd inbox;
+    inbox.fd = reader->inbox.event_fd;
+    inbox.events = POLLIN;
+    while (1) {
+        if (poll(&inbox, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
 
-    // empty client name
-    for (int i = 0; i < MAX_NAME; i++){
-    	client->name[i] = '\0';
-    }
+        Mail *mail = mailbox_take(&reader->inbox);
+        epoch_enter();
+        while (mail != NULL) {
+            Message *msg = (Message *)mail;
+            mail = mail->next;
+            messages_received++;
+            switch (msg->type) {
+                case MSG_READ_PROFILE:
+                    handle_read_profile(msg);
+                    break;
+                case MSG_READ_LIST_USERS:
+                    handle_read_list_users(msg);
+                    break;
+                case MSG_READ_SEARCH:
+                    handle_read_search(msg);
+                    break;
+            }
+        }
+        epoch_exit();
 
-    // empty client buffer
-    for (int i = 0; i < INPUT_BUFFER_SIZE; i++) {
-        client->buf[i] = '\0';
+        send_outboxes();
+        epoch_collect();
     }
+    return NULL;
+}
 
-    // ask user for User name
-    char *msg = "What is your user name?\r\n";
-    int num =write(client->fd, msg, strlen(msg));
 
-    // checking if write worked as intended
-    if (num == -1) {
-        perror("write");
-        exit(1);
+/*
+ * Write out the output queued for every client during this batch of events.
+ * A throttled client whose queue has drained resumes reading, which may
+ * queue more output, so keep going until no client has anything pending.
+ */
+void flush_pending_clients() {
+    while (pending_clients != NULL) {
+        Client *client = pending_clients;
+        pending_clients = client->next_pending;
+        client->pending_flush = 0;
+
+        if (client->closing) {
+            continue;
+        }
+        if (flush_client(client) == -1) {
+            close_client(client);
+            continue;
+        }
+        if (client->throttled && queued_output(client) <= output_high_water / 2) {
+            client->throttled = 0;
+            if (read_from_client(client) == -1) {
+                close_client(client);
+            }
+        }
     }
 }
 
 
 /*
- * Search the first n characters of buf for a network newline (\r\n).
- * Return one plus the index of the '\n' of the first network newline,
- * or -1 if no network newline is found. The return value is the index into buf
- * where the current line ends.
- * Definitely do not use strchr or other string functions to search here. (Why not?)
+ * Start writing a snapshot of users in a child process, which shares the
+ * parent's memory copy-on-write, so the event loop only pauses for the
+ * log rotation and the fork itself.
  */
-int find_network_newline(const char *buf, int n) {
-    for (int i = 0; i < n; i++) {
-        if (buf[i] == '\r') {
-            if (buf[i+1] == '\n') {
-                return i + 2;
-            }
+void start_snapshot() {
+    wal_rotate(wal);
+    records_at_snapshot = wal->records;
+    last_snapshot = monotonic_now();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        // the rotated segment is kept and covered by the next snapshot
+        perror("fork");
+        snapshots_failed++;
+        return;
+    }
+    if (pid == 0) {
+        if (snapshot_write(shard->snapshot_path, users, wal->generation) == -1) {
+            perror("snapshot");
+            _exit(1);
         }
+        _exit(0);
     }
-    return -1;
+    snapshot_pid = pid;
+    snapshot_generation = wal->generation;
+    snapshot_started = last_snapshot;
 }
 
 
 /*
- * Tokenize the string stored in cmd.
- * Return the number of tokens, and store the tokens in cmd_argv.
+ * If the snapshot child has exited, reap it. Once a snapshot is in place,
+ * the log segments it covers are deleted.
  */
-int tokenize(char *cmd, char **cmd_argv, int fd) {
-    int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
-    while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-            error("Too many arguments!", fd);
-            cmd_argc = 0;
-            break;
-        }
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc++;
-        next_token = strtok(NULL, DELIM);
+void reap_snapshot() {
+    if (snapshot_pid == 0) {
+        return;
     }
+    int status;
+    pid_t pid = waitpid(snapshot_pid, &status, WNOHANG);
+    if (pid == 0) {
+        return;
+    } else if (pid == -1) {
+        perror("waitpid");
+        exit(1);
+    }
+    snapshot_pid = 0;
 
-    return cmd_argc;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "snapshot failed; its log segments are kept\n");
+        snapshots_failed++;
+        return;
+    }
+    last_snapshot_ms = (monotonic_now() - snapshot_started) * 1e3;
+    snapshots_taken++;
+
+    char segment[WAL_MAX_PATH];
+    for (; oldest_segment < snapshot_generation; oldest_segment++) {
+        wal_segment_path(segment, sizeof(segment), wal->path, oldest_segment);
+        if (unlink(segment) == -1 && errno != ENOENT) {
+            perror("unlink");
+        }
+    }
 }
 
 
-/* 
- * Read and process commands
- * Return:  -1 for quit command
- *          0 otherwise
+/*
+ * Return the number of milliseconds until a snapshot is due (or until the
+ * running one should be checked on), or -1 if none is.
  */
-int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, User *user, int fd) {
-    User *user_list = *user_list_ptr;
-
-    if (cmd_argc <= 0) {
-        return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
+int snapshot_timeout() {
+    if (snapshot_pid != 0) {
+        return SNAPSHOT_POLL_INTERVAL;
+    }
+    if (snapshot_interval == 0 || wal->records == records_at_snapshot) {
         return -1;
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-		char *buf = list_users(user_list);
-		int num = write(fd, buf, strlen(buf) + 1);
-        // checking if write worked as intended
-        if (num == -1) {
-            perror("write");
-            exit(1);
-        }
-		free(buf);
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
-        char buf[INPUT_BUFFER_SIZE];
-        char friend_buf[INPUT_BUFFER_SIZE];
-        switch (make_friends(user->name, cmd_argv[1], user_list)) {
-            case 0:
-            	strcpy(buf, "You are now friends with ");
-            	strcat(buf, cmd_argv[1]);
-            	strcat(buf, "\r\n");
-            	int num = write(fd, buf, strlen(buf));
-                // checking if write worked as intended
-                if (num == -1) {
-                    perror("write");
-                    exit(1);
-                }
-                // printing out message for all instances of the user that was friended
-                strcpy(friend_buf, "You have been friended by ");
-                strcat(friend_buf, user->name);
-                strcat(friend_buf, "\r\n");
-                Client *curr = clients;
-                while (curr != NULL) {
-                    if (strcmp(curr->name, cmd_argv[1]) == 0) {
-                        int num = write(curr->fd, friend_buf, strlen(friend_buf));
-                        // checking if write worked as intended
-                        if (num == -1) {
-                            perror("write");
-                            exit(1);
-                        }
-                    }
-                    curr = curr->next;
-                }
-            	break;
-            case 1:
-                error("You are already friends.\r\n", fd);
-                break;
-            case 2:
-                error("At least one of you entered has the max number of friends\r\n", fd);
-                break;
-            case 3:
-                error("You can't friend yourself\r\n", fd);
-                break;
-            case 4:
-                error("The user you entered does not exist\r\n", fd);
-                break;
-        }
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 2; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
+    }
+    double remaining = last_snapshot + snapshot_interval - monotonic_now();
+    return remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+}
 
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            free(contents);
-            perror("malloc");
-            exit(1);
-        }
 
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[2]);
-        for (int i = 3; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
-
-        User *author = user;;
-        User *target = find_user(cmd_argv[1], user_list);
-        char buf[INPUT_BUFFER_SIZE];
-        switch (make_post(author, target, contents)) {
-            case 0:
-                // printing out post for all instances of the user to whom the post was sent
-                strcpy(buf, "From ");
-                strcat(buf, author->name);
-                strcat(buf, ": ");
-                strcat(buf, target->first_post->contents);
-                strcat(buf, "\r\n");
-                Client *curr = clients;
-                while (curr != NULL) {
-                    if (strcmp(curr->name, target->name) == 0) {
-                        int num = write(curr->fd, buf, strlen(buf));
-                        // checking if write worked as intended
-                        if (num == -1) {
-                            perror("write");
-                            exit(1);
-                        }
-                    }
-                    curr = curr->next;
-                }
-                break;
-            case 1:
-                error("You can only post to your friends\r\n", fd);
-                break;
-            case 2:
-                error("The user you want to post to does not exist\r\n", fd);
-                break;
-        }
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
-        char *buf = print_user(user);
-        if (strcmp(buf, "") == 0) {
-            error("User not found\r\n", fd);
-        }
-        int num = write(fd, buf, strlen(buf) + 1);
-        // checking if write worked as intended
-        if (num == -1) {
-            perror("write");
-            exit(1);
-        }
-        free(buf);
-    } else {
-        error("Incorrect syntax\r\n", fd);
+/*
+ * Write this shard's statistics to its metrics file. The file is replaced
+ * with a rename, so whatever reads it never sees it half written.
+ */
+void dump_metrics() {
+    last_metrics_dump = monotonic_now();
+
+    char tmp_path[WAL_MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", shard->metrics_path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        perror(tmp_path);
+        return;
+    }
+    write_stats(out, "\n");
+    if (fclose(out) == EOF) {
+        perror(tmp_path);
+        return;
+    }
+    if (rename(tmp_path, shard->metrics_path) == -1) {
+        perror("rename");
     }
-    return 0;
 }
 
 
 /*
- * Read and process buffered client message from client fds.
+ * Return the number of milliseconds until the metrics file is due to be
+ * written, or -1 if there is none.
  */
-void read_from_client(Client *client) {
-    // This part of the code was taken from lab11
-    // Receive messages
-    int nbytes = read(client->fd, client->after, client->room);
-    
-    // checking if the read worked as intended
-    if (nbytes == -1) {
-        perror("read");
-        exit(1);
+int metrics_timeout() {
+    if (metrics_path == NULL) {
+        return -1;
     }
-    // update inbuf (how many bytes were just added?)
-    client->inbuf += nbytes;
-
-    // where is now the index into buf immediately after 
-    // the first network newline
-    client->where = find_network_newline(client->buf, client->inbuf);
-    // the condition below calls find_network_newline
-    // to determine if a full line has been read from the client.
-    if (client->where > 0) {
-
-        // Output the full line, not including the "\r\n",
-        // using print statement below.
-        client->buf[client->where - 1] = '\0';
-        client->buf[client->where - 2] = '\0';
-
-        // if client does not have name, either initialise client or search for client
-        if (client->name[0] == '\0') {
-            
-            // check if client is already in the User's list
-            User *user = user_list_ptr;
-            while (user != NULL) {
-                if (strcmp(user->name, client->buf) == 0) {
-                    break;
-                }
-                user = user->next;
-            }
+    double remaining = last_metrics_dump + metrics_interval - monotonic_now();
+    return remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+}
 
-            // client found in list of User's
-            if (user != NULL) {
 
-                // copy clients name
-                strncpy(client->name, client->buf, sizeof(client->name) - 1);
+/*
+ * Sweep this shard's posts for those past the retention limits, within
+ * EXPIRE_BUDGET, so the event loop is never held up for long.
+ */
+void sweep_posts() {
+    last_expire = monotonic_now();
+    unsigned long started = metrics_now();
+    expire_behind = expire_posts(users, time(NULL), EXPIRE_BUDGET);
+    histogram_record(&metrics->expire, metrics_now() - started);
+}
 
-                // welcome message
-                char *msg = "Welcome back.\r\n";
-                int num = write(client->fd, msg, strlen(msg));
-                // checking if write worked as intended
-                if (num == -1) {
-                    perror("write");
-                    exit(1);
-                }
-            }
 
-            // initialising User name
-            else {
+/*
+ * Return the number of milliseconds until the next sweep for expired
+ * posts, or -1 if posts do not expire.
+ */
+int expire_timeout() {
+    if (users->max_posts == 0 && users->max_post_age == 0) {
+        return -1;
+    }
+    if (expire_behind) {
+        return 0;
+    }
+    double remaining = last_expire + EXPIRE_INTERVAL / 1000.0 - monotonic_now();
+    return remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+}
 
-                // if the name is too long, then truncate it
-                if (strlen(client->buf) > MAX_NAME - 1) {
-                    char *msg = "Username too long, truncated to 31 chars.\r\n";
-                    int num = write(client->fd, msg, strlen(msg));
-                    // checking if write worked as intended
-                    if (num == -1) {
-                        perror("write");
-                        exit(1);
-                    }
-                }
 
-                // otherwise, simply welcome user
-                else {
-                    char *msg = "Welcome.\r\n";
-                    int num = write(client->fd, msg, strlen(msg));
-                    // checking if write worked as intended
-                    if (num == -1) {
-                        perror("write");
-                        exit(1);
-                    }
-                }
+/*
+ * Return the shorter of two epoll timeouts, where -1 means none.
+ */
+int min_timeout(int a, int b) {
+    if (a == -1) {
+        return b;
+    } else if (b == -1) {
+        return a;
+    }
+    return a < b ? a : b;
+}
 
-                // updating client info
-                strncpy(client->name, client->buf, sizeof(client->name) - 1);
 
-                // create the new user
-                create_user(client->name, &user_list_ptr);
-            }
+/*
+ * Print the command line usage and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-w output_high_water_bytes] [-f max_friends] [-F fanout_limit]\n"
+                    "       [-l wal_path] [-s always|interval|never] [-i sync_interval_ms]\n"
+                    "       [-P snapshot_path] [-S snapshot_interval_seconds] [-t threads]\n"
+                    "       [-r reader_threads] [-m metrics_path] [-M metrics_interval_seconds]\n"
+                    "       [-L max_line_length] [-K max_posts_per_user]\n"
+                    "       [-E max_post_age_seconds]\n",
+            prog);
+    exit(1);
+}
 
-            // ask user for commands
-            char *msg = "Go ahead and enter user commands>\r\n";
-            int num = write(client->fd, msg, strlen(msg));
-            // checking if write worked as intended
-            if (num == -1) {
-                perror("write");
-                exit(1);
-            }
-        }
 
-        // if client has a name, find the user and call process_args on the tokenized command
-        else {
+/*
+ * Write path, or with more than one shard the shard's own file next to
+ * it, into buf.
+ */
+void shard_path(char *buf, const char *path, int id) {
+    if (num_shards == 1) {
+        snprintf(buf, WAL_MAX_PATH, "%s", path);
+    } else {
+        snprintf(buf, WAL_MAX_PATH, "%s.shard%d", path, id);
+    }
+}
 
-            // tokenize input
-            char *cmd_argv[INPUT_ARG_MAX_NUM];
-            int cmd_argc = tokenize(client->buf, cmd_argv, client->fd);
 
-            User *user = user_list_ptr;
-            while (user != NULL) {
-                if (strcmp(user->name, client->name) == 0) {
-                    break;
-                }
-                user = user->next;
-            }
+/*
+ * Apply the given replay pass to every log segment of shard s, starting
+ * at its oldest one, and to its current log.
+ * Return the number of records applied; the current log's generation is
+ * stored in *generation.
+ */
+long replay_logs(Shard *s, int pass, UserTable *tables, unsigned long *generation) {
+    long applied = 0;
+    char segment[WAL_MAX_PATH];
+    unsigned long segment_generation;
+    for (unsigned long g = s->oldest_segment;; g++) {
+        wal_segment_path(segment, sizeof(segment), s->wal_path, g);
+        if (access(segment, F_OK) == -1) {
+            *generation = g;
+            break;
+        }
+        applied += wal_replay(segment, pass, tables, num_shards, &segment_generation);
+    }
+    applied += wal_replay(s->wal_path, pass, tables, num_shards, generation);
+    return applied;
+}
 
-            // process commands. if quit, then remove client from clients list
-            if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, &user_list_ptr,
-                    user, client->fd) == -1) {
-
-                // iterating over client linked list to find the client
-                Client *curr = clients;
-                while (curr != NULL) {
-                    if (curr == client) {
-                        break;
-                    }
-                    curr = curr->next;
-                }
 
-                // removing client from client linked list by make the previous client linked to the next client of deleted client
-                Client *prev = clients;
-                if (prev == curr) {
-                    clients = curr->next;
-                } else {
-                    while (prev->next != curr) {
-                        prev = prev->next;
-                    }
-                    prev->next = curr->next;
-                }
+/*
+ * Rebuild every shard's users from its snapshot, then from the log
+ * segments the snapshot does not cover and the current log, and open the
+ * logs for new changes. Friendships and posts may refer to users of any
+ * shard, so every user is created before any of them are applied.
+ */
+void load_state(const char *wal_path, int sync_policy, int sync_interval) {
+    double start = monotonic_now();
+    UserTable *tables = malloc(num_shards * sizeof(UserTable));
+    Snapshot *snapshots = malloc(num_shards * sizeof(Snapshot));
+    int *mapped = malloc(num_shards * sizeof(int));
+    unsigned long *generations = malloc(num_shards * sizeof(unsigned long));
+    if (tables == NULL || snapshots == NULL || mapped == NULL || generations == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-                // freeing dynamically allocated memory
-                free(client);
-            }
+    // replay works on copies of the tables, which are copied back below
+    long loaded = 0;
+    for (int k = 0; k < num_shards; k++) {
+        tables[k] = shards[k].users;
+        mapped[k] = snapshot_open(shards[k].snapshot_path, &snapshots[k]) == 0;
+        shards[k].oldest_segment = 0;
+        if (mapped[k]) {
+            loaded += snapshot_load_users(&snapshots[k], &tables[k]);
+            shards[k].oldest_segment = snapshots[k].header->wal_generation;
         }
+    }
+    double loaded_at = monotonic_now();
+    if (loaded > 0) {
+        fprintf(stderr, "loaded %ld users from %s in %.1f ms\n", loaded, snapshot_path,
+                (loaded_at - start) * 1e3);
+    }
 
-        // update inbuf and remove the full line from the buffer
-        client->inbuf -= client->where;
+    long recovered = 0;
+    for (int k = 0; k < num_shards; k++) {
+        shards[k].recovered = replay_logs(&shards[k], WAL_REPLAY_USERS, tables, &generations[k]);
+    }
 
-        for (int i = 0; i < client->where; i++) {
-            client->buf[i] = '\0';
+    // ids are handed out round robin over the shards
+    unsigned long num_ids = 0;
+    for (int k = 0; k < num_shards; k++) {
+        unsigned long end = tables[k].id_offset + (unsigned long)tables[k].count * tables[k].id_stride;
+        if (end > num_ids) {
+            num_ids = end;
         }
+    }
+    User **users_by_id = calloc(num_ids + 1, sizeof(User *));
+    if (users_by_id == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int k = 0; k < num_shards; k++) {
+        for (User *user = tables[k].head; user != NULL; user = user->next) {
+            users_by_id[user->id] = user;
+        }
+    }
 
-        // You want to move the stuff after the full line to the beginning
-        // of the buffer.
-        memmove(&(client->buf), &(client->buf[client->where]), client->inbuf);
-
+    for (int k = 0; k < num_shards; k++) {
+        if (mapped[k]) {
+            snapshot_load_links(&snapshots[k], &tables[k], users_by_id, num_ids);
+        }
     }
-    // update after and room, in preparation for the next read.
-    client->after = client->buf + client->inbuf;
-    client->room = INPUT_BUFFER_SIZE - client->inbuf;
+    for (int k = 0; k < num_shards; k++) {
+        shards[k].recovered += replay_logs(&shards[k], WAL_REPLAY_CHANGES, tables, &generations[k]);
+        recovered += shards[k].recovered;
+        shards[k].users = tables[k];
+        wal_open(&shards[k].wal, shards[k].wal_path, generations[k], sync_policy, sync_interval);
+    }
+    double recovered_at = monotonic_now();
+    fprintf(stderr, "recovered %ld records from %s in %.1f ms (startup took %.1f ms)\n",
+            recovered, wal_path, (recovered_at - loaded_at) * 1e3,
+            (recovered_at - start) * 1e3);
+
+    free(users_by_id);
+    free(generations);
+    free(mapped);
+    free(snapshots);
+    free(tables);
 }
 
 
-int main() {
-
-    // list of clients whose head is pointed to by *user_list_ptr
+/*
+ * Run the event loop of shard s, whose listening socket shares the port
+ * with every other shard's (SO_REUSEPORT), so the kernel spreads new
+ * connections over the shards.
+ */
+void *run_shard(void *arg) {
+    shard = arg;
+    self = shard->id;
+    // feeds read the users of other shards as readers do
+    epoch_register();
+    users = &shard->users;
+    wal = &shard->wal;
+    metrics = &shard->metrics;
+    oldest_segment = shard->oldest_segment;
+    last_snapshot = monotonic_now();
+    last_metrics_dump = last_snapshot;
+    last_expire = last_snapshot;
+    // a log recovered at startup is folded into the first snapshot
+    records_at_snapshot = shard->recovered > 0 ? -1 : 0;
+
+    // list of clients whose head is pointed to by clients
     clients = NULL;
-
-    // list of User's whose head is pointed to by *user_list_ptr
-    user_list_ptr = NULL;
+    num_clients = 0;
+    init_pool(&client_pool, sizeof(Client));
+    closing_clients = NULL;
+    pending_clients = NULL;
 
     // This part of the code was taken from lab10
     // Create the socket FD.
@@ -478,6 +3036,11 @@ int main() {
     if (status == -1) {
         perror("setsockopt -- REUSEADDR");
     }
+    // every shard listens on the same port
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &on, sizeof(on)) == -1) {
+        perror("setsockopt -- REUSEPORT");
+        exit(1);
+    }
 
     // This should always be zero. On some systems, it won't error if you
     // forget, but on others, you'll get mysterious errors. So zero it.
@@ -497,45 +3060,269 @@ int main() {
         exit(1);
     }
 
-    Client *client;
+    // the listening socket must not block once it is drained
+    set_nonblocking(sock_fd);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // the listening socket is registered with a NULL data pointer and the
+    // inbox with a pointer to it, so both can be told apart from clients
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shard->inbox;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shard->inbox.event_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
 
     while (1) {
-        // The client accept - message accept loop. First, we prepare to listen to multiple
-        // file descriptors by initializing a set of file descriptors.
-        int max_fd = sock_fd;
-        fd_set all_fds;
-        FD_ZERO(&all_fds);
-        FD_SET(sock_fd, &all_fds);
-
-        // initialize fd's of all clients and find max_fd
-        client = clients;
-        while (client != NULL) {
-            FD_SET(client->fd, &all_fds);
-            if (client->fd > max_fd)
-                max_fd = client->fd;
-            client = client->next;
-        }
-
-        // waiting for activity on any fd 
-        if (select(max_fd + 1, &all_fds, NULL, NULL, NULL) == -1) {
-            perror("server: select");
+        // waiting for activity on any registered fd, or for the next
+        // interval sync of the log
+        int timeout = min_timeout(min_timeout(wal_sync_timeout(wal), expire_timeout()),
+                                  min_timeout(snapshot_timeout(), metrics_timeout()));
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("server: epoll_wait");
             exit(1);
         }
 
-        // check fds of clients
-        client = clients;
-        while (client != NULL) {
-            if (FD_ISSET(client->fd, &all_fds)) {
+        for (int i = 0; i < num_events; i++) {
+            Client *client = events[i].data.ptr;
+
+            // activity on server socket means new client connection
+            if (client == NULL) {
+                accept_client_connection(sock_fd);
+                continue;
+            }
+
+            // messages from other shards
+            if (events[i].data.ptr == &shard->inbox) {
+                handle_messages();
+                continue;
+            }
+
+            if (client->closing) {
+                continue;
+            }
+
+            // the socket accepts more output: flush the client's queue, and
+            // resume reading from a throttled client once it has caught up
+            int can_read = events[i].events & ~EPOLLOUT;
+            if (events[i].events & EPOLLOUT) {
+                if (flush_client(client) == -1) {
+                    close_client(client);
+                    continue;
+                }
+                if (client->throttled && queued_output(client) <= output_high_water / 2) {
+                    client->throttled = 0;
+                    can_read = 1;
+                }
+            }
 
-                // if activity detected from client, process input
-                read_from_client(client);
+            // if activity detected from client, process input; a client that
+            // quit, hung up or errored is deregistered and freed
+            if (can_read && !client->throttled && read_from_client(client) == -1) {
+                close_client(client);
             }
-            client = client->next;
         }
 
-        // activity on server socket means new client connection
-		if (FD_ISSET(sock_fd, &all_fds)){
-			accept_client_connection(sock_fd);
-		}
+        flush_pending_clients();
+
+        // changes that produced no output still go to the log with the
+        // batch, and messages to other shards only leave once it is in
+        wal_commit(wal);
+        wal_tick(wal);
+        send_outboxes();
+        if (expire_timeout() == 0) {
+            sweep_posts();
+        }
+        epoch_collect();
+
+        reap_snapshot();
+        if (snapshot_timeout() == 0) {
+            start_snapshot();
+        }
+        if (metrics_timeout() == 0) {
+            dump_metrics();
+        }
+
+        // remove every client that quit, hung up or failed during this batch
+        while (closing_clients != NULL) {
+            Client *client = closing_clients;
+            closing_clients = client->next_closing;
+            remove_client(client);
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    char *wal_path = WAL_DEFAULT_PATH;
+    int sync_policy = WAL_SYNC_INTERVAL;
+    int sync_interval = WAL_DEFAULT_SYNC_INTERVAL;
+    unsigned int max_friends = MAX_FRIENDS;
+    unsigned int fanout_limit = FEED_FANOUT_LIMIT;
+    long max_posts = 0;
+    long max_post_age = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:f:F:l:s:i:P:S:t:r:m:M:L:K:E:")) != -1) {
+        switch (opt) {
+            case 'w':
+                output_high_water = strtol(optarg, NULL, 10);
+                if (output_high_water <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'f':
+                // 0 lifts the limit
+                max_friends = strtol(optarg, NULL, 10);
+                break;
+            case 'F':
+                fanout_limit = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                wal_path = optarg;
+                break;
+            case 's':
+                if (strcmp(optarg, "always") == 0) {
+                    sync_policy = WAL_SYNC_ALWAYS;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    sync_policy = WAL_SYNC_INTERVAL;
+                } else if (strcmp(optarg, "never") == 0) {
+                    sync_policy = WAL_SYNC_NEVER;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'i':
+                sync_interval = strtol(optarg, NULL, 10);
+                if (sync_interval <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                snapshot_path = optarg;
+                break;
+            case 'S':
+                // 0 disables snapshots
+                snapshot_interval = strtol(optarg, NULL, 10);
+                if (snapshot_interval < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                num_shards = strtol(optarg, NULL, 10);
+                if (num_shards < 1 || num_shards > MAX_SHARDS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                num_readers = strtol(optarg, NULL, 10);
+                if (num_readers < 0 || num_readers > MAX_READERS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'L':
+                max_line_length = strtol(optarg, NULL, 10);
+                if (max_line_length < INPUT_BUFFER_SIZE) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'K':
+                // 0 keeps every post
+                max_posts = strtol(optarg, NULL, 10);
+                if (max_posts < 0 || max_posts > INT_MAX) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'E':
+                // 0 keeps posts however old
+                max_post_age = strtol(optarg, NULL, 10);
+                if (max_post_age < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'M':
+                metrics_interval = strtol(optarg, NULL, 10);
+                if (metrics_interval <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // one table of User's per shard, listed from head in insertion order;
+    // shard k hands out the ids k, k + num_shards, k + 2 * num_shards, ...
+    shards = calloc(num_shards, sizeof(Shard));
+    if (shards == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int k = 0; k < num_shards; k++) {
+        shards[k].id = k;
+        init_user_table(&shards[k].users);
+        shards[k].users.id_offset = k;
+        shards[k].users.id_stride = num_shards;
+        shards[k].users.max_friends = max_friends;
+        shards[k].users.fanout_limit = fanout_limit;
+        shards[k].users.max_posts = max_posts;
+        shards[k].users.max_post_age = max_post_age;
+        shard_path(shards[k].wal_path, wal_path, k);
+        shard_path(shards[k].snapshot_path, snapshot_path, k);
+        if (metrics_path != NULL) {
+            shard_path(shards[k].metrics_path, metrics_path, k);
+        }
+        mailbox_init(&shards[k].inbox);
+    }
+    load_state(wal_path, sync_policy, sync_interval);
+
+    readers = calloc(num_readers + 1, sizeof(Reader));
+    if (readers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int k = 0; k < num_readers; k++) {
+        readers[k].id = k;
+        mailbox_init(&readers[k].inbox);
+        int err = pthread_create(&readers[k].thread, NULL, run_reader, &readers[k]);
+        if (err != 0) {
+            errno = err;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    // the main thread runs the first shard
+    for (int k = 1; k < num_shards; k++) {
+        int err = pthread_create(&shards[k].thread, NULL, run_shard, &shards[k]);
+        if (err != 0) {
+            errno = err;
+            perror("pthread_create");
+            exit(1);
+        }
     }
-}
\ No newline at end of file
+    run_shard(&shards[0]);
+    return 0;
+}
@@ -1,12 +1,268 @@
 #include "friends.h"
+#include "epoch.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
 
 
 /*
- * Create a new user with the given name.  Insert it at the tail of the list
- * of users whose head is pointed to by *user_ptr_add.
+ * Return a new, empty index with the given number of slots.
+ */
+static UserIndex *new_user_index(unsigned int capacity) {
+    UserIndex *index = calloc(1, sizeof(UserIndex) + capacity * sizeof(User *));
+    if (index == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    index->capacity = capacity;
+    return index;
+}
+
+
+/*
+ * Drop the reference a cache or a table's user_list held to rendering.
+ * Passed to epoch_retire, so readers that found rendering there have
+ * taken their own references by the time it runs.
+ */
+static void release_cached_rendering(void *rendering) {
+    release_rendering(rendering);
+}
+
+
+/*
+ * Return an empty user list with room for capacity bytes, and a reference
+ * for the table it is made for.
+ */
+static Rendering *new_user_list(int capacity) {
+    Rendering *list = malloc(sizeof(Rendering) + capacity);
+    if (list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    list->version = 0;
+    list->refs = 1;
+    list->len = 0;
+    list->capacity = capacity;
+    return list;
+}
+
+
+/*
+ * Return an empty posts_by_id with capacity slots, starting at id base,
+ * and room for num_kept posts below it.
+ */
+static PostIndex *new_post_index(unsigned int base, unsigned int capacity,
+                                 unsigned int num_kept) {
+    PostIndex *posts = malloc(sizeof(PostIndex) + capacity * sizeof(Post *));
+    if (posts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    posts->base = base;
+    posts->capacity = capacity;
+    posts->kept = NULL;
+    posts->num_kept = num_kept;
+    if (num_kept > 0) {
+        posts->kept = malloc(num_kept * sizeof(KeptPost));
+        if (posts->kept == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    return posts;
+}
+
+
+/*
+ * Free a posts_by_id (an epoch_retire destroy function).
+ */
+static void free_post_index(void *ptr) {
+    PostIndex *posts = ptr;
+    free(posts->kept);
+    free(posts);
+}
+
+
+/*
+ * Return the bytes taken by a posts_by_id.
+ */
+static size_t post_index_bytes(const PostIndex *posts) {
+    return sizeof(PostIndex) + posts->capacity * sizeof(Post *) +
+           posts->num_kept * sizeof(KeptPost);
+}
+
+
+/*
+ * Initialize an empty user table whose users can have at most MAX_FRIENDS
+ * friends.
+ */
+void init_user_table(UserTable *table) {
+    table->head = NULL;
+    table->tail = NULL;
+    table->count = 0;
+    table->id_offset = 0;
+    table->id_stride = 1;
+    table->max_friends = MAX_FRIENDS;
+    table->fanout_limit = FEED_FANOUT_LIMIT;
+    init_pool(&table->user_pool, sizeof(User));
+    init_pool(&table->post_pool, sizeof(Post));
+    init_arena(&table->post_arena, ARENA_CHUNK_SIZE);
+    table->mutual_counts = NULL;
+    table->candidates = NULL;
+    table->scratch_size = 0;
+    table->profile_cache_hits = 0;
+    table->profile_cache_misses = 0;
+    table->index = new_user_index(USER_TABLE_INITIAL_CAPACITY);
+    for (int i = 0; i < NAME_INDEX_LEVELS; i++) {
+        table->sorted_head[i] = NULL;
+    }
+    init_arena(&table->index_arena, ARENA_CHUNK_SIZE);
+    table->index_seed = 1;
+    table->user_list = new_user_list(USER_LIST_INITIAL_CAPACITY);
+    init_search_index(&table->search);
+    table->posts_by_id = new_post_index(0, POST_IDS_INITIAL_CAPACITY, 0);
+    table->num_post_ids = 0;
+    table->live_posts = 0;
+    table->max_posts = 0;
+    table->max_post_age = 0;
+    table->expire_next = 0;
+    table->cap_next = NULL;
+    table->expired = NULL;
+    table->mapped_post_ids = 0;
+    table->live_contents_bytes = 0;
+    table->compacting = 0;
+    table->compact_next = 0;
+    table->compact_end = 0;
+    table->posts_expired = 0;
+    table->bytes_reclaimed = 0;
+    table->compactions = 0;
+}
+
+
+/*
+ * Return the hash of a user name (32-bit FNV-1a).
+ */
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Return which of num_shards tables owns the user whose name has this
+ * hash. The table's index uses the low bits of the hash, so the shard is
+ * chosen by the high bits.
+ */
+unsigned int shard_of(unsigned int hash, unsigned int num_shards) {
+    return ((unsigned long long)hash * num_shards) >> 32;
+}
+
+
+/*
+ * Return the index of the slot holding the user with this name and hash,
+ * or of the empty slot where it would be inserted.
+ */
+static unsigned int find_slot(const UserIndex *index, const char *name, unsigned int hash) {
+    unsigned int mask = index->capacity - 1;
+    unsigned int i = hash & mask;
+    User *user;
+    while ((user = __atomic_load_n(&index->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (user->hash == hash && strcmp(user->name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+/*
+ * Replace the table's index with one of twice as many slots. Readers may
+ * still be searching the old one, so it is retired rather than freed.
+ */
+static void grow_user_table(UserTable *table) {
+    UserIndex *old_index = table->index;
+    UserIndex *index = new_user_index(old_index->capacity * 2);
+    unsigned int mask = index->capacity - 1;
+
+    for (unsigned int i = 0; i < old_index->capacity; i++) {
+        if (old_index->slots[i] != NULL) {
+            unsigned int j = old_index->slots[i]->hash & mask;
+            while (index->slots[j] != NULL) {
+                j = (j + 1) & mask;
+            }
+            index->slots[j] = old_index->slots[i];
+        }
+    }
+    __atomic_store_n(&table->index, index, __ATOMIC_RELEASE);
+    epoch_retire(old_index, free);
+}
+
+
+/*
+ * Add user to the table's sorted name index. The levels of its tower are
+ * linked in from the bottom up, each with a single store, so a reader
+ * either finds user on a level or skips straight past where it goes.
+ */
+static void index_user_name(User *user, UserTable *table) {
+    // each level up holds a quarter of the users of the one below
+    int height = 1;
+    while (height < NAME_INDEX_LEVELS && (rand_r(&table->index_seed) & 3) == 0) {
+        height++;
+    }
+    user->sorted_next = arena_alloc(&table->index_arena, height * sizeof(User *));
+
+    // on each level, the array of next pointers that user goes after
+    User **prev[NAME_INDEX_LEVELS];
+    User **next = table->sorted_head;
+    for (int level = NAME_INDEX_LEVELS - 1; level >= 0; level--) {
+        while (next[level] != NULL && strcmp(next[level]->name, user->name) < 0) {
+            next = next[level]->sorted_next;
+        }
+        prev[level] = next;
+    }
+    for (int level = 0; level < height; level++) {
+        user->sorted_next[level] = prev[level][level];
+        __atomic_store_n(&prev[level][level], user, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * Append user's name to the table's user list, in place if it has room
+ * (the bytes readers may be sending are left alone), and otherwise in a
+ * larger copy that replaces it.
+ */
+static void append_user_list(const User *user, UserTable *table) {
+    Rendering *list = table->user_list;
+    int len = strlen(user->name);
+    if (list->len + len + 2 > list->capacity) {
+        int capacity = list->capacity * 2;
+        while (list->len + len + 2 > capacity) {
+            capacity *= 2;
+        }
+        Rendering *larger = new_user_list(capacity);
+        memcpy(larger->data, list->data, list->len);
+        larger->len = list->len;
+        __atomic_store_n(&table->user_list, larger, __ATOMIC_RELEASE);
+        epoch_retire(list, release_cached_rendering);
+        list = larger;
+    }
+    memcpy(list->data + list->len, user->name, len);
+    memcpy(list->data + list->len + len, "\r\n", 2);
+    __atomic_store_n(&list->len, list->len + len + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Create a new user with the given name.  Insert it at the tail of the
+ * table's list of users and add it to the table's name index.
  *
  * Return:
  *   - 0 on success.
@@ -14,84 +270,97 @@
  *   - 2 if the given name cannot fit in the 'name' array
  *       (don't forget about the null terminator).
  */
-int create_user(const char *name, User **user_ptr_add) {
+int create_user(const char *name, UserTable *table) {
     if (strlen(name) >= MAX_NAME) {
         return 2;
     }
 
-    User *new_user = malloc(sizeof(User));
-    if (new_user == NULL) {
-        perror("malloc");
-        exit(1);
+    unsigned int hash = hash_name(name);
+    unsigned int slot = find_slot(table->index, name, hash);
+    if (table->index->slots[slot] != NULL) {
+        return 1;
     }
+
+    User *new_user = pool_alloc(&table->user_pool);
     strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
+    new_user->hash = hash;
+    new_user->id = table->id_offset + table->id_stride * table->count;
 
     for (int i = 0; i < MAX_NAME; i++) {
         new_user->profile_pic[i] = '\0';
     }
 
     new_user->first_post = NULL;
+    new_user->last_post = NULL;
+    new_user->num_posts = 0;
+    new_user->posts_version = 0;
+    new_user->cached_friends = NULL;
+    new_user->cached_posts = NULL;
+    new_user->friends_version = 0;
+    new_user->sessions = NULL;
     new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
-    }
-
-    // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
+    new_user->friends = NULL;
+    new_user->friend_ids = NULL;
+    new_user->num_friends = 0;
+    new_user->friends_capacity = 0;
+    new_user->reserved_friends = 0;
+    new_user->timeline = NULL;
+    new_user->timeline_start = 0;
+    new_user->timeline_count = 0;
+    index_user_name(new_user, table);
+    append_user_list(new_user, table);
+
+    // Add user to list; the stores publish the initialized user to readers
+    if (table->tail == NULL) {
+        __atomic_store_n(&table->head, new_user, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&table->tail->next, new_user, __ATOMIC_RELEASE);
     }
+    table->tail = new_user;
 
-    if (*user_ptr_add == NULL) {
-        *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
-        free(new_user);
-        return 1;
-    } else {
-        prev->next = new_user;
-        return 0;
+    // Add user to index, keeping the load factor at or below 3/4
+    __atomic_store_n(&table->index->slots[slot], new_user, __ATOMIC_RELEASE);
+    table->count++;
+    if (table->count * 4 > table->index->capacity * 3) {
+        grow_user_table(table);
     }
+    return 0;
 }
 
 
 /*
- * Return a pointer to the user with this name in
- * the list starting with head. Return NULL if no such user exists.
- *
- * NOTE: You'll likely need to cast a (const User *) to a (User *)
- * to satisfy the prototype without warnings.
+ * Return a pointer to the user with this name in the table.
+ * Return NULL if no such user exists.
  */
-User *find_user(const char *name, const User *head) {
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
-    }
-
-    return (User *)head;
+User *find_user(const char *name, const UserTable *table) {
+    const UserIndex *index = __atomic_load_n(&table->index, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&index->slots[find_slot(index, name, hash_name(name))],
+                           __ATOMIC_ACQUIRE);
 }
 
 
 /*
  * Return a pointer to a dynamically allocated string containing
- * the usernames of all users in the list starting at curr.
+ * the usernames of all users in the list starting at curr. Users appended
+ * while the list is being read are left out.
  */
 char *list_users(const User *curr) {
     if (curr == NULL) {
         // If there is no user in the list, return empty dynamically allocated string
-		char *empty = malloc(0);
+		char *empty = malloc(1);
 
         // Checking if malloc worked as intended
         if (empty == NULL) {
             perror("malloc");
             exit(1);
         }
+        empty[0] = '\0';
         return empty;
     }
 
     // Used for finding the size of string to be dynamically allocated
     int malloc_size = 0;
+    int num_users = 0;
 
     // Used for iterating over every user
     const User *copy_curr = curr;
@@ -104,7 +373,8 @@ char *list_users(const User *curr) {
 
         // Adding space for \r\n
         malloc_size += 2;
-        copy_curr = copy_curr->next;
+        num_users++;
+        copy_curr = __atomic_load_n(&copy_curr->next, __ATOMIC_ACQUIRE);
     }
 
     // Adding space for \0 at the end
@@ -121,11 +391,11 @@ char *list_users(const User *curr) {
 
     int written_len = 0;
 
-    // Iterating over the linked list of Users starting at curr
-    while (curr != NULL) {
+    // Iterating over the users counted above, starting at curr
+    for (int i = 0; i < num_users; i++) {
         // Concatenating the curr User's name followed by \r\n
         written_len += snprintf(usernames + written_len, malloc_size - written_len, "%s\r\n", curr->name);
-        curr = curr->next;
+        curr = __atomic_load_n(&curr->next, __ATOMIC_RELAXED);
     }
 
     // Concatenating the string NULL terminator
@@ -137,26 +407,187 @@ char *list_users(const User *curr) {
 }
 
 
+/*
+ * Mark the start of a change to the data guarded by version, which makes
+ * it odd until end_change. Only the owner of the data changes it.
+ */
+static void begin_change(unsigned long *version) {
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+    // the stores that make up the change must not be seen before this one
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/*
+ * Mark the end of a change begun by begin_change.
+ */
+static void end_change(unsigned long *version) {
+    __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return the current version of the data guarded by version, waiting out
+ * a change in progress.
+ */
+static unsigned long read_begin(const unsigned long *version) {
+    unsigned long v;
+    while ((v = __atomic_load_n(version, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return v;
+}
+
+
+/*
+ * Return 1 if the data guarded by version changed since read_begin
+ * returned v, so what was read in between must be read again.
+ */
+static int read_retry(const unsigned long *version, unsigned long v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) != v;
+}
+
+
+/*
+ * Drop the cached section *cache so it is re-rendered on next use.
+ */
+static void invalidate_cached_section(Rendering **cache) {
+    epoch_retire(__atomic_exchange_n(cache, NULL, __ATOMIC_ACQ_REL), release_cached_rendering);
+}
+
+
+/*
+ * Binary search user's friends array for other.
+ * Return the index of other if found, or -(i + 1) where i is the index at
+ * which other would have to be inserted to keep the array sorted.
+ */
+static int find_friend(const User *user, const User *other) {
+    int lo = 0;
+    int hi = user->num_friends;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (user->friend_ids[mid] < other->id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < user->num_friends && user->friends[lo] == other) {
+        return lo;
+    }
+    return -(lo + 1);
+}
+
+
+/*
+ * Return 1 if other is in user's friends array, 0 otherwise.
+ * Takes O(log n) time in the number of user's friends.
+ */
+int is_friend(const User *user, const User *other) {
+    return find_friend(user, other) >= 0;
+}
+
+
+/*
+ * Insert other into user's friends array at index pos, doubling the
+ * array first if it is full, and invalidate the cached friends section.
+ *
+ * Readers may be copying the friends array meanwhile (see read_friends):
+ * a grown array is published before the count that needs it, and the old
+ * one is retired rather than freed.
+ */
+static void insert_friend(User *user, User *other, int pos) {
+    begin_change(&user->friends_version);
+    if (user->num_friends == user->friends_capacity) {
+        int new_capacity = user->friends_capacity == 0 ?
+            FRIENDS_INITIAL_CAPACITY : user->friends_capacity * 2;
+        User **new_friends = malloc(new_capacity * sizeof(User *));
+        unsigned int *new_ids = realloc(user->friend_ids, new_capacity * sizeof(unsigned int));
+        if (new_friends == NULL || new_ids == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        User **old_friends = user->friends;
+        if (user->num_friends > 0) {
+            memcpy(new_friends, old_friends, user->num_friends * sizeof(User *));
+        }
+        __atomic_store_n(&user->friends, new_friends, __ATOMIC_RELEASE);
+        epoch_retire(old_friends, free);
+        user->friend_ids = new_ids;
+        user->friends_capacity = new_capacity;
+    }
+
+    memmove(&user->friends[pos + 1], &user->friends[pos],
+            (user->num_friends - pos) * sizeof(User *));
+    memmove(&user->friend_ids[pos + 1], &user->friend_ids[pos],
+            (user->num_friends - pos) * sizeof(unsigned int));
+    user->friends[pos] = other;
+    user->friend_ids[pos] = other->id;
+    __atomic_store_n(&user->num_friends, user->num_friends + 1, __ATOMIC_RELEASE);
+    end_change(&user->friends_version);
+
+    invalidate_cached_section(&user->cached_friends);
+    // rebuilt with the new friend's posts when next read
+    free(user->timeline);
+    user->timeline = NULL;
+}
+
+
+/*
+ * Store in *friends a dynamically allocated copy of user's friends array,
+ * all of one version, and return how many there are. Safe to call while
+ * the owner of user is adding friends.
+ */
+static int read_friends(const User *user, User ***friends, unsigned long *version) {
+    User **copy = NULL;
+    int capacity = 0;
+    while (1) {
+        unsigned long v = read_begin(&user->friends_version);
+        // the count is loaded first, so the array is at least that long
+        int n = __atomic_load_n(&user->num_friends, __ATOMIC_ACQUIRE);
+        User **array = __atomic_load_n(&user->friends, __ATOMIC_ACQUIRE);
+        if (n > capacity) {
+            capacity = n;
+            copy = realloc(copy, capacity * sizeof(User *));
+            if (copy == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        if (n > 0) {
+            memcpy(copy, array, n * sizeof(User *));
+        }
+        if (!read_retry(&user->friends_version, v)) {
+            *friends = copy;
+            *version = v;
+            return n;
+        }
+    }
+}
+
+
 /*
  * Make two users friends with each other.  This is symmetric - a pointer to
  * each user must be stored in the 'friends' array of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * Each 'friends' array is kept sorted by user id.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
  *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
+ *     table->max_friends friends.
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
  * Do not modify either user if the result is a failure.
  * NOTE: If multiple errors apply, return the *largest* error code that applies.
  */
-int make_friends(const char *name1, const char *name2, User *head) {
-    User *user1 = find_user(name1, head);
-    User *user2 = find_user(name2, head);
+int make_friends(const char *name1, const char *name2, UserTable *table) {
+    User *user1 = find_user(name1, table);
+    User *user2 = find_user(name2, table);
 
     if (user1 == NULL || user2 == NULL) {
         return 4;
@@ -164,184 +595,906 @@ int make_friends(const char *name1, const char *name2, User *head) {
         return 3;
     }
 
-    int i, j;
-    for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
-            break;
-        } else if (user1->friends[i] == user2) { // Already friends.
-            return 1;
-        }
+    int i = find_friend(user1, user2);
+    if (i >= 0) { // Already friends.
+        return 1;
     }
 
-    for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
-            break;
-        }
+    unsigned int max = table->max_friends;
+    if (max != 0 && (user1->num_friends + user1->reserved_friends >= max ||
+                     user2->num_friends + user2->reserved_friends >= max)) {
+        return 2; // Too many friends.
     }
 
-    if (i == MAX_FRIENDS || j == MAX_FRIENDS) { // Too many friends.
+    int j = find_friend(user2, user1);
+
+    insert_friend(user1, user2, -i - 1);
+    insert_friend(user2, user1, -j - 1);
+    return 0;
+}
+
+
+/*
+ * Add other to user's friends array: one half of a friendship, for users
+ * in different tables. The other half is added by the owner of other.
+ *
+ * Return:
+ *   - 0 on success.
+ *   - 1 if other is already user's friend.
+ *   - 2 if user already has max_friends friends (counting reserved ones);
+ *     0 means no limit.
+ */
+int add_friend(User *user, User *other, unsigned int max_friends) {
+    int i = find_friend(user, other);
+    if (i >= 0) {
+        return 1;
+    }
+    if (max_friends != 0 && user->num_friends + user->reserved_friends >= max_friends) {
         return 2;
     }
-
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
+    insert_friend(user, other, -i - 1);
     return 0;
 }
 
 
 /*
- *  Return the number of characters used while printing a post.
+ * Return the index of the first friend of user at or after index lo whose
+ * id is at least id, searching with exponentially growing steps.
  */
-int num_chars_in_printing_post(const Post *post) {
-    // Used to store the number of characters used while printing a post
-    int number_chars = 0;
+static int gallop(const User *user, int lo, unsigned int id) {
+    int step = 1;
+    int hi = lo;
+    while (hi < user->num_friends && user->friend_ids[hi] < id) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > user->num_friends) {
+        hi = user->num_friends;
+    }
 
-    // Since there is no post, no print occurs
-    if (post == NULL) {
-        return number_chars;
+    // binary search the last step
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (user->friend_ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    
-    // Characters used in "From: \r\n" : 8 characters
-    number_chars += 8;
+    return lo;
+}
 
-    // Characters used in authors name
-    number_chars += strlen(post->author);
 
-    // Characters used in "Date: " : 6 characters
-    number_chars += 6;
+/*
+ * Store in result the friends that user1 and user2 have in common, sorted
+ * by id, and return how many there are. result must have room for the
+ * smaller of the two users' num_friends.
+ *
+ * The friends arrays are intersected with a sorted merge, or by galloping
+ * through the longer array when their sizes differ by GALLOP_RATIO or more.
+ */
+int intersect_friends(const User *user1, const User *user2, User **result) {
+    // make user1 the one with fewer friends
+    if (user1->num_friends > user2->num_friends) {
+        const User *tmp = user1;
+        user1 = user2;
+        user2 = tmp;
+    }
 
-    // Characters used in post time. Adding one since it already ends with a \n.
-    number_chars += strlen(asctime(localtime(post->date))) + 1;
+    int count = 0;
+    int i = 0;
+    int j = 0;
+    if (user1->num_friends * GALLOP_RATIO <= user2->num_friends) {
+        for (i = 0; i < user1->num_friends && j < user2->num_friends; i++) {
+            j = gallop(user2, j, user1->friend_ids[i]);
+            if (j < user2->num_friends && user2->friend_ids[j] == user1->friend_ids[i]) {
+                result[count++] = user1->friends[i];
+                j++;
+            }
+        }
+        return count;
+    }
 
-    // Characters used in "\r\n" : 2 characters
-    number_chars += 2;
+    while (i < user1->num_friends && j < user2->num_friends) {
+        unsigned int id1 = user1->friend_ids[i];
+        unsigned int id2 = user2->friend_ids[j];
+        if (id1 < id2) {
+            i++;
+        } else if (id1 > id2) {
+            j++;
+        } else {
+            result[count++] = user1->friends[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
 
-    // Characters used in post content including \r\n at the end
-    number_chars += strlen(post->contents) + 2;
 
-    // Returning number of characters used
-    return number_chars;
+/*
+ * Return 1 if candidate a should be ranked below candidate b: fewer mutual
+ * friends, or as many but created later.
+ */
+static int ranks_below(const User *a, unsigned int count_a, const User *b, unsigned int count_b) {
+    if (count_a != count_b) {
+        return count_a < count_b;
+    }
+    return a->id > b->id;
 }
 
 
 /*
- * Return a pointer to a dynamically allocated string containing
- * a user profile.
- * For an example of the required output format, see the example output
- * linked from the handout.
+ * Restore the min-heap order (worst candidate at the root) of the first n
+ * entries of result/counts after the root was replaced.
  */
-char *print_user(const User *user) {
-    if (user == NULL) {
-        // If there is no user in the list, return empty dynamically allocated string
-		char *empty = malloc(0);
+static void sift_down(User **result, unsigned int *counts, int n) {
+    int i = 0;
+    while (1) {
+        int worst = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < n && ranks_below(result[left], counts[left], result[worst], counts[worst])) {
+            worst = left;
+        }
+        if (right < n && ranks_below(result[right], counts[right], result[worst], counts[worst])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        User *user = result[i];
+        unsigned int count = counts[i];
+        result[i] = result[worst];
+        counts[i] = counts[worst];
+        result[worst] = user;
+        counts[worst] = count;
+        i = worst;
+    }
+}
 
-        // Checking if malloc worked as intended
-        if (empty == NULL) {
+
+/*
+ * Find the (at most) k users that are not yet friends with user but share
+ * the most friends with them. Store them in result, most mutual friends
+ * first (ties go to the older user), with the number of mutual friends of
+ * each in mutual_counts, and return how many were found.
+ * result and mutual_counts must have room for k entries.
+ */
+int suggest_friends(const User *user, UserTable *table, int k, User **result,
+                    unsigned int *mutual_counts) {
+    // one counter per user id, all zero between calls; friends arrays are
+    // sorted by id, so the largest id to be counted is a last entry (ids of
+    // users in other tables can exceed this table's own)
+    unsigned int max_id = user->id;
+    for (int i = -1; i < user->num_friends; i++) {
+        const User *friend = i < 0 ? user : user->friends[i];
+        if (friend->num_friends > 0 && friend->friend_ids[friend->num_friends - 1] > max_id) {
+            max_id = friend->friend_ids[friend->num_friends - 1];
+        }
+    }
+    if (table->scratch_size <= max_id) {
+        free(table->mutual_counts);
+        free(table->candidates);
+        table->scratch_size = table->scratch_size * 2 > max_id ? table->scratch_size * 2 : max_id + 1;
+        table->mutual_counts = calloc(table->scratch_size, sizeof(unsigned int));
+        table->candidates = malloc(table->scratch_size * sizeof(User *));
+        if (table->mutual_counts == NULL || table->candidates == NULL) {
             perror("malloc");
             exit(1);
         }
-        return empty;
+    }
+    unsigned int *counts = table->mutual_counts;
+    User **candidates = table->candidates;
+    int num_candidates = 0;
+
+    // user and their friends can never be suggested
+    counts[user->id] = UINT_MAX;
+    for (int i = 0; i < user->num_friends; i++) {
+        counts[user->friend_ids[i]] = UINT_MAX;
     }
 
-    char *dash = "------------------------------------------\r\n";
-
-    // Used for finding the size of string to be dynamically allocated
-    int malloc_size = 0;
-
-    // Characters used in User's name
-    malloc_size += strlen(user->name);
+    // count the paths of length two to every other user
+    for (int i = 0; i < user->num_friends; i++) {
+        const User *friend = user->friends[i];
+        for (int j = 0; j < friend->num_friends; j++) {
+            unsigned int *count = &counts[friend->friend_ids[j]];
+            if (*count == UINT_MAX) {
+                continue;
+            }
+            if ((*count)++ == 0) {
+                candidates[num_candidates++] = friend->friends[j];
+            }
+        }
+    }
 
-    // Characters used in "Name: \r\n\r\n" : 10 characters
-    malloc_size += 10;
+    // keep the best k candidates in a min-heap with the worst at the root
+    int found = 0;
+    for (int i = 0; i < num_candidates; i++) {
+        User *candidate = candidates[i];
+        unsigned int count = counts[candidate->id];
+        counts[candidate->id] = 0;
+
+        if (found < k) {
+            // insert at the bottom and sift up
+            int pos = found++;
+            while (pos > 0) {
+                int parent = (pos - 1) / 2;
+                if (!ranks_below(candidate, count, result[parent], mutual_counts[parent])) {
+                    break;
+                }
+                result[pos] = result[parent];
+                mutual_counts[pos] = mutual_counts[parent];
+                pos = parent;
+            }
+            result[pos] = candidate;
+            mutual_counts[pos] = count;
+        } else if (k > 0 && ranks_below(result[0], mutual_counts[0], candidate, count)) {
+            result[0] = candidate;
+            mutual_counts[0] = count;
+            sift_down(result, mutual_counts, found);
+        }
+    }
 
-    // Characters used in "Friends:\r\n" : 10 characters
-    malloc_size += 10;
+    counts[user->id] = 0;
+    for (int i = 0; i < user->num_friends; i++) {
+        counts[user->friend_ids[i]] = 0;
+    }
 
-    // Characters used in "Posts:\r\n" : 8 characters
-    malloc_size += 8;
+    // pop the heap from the back so the best candidate ends up first
+    for (int n = found - 1; n > 0; n--) {
+        User *best = result[0];
+        unsigned int count = mutual_counts[0];
+        result[0] = result[n];
+        mutual_counts[0] = mutual_counts[n];
+        result[n] = best;
+        mutual_counts[n] = count;
+        sift_down(result, mutual_counts, n);
+    }
+    return found;
+}
 
-    // Characters used in 3 lines of dashes
-    malloc_size += strlen(dash) * 3;
 
-    // Add length of each friend User's name
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
+/*
+ * Return a pointer to a dynamically allocated string listing the mutual
+ * friends of user1 and user2.
+ */
+char *list_mutual_friends(const User *user1, const User *user2) {
+    int max = user1->num_friends < user2->num_friends ?
+        user1->num_friends : user2->num_friends;
+    // room for at least one, since malloc(0) may return NULL
+    User **mutual = malloc((max > 0 ? max : 1) * sizeof(User *));
+    if (mutual == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = intersect_friends(user1, user2, mutual);
 
+    // Characters used in "Mutual friends with :\r\n" and the \0 at the end
+    int malloc_size = strlen(user2->name) + 24;
+    for (int i = 0; i < count; i++) {
         // Characters used in friend User's name followed by \r\n
-        malloc_size += strlen(user->friends[i]->name) + 2;
+        malloc_size += strlen(mutual[i]->name) + 2;
     }
 
-    // Used for iterating over every post of the User to add space needed
-    const Post *curr = user->first_post;
-    while (curr != NULL) {
-
-        // Adding space for each post
-        malloc_size += num_chars_in_printing_post(curr);
-        curr = curr->next;
-        if (curr != NULL) {
+    char *list = malloc(malloc_size);
+    if (list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-            // Characters used in "===\r\n" : 5 characters
-            malloc_size += 5;
-        }
+    int written_len = snprintf(list, malloc_size, "Mutual friends with %s:\r\n", user2->name);
+    for (int i = 0; i < count; i++) {
+        written_len += snprintf(list + written_len, malloc_size - written_len, "%s\r\n", mutual[i]->name);
     }
 
-    // Adding space for \0 at the end
-    malloc_size += 1;
+    free(mutual);
+    return list;
+}
 
-    // Allocating memory on the heap for string of User profile
-    char* user_profile = malloc(malloc_size * sizeof(char));
 
-    // Checking if malloc worked as intended
-    if (!user_profile) {
+/*
+ * Return a pointer to a dynamically allocated string listing up to k
+ * friend suggestions for user, with their number of mutual friends.
+ */
+char *list_suggestions(const User *user, UserTable *table, int k) {
+    User **suggested = malloc(k * sizeof(User *));
+    unsigned int *mutual_counts = malloc(k * sizeof(unsigned int));
+    if (suggested == NULL || mutual_counts == NULL) {
         perror("malloc");
         exit(1);
     }
+    int count = suggest_friends(user, table, k, suggested, mutual_counts);
+
+    // Characters used in "Suggested friends:\r\n" and the \0 at the end
+    int malloc_size = 21;
+    for (int i = 0; i < count; i++) {
+        // Characters used in " (N mutual)\r\n" after the name: at most 10
+        // digits for N plus 12 characters
+        malloc_size += strlen(suggested[i]->name) + 22;
+    }
 
-    int written_len = 0;
-
-    // Write User name to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "Name: %s\r\n\r\n", user->name);
-
-    // Write dashes to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "%s", dash);
+    char *list = malloc(malloc_size);
+    if (list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-    // Write friend User's names to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "Friends:\r\n");
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-        written_len += snprintf(user_profile + written_len, malloc_size - written_len, "%s\r\n", user->friends[i]->name);
+    int written_len = snprintf(list, malloc_size, "Suggested friends:\r\n");
+    for (int i = 0; i < count; i++) {
+        written_len += snprintf(list + written_len, malloc_size - written_len,
+                                "%s (%u mutual)\r\n", suggested[i]->name, mutual_counts[i]);
     }
 
-    // Write dashes to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "%s", dash);
+    free(suggested);
+    free(mutual_counts);
+    return list;
+}
 
-    // Going back to first post
-    curr = user->first_post;
 
-    // Write User's posts to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "Posts:\r\n");
-    while (curr != NULL) {
-        // Write post author to allocated string
-        written_len += snprintf(user_profile + written_len, malloc_size - written_len, "From: %s\r\n", curr->author);
-    
-        // Write post time to allocated string
-        char *time = asctime(localtime(curr->date));
+/*
+ * Pass the NUL terminated string str to emit.
+ */
+static void emit_string(Emitter emit, void *context, const char *str) {
+    emit(context, str, strlen(str));
+}
 
-        // Since asctime returns a string ending with \n, updating it to have \r\n at the end
-        time[strlen(time)-1] = '\r';
-        written_len += snprintf(user_profile + written_len, malloc_size - written_len, "Date: %s\n\r\n", time);
 
-        // Write post content to allocated string
-        written_len += snprintf(user_profile + written_len, malloc_size - written_len, "%s\r\n", curr->contents);
-        curr = curr->next;
-        if (curr != NULL) {
-            written_len += snprintf(user_profile + written_len, malloc_size - written_len, "===\r\n");
+/*
+ * Render the top of user's profile, from the "Name:" line to the dashes
+ * closing the friends list, and return the version of the friends shown.
+ */
+static unsigned long render_friends_section(const User *user, Emitter emit, void *context) {
+    User **friends;
+    unsigned long version;
+    int num_friends = read_friends(user, &friends, &version);
+
+    // Write User name
+    emit_string(emit, context, "Name: ");
+    emit_string(emit, context, user->name);
+    emit_string(emit, context, "\r\n\r\n");
+    emit_string(emit, context, PROFILE_DASH);
+
+    // Write friend User's names
+    emit_string(emit, context, "Friends:\r\n");
+    for (int i = 0; i < num_friends; i++) {
+        emit_string(emit, context, friends[i]->name);
+        emit_string(emit, context, "\r\n");
+    }
+    emit_string(emit, context, PROFILE_DASH);
+    free(friends);
+    return version;
+}
+
+
+/*
+ * Render the posts section of user's profile, from the "Posts:" line to
+ * the closing dashes, showing the posts selected by offset and limit (see
+ * render_profile), and return the version of the posts shown.
+ */
+static unsigned long render_posts_section(const User *user, int offset, int limit, Emitter emit,
+                                          void *context) {
+    // posts are added at the front and expire from the back, so the newest
+    // post and the count, read at one version, pin down the whole list
+    // (but for posts that expire while it is read)
+    const Post *curr;
+    int num_posts;
+    unsigned long version;
+    do {
+        version = read_begin(&user->posts_version);
+        curr = __atomic_load_n(&user->first_post, __ATOMIC_ACQUIRE);
+        num_posts = __atomic_load_n(&user->num_posts, __ATOMIC_RELAXED);
+    } while (read_retry(&user->posts_version, version));
+
+    // Skip to the first post of the page
+    for (int i = 0; i < offset && curr != NULL; i++) {
+        curr = curr->next;
+    }
+    int shown = num_posts - offset;
+    if (shown < 0) {
+        shown = 0;
+    }
+    if (limit >= 0 && shown > limit) {
+        shown = limit;
+    }
+
+    // Say which posts are shown when it is not all of them
+    if (shown == num_posts) {
+        emit_string(emit, context, "Posts:\r\n");
+    } else {
+        char header[64];
+        int len;
+        if (shown == 0) {
+            len = snprintf(header, sizeof(header), "Posts 0 of %d:\r\n", num_posts);
+        } else {
+            len = snprintf(header, sizeof(header), "Posts %d-%d of %d:\r\n",
+                           offset + 1, offset + shown, num_posts);
+        }
+        emit(context, header, len);
+    }
+
+    // Write User's posts; the oldest may expire while they are read, so
+    // the list can end early
+    for (int i = 0; i < shown && curr != NULL; i++) {
+        if (i > 0) {
+            emit_string(emit, context, "===\r\n");
+        }
+
+        // Write post author
+        emit_string(emit, context, "From: ");
+        emit_string(emit, context, curr->author->name);
+        emit_string(emit, context, "\r\n");
+
+        // Write post time, formatted when the post was made
+        emit_string(emit, context, "Date: ");
+        emit_string(emit, context, curr->date_str);
+        emit_string(emit, context, "\r\n\r\n");
+
+        // Write post content
+        emit_string(emit, context, __atomic_load_n(&curr->contents, __ATOMIC_ACQUIRE));
+        emit_string(emit, context, "\r\n");
+        curr = __atomic_load_n(&curr->next, __ATOMIC_ACQUIRE);
+    }
+
+    emit_string(emit, context, PROFILE_DASH);
+    return version;
+}
+
+
+/*
+ * Render user's profile, showing at most limit of their posts starting
+ * with the offset'th newest (limit < 0 shows every post from offset on),
+ * and pass the output piece by piece to emit. Nothing is buffered or sized
+ * up front, so the cost is proportional to the page, not the whole profile.
+ * For an example of the output format, see the example output linked from
+ * the handout.
+ */
+void render_profile(const User *user, int offset, int limit, Emitter emit, void *context) {
+    render_friends_section(user, emit, context);
+    render_posts_section(user, offset, limit, emit, context);
+}
+
+
+/*
+ * Return the first user in table's sorted name index whose name is not
+ * less than name, or NULL if there is none.
+ */
+static const User *seek_sorted_user(const UserTable *table, const char *name) {
+    User *const *next = table->sorted_head;
+    for (int level = NAME_INDEX_LEVELS - 1; level >= 0; level--) {
+        const User *curr;
+        while ((curr = __atomic_load_n(&next[level], __ATOMIC_ACQUIRE)) != NULL &&
+                strcmp(curr->name, name) < 0) {
+            next = curr->sorted_next;
+        }
+    }
+    return __atomic_load_n(&next[0], __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Pass to emit the usernames, each followed by "\r\n", of the users of
+ * num_tables tables whose names start with prefix, in name order,
+ * skipping the first offset and stopping after limit of them (limit < 0
+ * for no limit). The tables' indexes are merged as they are walked.
+ * Users added meanwhile may or may not be included.
+ */
+void render_sorted_users(UserTable *const *tables, int num_tables, const char *prefix,
+                         int offset, int limit, Emitter emit, void *context) {
+    const User *cursors[num_tables];
+    for (int i = 0; i < num_tables; i++) {
+        cursors[i] = seek_sorted_user(tables[i], prefix);
+    }
+
+    int prefix_len = strlen(prefix);
+    int skipped = 0;
+    int shown = 0;
+    while (limit < 0 || shown < limit) {
+        // the smallest name under the cursors comes next
+        int next = -1;
+        for (int i = 0; i < num_tables; i++) {
+            if (cursors[i] != NULL &&
+                    (next == -1 || strcmp(cursors[i]->name, cursors[next]->name) < 0)) {
+                next = i;
+            }
+        }
+        if (next == -1 || strncmp(cursors[next]->name, prefix, prefix_len) != 0) {
+            break;
         }
+
+        if (skipped < offset) {
+            skipped++;
+        } else {
+            emit_string(emit, context, cursors[next]->name);
+            emit(context, "\r\n", 2);
+            shown++;
+        }
+        cursors[next] = __atomic_load_n(&cursors[next]->sorted_next[0], __ATOMIC_ACQUIRE);
+    }
+}
+
+
+/*
+ * A dynamically allocated string that grows as output is appended to it.
+ */
+typedef struct string_builder {
+    char *data;
+    int len;
+    int capacity;
+} StringBuilder;
+
+
+/*
+ * Emitter that appends bytes to the StringBuilder context, keeping it NUL
+ * terminated.
+ */
+static void append_to_string(void *context, const char *bytes, int len) {
+    StringBuilder *builder = context;
+    if (builder->len + len + 1 > builder->capacity) {
+        while (builder->len + len + 1 > builder->capacity) {
+            builder->capacity *= 2;
+        }
+        builder->data = realloc(builder->data, builder->capacity);
+        if (builder->data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(builder->data + builder->len, bytes, len);
+    builder->len += len;
+    builder->data[builder->len] = '\0';
+}
+
+
+/*
+ * Return a pointer to a dynamically allocated string containing
+ * a user's whole profile (see render_profile), or an empty string if user
+ * is NULL.
+ */
+char *print_user(const User *user) {
+    StringBuilder builder;
+    builder.len = 0;
+    builder.capacity = 256;
+    builder.data = malloc(builder.capacity);
+    if (builder.data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    builder.data[0] = '\0';
+
+    if (user != NULL) {
+        render_profile(user, 0, -1, append_to_string, &builder);
+    }
+    return builder.data;
+}
+
+
+/*
+ * Return a dynamically allocated rendering of one section of user's
+ * profile: the posts section of the first page if posts is nonzero,
+ * otherwise the friends section.
+ */
+static Rendering *render_section(const User *user, int posts) {
+    StringBuilder builder;
+    builder.len = 0;
+    builder.capacity = 256;
+    builder.data = malloc(builder.capacity);
+    if (builder.data == NULL) {
+        perror("malloc");
+        exit(1);
     }
 
-    // Write dashes to allocated string
-    written_len += snprintf(user_profile + written_len, malloc_size - written_len, "%s", dash);
+    unsigned long version;
+    if (posts) {
+        version = render_posts_section(user, 0, PROFILE_PAGE_SIZE, append_to_string, &builder);
+    } else {
+        version = render_friends_section(user, append_to_string, &builder);
+    }
 
-    // Return pointer to string containing User's profile
-    return user_profile;
+    Rendering *rendering = malloc(sizeof(Rendering) + builder.len);
+    if (rendering == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    rendering->version = version;
+    rendering->refs = 1;
+    rendering->len = builder.len;
+    rendering->capacity = builder.len;
+    memcpy(rendering->data, builder.data, builder.len);
+    free(builder.data);
+    return rendering;
+}
+
+
+/*
+ * Return the cached rendering of one section of user's profile (see
+ * render_section) with a reference for the caller, rendering it first, and
+ * setting *miss, if it is missing or out of date. When several threads
+ * render the same section at once, the first to finish caches it and the
+ * others' renderings are freed once their callers release them.
+ */
+static Rendering *cached_section(User *user, int posts, int *miss) {
+    Rendering **cache = posts ? &user->cached_posts : &user->cached_friends;
+    const unsigned long *version = posts ? &user->posts_version : &user->friends_version;
+
+    Rendering *cached = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+    if (cached != NULL && cached->version == __atomic_load_n(version, __ATOMIC_ACQUIRE)) {
+        // the cache's reference is only dropped after our epoch ends
+        __atomic_fetch_add(&cached->refs, 1, __ATOMIC_RELAXED);
+        return cached;
+    }
+
+    *miss = 1;
+    Rendering *rendering = render_section(user, posts);
+    rendering->refs = 2;
+    if (__atomic_compare_exchange_n(cache, &cached, rendering, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        epoch_retire(cached, release_cached_rendering);
+    } else {
+        rendering->refs = 1;
+    }
+    return rendering;
+}
+
+
+/*
+ * Store in sections the cached renderings that render_cached_profile
+ * emits, in order, each with a reference for the caller (see
+ * render_cached_profile). Counts a hit in table if nothing had to be
+ * rendered, a miss otherwise.
+ */
+void acquire_cached_profile(User *user, UserTable *table, Rendering **sections) {
+    int miss = 0;
+    sections[0] = cached_section(user, 0, &miss);
+    sections[1] = cached_section(user, 1, &miss);
+
+    if (miss) {
+        __atomic_fetch_add(&table->profile_cache_misses, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&table->profile_cache_hits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Return the table's user list with a reference for the caller, and store
+ * its length in *len. The owner replaces the list only through
+ * epoch_retire, so the reference is taken before the list can be freed.
+ */
+Rendering *acquire_user_list(UserTable *table, int *len) {
+    Rendering *list = __atomic_load_n(&table->user_list, __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&list->refs, 1, __ATOMIC_RELAXED);
+    *len = __atomic_load_n(&list->len, __ATOMIC_ACQUIRE);
+    return list;
+}
+
+
+/*
+ * Drop a reference to rendering, freeing it if it was the last.
+ */
+void release_rendering(Rendering *rendering) {
+    if (__atomic_sub_fetch(&rendering->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(rendering);
+    }
+}
+
+
+/*
+ * Emit the first page of user's profile (what render_profile emits for
+ * offset 0 and limit PROFILE_PAGE_SIZE) from the user's cached rendering,
+ * re-rendering only the sections that changed since the last call.
+ * make_friends and make_post invalidate the sections they affect.
+ * Counts a hit in table if nothing had to be rendered, a miss otherwise.
+ * May be called from reader threads.
+ */
+void render_cached_profile(User *user, UserTable *table, Emitter emit, void *context) {
+    Rendering *sections[PROFILE_SECTIONS];
+    acquire_cached_profile(user, table, sections);
+    for (int i = 0; i < PROFILE_SECTIONS; i++) {
+        emit(context, sections[i]->data, sections[i]->len);
+        release_rendering(sections[i]);
+    }
+}
+
+
+/*
+ * Store in date_str the local time date formatted like asctime(), without
+ * the trailing newline. Consecutive calls for the same second are served
+ * from a cache instead of calling into libc.
+ */
+void format_post_date(time_t date, char *date_str) {
+    // per thread, since every server thread posts
+    static __thread time_t cached_date = -1;
+    static __thread char cached_str[POST_DATE_LEN];
+
+    if (date != cached_date) {
+        struct tm local;
+        localtime_r(&date, &local);
+        strftime(cached_str, POST_DATE_LEN, "%a %b %e %H:%M:%S %Y", &local);
+        cached_date = date;
+    }
+    memcpy(date_str, cached_str, POST_DATE_LEN);
+}
+
+
+/*
+ * Return where posts holds the post with this id, which must be below
+ * num_post_ids, or NULL if it holds none there, since the post expired
+ * before posts moved past it.
+ */
+static Post **post_slot(PostIndex *posts, unsigned int id) {
+    if (id >= posts->base) {
+        return &posts->posts[id - posts->base];
+    }
+    unsigned int lo = 0;
+    unsigned int hi = posts->num_kept;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (posts->kept[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < posts->num_kept && posts->kept[lo].id == id ? &posts->kept[lo].post : NULL;
+}
+
+
+/*
+ * Return the post of table with this id, or NULL if it expired or no
+ * post has it. May be called from reader threads, inside their epoch.
+ */
+Post *find_post(const UserTable *table, unsigned int id) {
+    // the index is published before the ids it holds, so one loaded after
+    // num_post_ids holds every id below it
+    if (id >= __atomic_load_n(&table->num_post_ids, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    PostIndex *posts = __atomic_load_n(&table->posts_by_id, __ATOMIC_ACQUIRE);
+    Post **slot = post_slot(posts, id);
+    return slot == NULL ? NULL : __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Accept the ids of posts that are still in the table given as context.
+ */
+static int is_live_post(void *context, unsigned int id) {
+    return find_post(context, id) != NULL;
+}
+
+
+/*
+ * Replace table's posts_by_id with one of capacity slots holding the ids
+ * from base, which must not be below the current base, and room for all
+ * of them up to num_post_ids. The live posts below base are kept aside.
+ * Readers may still hold the old one, so it is retired rather than freed.
+ */
+static void move_post_index(UserTable *table, unsigned int base, unsigned int capacity) {
+    PostIndex *old_posts = table->posts_by_id;
+    unsigned int num_kept = 0;
+    for (unsigned int i = 0; i < old_posts->num_kept; i++) {
+        num_kept += old_posts->kept[i].post != NULL;
+    }
+    for (unsigned int id = old_posts->base; id < base; id++) {
+        num_kept += old_posts->posts[id - old_posts->base] != NULL;
+    }
+
+    PostIndex *posts = new_post_index(base, capacity, num_kept);
+    unsigned int next = 0;
+    for (unsigned int i = 0; i < old_posts->num_kept; i++) {
+        if (old_posts->kept[i].post != NULL) {
+            posts->kept[next++] = old_posts->kept[i];
+        }
+    }
+    for (unsigned int id = old_posts->base; id < base; id++) {
+        if (old_posts->posts[id - old_posts->base] != NULL) {
+            posts->kept[next].id = id;
+            posts->kept[next++].post = old_posts->posts[id - old_posts->base];
+        }
+    }
+    memcpy(posts->posts, old_posts->posts + (base - old_posts->base),
+           (table->num_post_ids - base) * sizeof(Post *));
+    __atomic_store_n(&table->posts_by_id, posts, __ATOMIC_RELEASE);
+    epoch_retire(old_posts, free_post_index);
+}
+
+
+/*
+ * Give post the next post id of table and add its words to the table's
+ * search index.
+ */
+static void index_post(Post *post, UserTable *table) {
+    PostIndex *posts = table->posts_by_id;
+    if (table->num_post_ids - posts->base == posts->capacity) {
+        move_post_index(table, posts->base, posts->capacity * 2);
+        posts = table->posts_by_id;
+    }
+    post->id = table->num_post_ids;
+    posts->posts[post->id - posts->base] = post;
+    __atomic_store_n(&table->num_post_ids, post->id + 1, __ATOMIC_RELEASE);
+    table->live_posts++;
+    search_index_add(&table->search, post->id, post->contents);
+}
+
+
+/*
+ * Posts expired together, returned to their pool once no reader can
+ * still be reading them.
+ */
+typedef struct expired_posts {
+    Pool *pool;
+    int count;
+    Post *posts[EXPIRED_BATCH_SIZE];
+} ExpiredPosts;
+
+
+/*
+ * Return a batch of expired posts to their pool (an epoch_retire destroy
+ * function, called by the thread that retired it).
+ */
+static void free_expired_posts(void *ptr) {
+    ExpiredPosts *batch = ptr;
+    for (int i = 0; i < batch->count; i++) {
+        pool_free(batch->pool, batch->posts[i]);
+    }
+    free(batch);
+}
+
+
+/*
+ * Retire the posts of table that expired since this was last called.
+ */
+static void retire_expired_posts(UserTable *table) {
+    if (table->expired != NULL) {
+        table->expired->pool = &table->post_pool;
+        epoch_retire(table->expired, free_expired_posts);
+        table->expired = NULL;
+    }
+}
+
+
+/*
+ * Take the count oldest posts off user's profile and out of table's
+ * posts_by_id, and hold them to be retired. Called inside a change of
+ * user's posts_version.
+ */
+static void expire_oldest_posts(User *user, int count, UserTable *table) {
+    Post *newer = user->last_post;
+    for (int i = 0; i < count; i++) {
+        Post *post = newer;
+        newer = post->newer;
+        __atomic_store_n(post_slot(table->posts_by_id, post->id), NULL, __ATOMIC_RELEASE);
+        table->live_posts--;
+        if (post->id >= table->mapped_post_ids) {
+            table->live_contents_bytes -= strlen(post->contents) + 1;
+        }
+        table->posts_expired++;
+        table->bytes_reclaimed += table->post_pool.object_size;
+
+        if (table->expired == NULL) {
+            table->expired = malloc(sizeof(ExpiredPosts));
+            if (table->expired == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            table->expired->count = 0;
+        }
+        table->expired->posts[table->expired->count++] = post;
+        if (table->expired->count == EXPIRED_BATCH_SIZE) {
+            retire_expired_posts(table);
+        }
+    }
+
+    // a reader that is walking the list sees it end early
+    if (newer == NULL) {
+        __atomic_store_n(&user->first_post, NULL, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&newer->next, NULL, __ATOMIC_RELEASE);
+    }
+    user->last_post = newer;
+    __atomic_store_n(&user->num_posts, user->num_posts - count, __ATOMIC_RELAXED);
 }
 
 
@@ -353,48 +1506,563 @@ char *print_user(const User *user) {
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * The post and a copy of 'contents' are allocated from table, which
+ * target must belong to. If target then has more than table->max_posts
+ * posts, the oldest expires (see expire_posts).
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents) {
+int make_post(const User *author, User *target, const char *contents, UserTable *table) {
+    return make_post_at(author, target, contents, time(NULL), table);
+}
+
+
+/*
+ * Like make_post, but the post is dated date instead of the current time
+ * (used to replay posts from the write-ahead log).
+ */
+int make_post_at(const User *author, User *target, const char *contents, time_t date,
+                 UserTable *table) {
     if (target == NULL || author == NULL) {
         return 2;
     }
 
-    int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
-            friends = 1;
+    if (!is_friend(target, author)) {
+        return 1;
+    }
+
+    // Create post
+    Post *new_post = pool_alloc(&table->post_pool);
+    new_post->author = author;
+    new_post->target = target;
+    size_t len = strlen(contents);
+    new_post->contents = arena_strndup(&table->post_arena, contents, len);
+    table->live_contents_bytes += len + 1;
+    new_post->date = date;
+    format_post_date(new_post->date, new_post->date_str);
+    // the id is set before readers can find the post on the profile
+    index_post(new_post, table);
+    begin_change(&target->posts_version);
+    new_post->next = target->first_post;
+    new_post->newer = NULL;
+    if (target->first_post == NULL) {
+        target->last_post = new_post;
+    } else {
+        target->first_post->newer = new_post;
+    }
+    __atomic_store_n(&target->first_post, new_post, __ATOMIC_RELEASE);
+    __atomic_store_n(&target->num_posts, target->num_posts + 1, __ATOMIC_RELAXED);
+    if (table->max_posts > 0 && target->num_posts > table->max_posts) {
+        expire_oldest_posts(target, target->num_posts - table->max_posts, table);
+    }
+    end_change(&target->posts_version);
+    invalidate_cached_section(&target->cached_posts);
+
+    return 0;
+}
+
+
+/*
+ * Order posts by id.
+ */
+static int compare_post_ids(const void *a, const void *b) {
+    unsigned int id_a = (*(const Post **)a)->id;
+    unsigned int id_b = (*(const Post **)b)->id;
+    return id_a < id_b ? -1 : id_a > id_b;
+}
+
+
+/*
+ * Add the posts on the profiles of table's users to its search index, in
+ * the order of the ids they were loaded with, and give them new ids in
+ * that order. Called once, after loading them from a snapshot; posts made
+ * with make_post are indexed as they are made.
+ */
+void index_posts(UserTable *table) {
+    unsigned long num_posts = 0;
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        num_posts += user->num_posts;
+    }
+    if (num_posts == 0) {
+        return;
+    }
+    Post **posts = malloc(num_posts * sizeof(Post *));
+    if (posts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    unsigned long next = 0;
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        for (Post *post = user->first_post; post != NULL; post = post->next) {
+            posts[next++] = post;
+        }
+    }
+    qsort(posts, num_posts, sizeof(Post *), compare_post_ids);
+    for (unsigned long i = 0; i < num_posts; i++) {
+        index_post(posts[i], table);
+    }
+    free(posts);
+    table->mapped_post_ids = table->num_post_ids;
+    table->cap_next = table->head;
+}
+
+
+/*
+ * Free an arena retired by expire_posts.
+ */
+static void free_retired_arena(void *ptr) {
+    free_arena(ptr);
+    free(ptr);
+}
+
+
+/*
+ * Do up to budget steps of the work of keeping table's posts within its
+ * retention limits, each looking at one post or user: expire posts older
+ * than max_post_age, oldest first, cap the users loaded from a snapshot
+ * to max_posts (make_post caps the others as it goes), and once more of
+ * post_arena is taken by expired posts than by the others, copy the live
+ * contents to a new arena and free the old one. Expired posts are taken
+ * off their profile and out of posts_by_id, so search and feeds skip them,
+ * and freed once no reader can hold them.
+ * Return 1 if the budget ran out before the work did, 0 otherwise.
+ */
+int expire_posts(UserTable *table, time_t now, int budget) {
+    // ids are handed out in the order posts are made, and all of a
+    // profile's posts come from the table of its user, so the post with
+    // the lowest live id is the oldest on its profile; without an age
+    // limit, expire_next still moves past the posts capping expired
+    while (budget > 0 && table->expire_next < table->num_post_ids) {
+        Post *post = find_post(table, table->expire_next);
+        if (post != NULL) {
+            if (table->max_post_age == 0 || post->date > now - table->max_post_age) {
+                break;
+            }
+            User *user = (User *)post->target;
+            begin_change(&user->posts_version);
+            expire_oldest_posts(user, 1, table);
+            end_change(&user->posts_version);
+            invalidate_cached_section(&user->cached_posts);
+        }
+        __atomic_store_n(&table->expire_next, table->expire_next + 1, __ATOMIC_RELAXED);
+        budget--;
+    }
+
+    while (table->cap_next != NULL && budget > 0) {
+        User *user = table->cap_next;
+        if (table->max_posts > 0 && user->num_posts > table->max_posts) {
+            int count = user->num_posts - table->max_posts;
+            if (count > budget) {
+                count = budget;
+            }
+            begin_change(&user->posts_version);
+            expire_oldest_posts(user, count, table);
+            end_change(&user->posts_version);
+            invalidate_cached_section(&user->cached_posts);
+            budget -= count;
+            if (user->num_posts > table->max_posts) {
+                continue;
+            }
+        } else {
+            budget--;
+        }
+        table->cap_next = user->next;
+    }
+    retire_expired_posts(table);
+
+    // once most of posts_by_id is expired posts, move its base up to leave
+    // twice as many ids as there are live posts, or to expire_next if that
+    // is higher, keeping aside the live posts below; a post that outlives
+    // those made after it, as one may under max_posts, holds nothing back
+    PostIndex *posts = table->posts_by_id;
+    unsigned int span = table->num_post_ids - posts->base;
+    if (span > posts->capacity / 2 && span > table->live_posts * 4) {
+        unsigned int base = table->num_post_ids - table->live_posts * 2;
+        if (base < table->expire_next) {
+            base = table->expire_next;
+        }
+        unsigned int capacity = POST_IDS_INITIAL_CAPACITY;
+        while (capacity < (table->num_post_ids - base) * 2) {
+            capacity *= 2;
+        }
+        size_t old_bytes = post_index_bytes(posts);
+        move_post_index(table, base, capacity);
+        if (post_index_bytes(table->posts_by_id) < old_bytes) {
+            table->bytes_reclaimed += old_bytes - post_index_bytes(table->posts_by_id);
+        }
+    }
+    // the ids below the base of posts_by_id are expired but for the few
+    // kept, so the search index is pruned of the others
+    unsigned long search_bytes = table->search.bytes;
+    budget = search_index_prune(&table->search, table->posts_by_id->base, is_live_post, table,
+                                budget);
+    if (table->search.bytes < search_bytes) {
+        table->bytes_reclaimed += search_bytes - table->search.bytes;
+    }
+
+    if (!table->compacting) {
+        size_t dead_bytes = table->post_arena.bytes_used - table->live_contents_bytes;
+        if (dead_bytes >= COMPACT_MIN_BYTES && dead_bytes > table->live_contents_bytes) {
+            // posts made from now on go to the new arena
+            table->compact_arena = table->post_arena;
+            init_arena(&table->post_arena, table->compact_arena.chunk_size);
+            table->compact_next = table->expire_next > table->mapped_post_ids ?
+                                  table->expire_next : table->mapped_post_ids;
+            table->compact_end = table->num_post_ids;
+            table->compacting = 1;
+        }
+    }
+    while (table->compacting && budget > 0) {
+        if (table->compact_next == table->compact_end) {
+            Arena *old = malloc(sizeof(Arena));
+            if (old == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            *old = table->compact_arena;
+            table->bytes_reclaimed += old->bytes_reserved;
+            table->compactions++;
+            init_arena(&table->compact_arena, old->chunk_size);
+            epoch_retire(old, free_retired_arena);
+            table->compacting = 0;
             break;
         }
+        Post *post = find_post(table, table->compact_next++);
+        if (post != NULL) {
+            char *copy = arena_strndup(&table->post_arena, post->contents,
+                                       strlen(post->contents));
+            __atomic_store_n(&post->contents, copy, __ATOMIC_RELEASE);
+        }
+        budget--;
     }
+    return budget == 0;
+}
 
-    if (friends == 0) {
-        return 1;
+
+/*
+ * Store in hits, newest first, up to limit of the newest posts in table
+ * that contain every one of the num_terms words in terms (as next_term
+ * splits them), and return how many were stored. May be called from
+ * reader threads, inside their epoch.
+ */
+int search_posts(const UserTable *table, char terms[][SEARCH_MAX_TERM], int num_terms,
+                 const Post **hits, int limit) {
+    unsigned int ids[limit];
+    // the ids below expire_next have all expired, so the search stops there
+    int found = search_index_query(&table->search, terms, num_terms, ids, limit,
+                                   __atomic_load_n(&table->expire_next, __ATOMIC_RELAXED),
+                                   is_live_post, (void *)table);
+    int num_hits = 0;
+    for (int i = 0; i < found; i++) {
+        // skip those that expired since they were accepted
+        hits[num_hits] = find_post(table, ids[i]);
+        if (hits[num_hits] != NULL) {
+            num_hits++;
+        }
     }
+    return num_hits;
+}
 
-    // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
+
+/*
+ * Pass to emit a post as a search result: its author, the user it was
+ * posted to, its date and its contents.
+ */
+void render_post(const Post *post, Emitter emit, void *context) {
+    emit_string(emit, context, "From: ");
+    emit_string(emit, context, post->author->name);
+    emit_string(emit, context, "\r\nTo: ");
+    emit_string(emit, context, post->target->name);
+    emit_string(emit, context, "\r\nDate: ");
+    emit_string(emit, context, post->date_str);
+    emit_string(emit, context, "\r\n\r\n");
+    emit_string(emit, context, __atomic_load_n(&post->contents, __ATOMIC_ACQUIRE));
+    emit_string(emit, context, "\r\n");
+}
+
+
+/*
+ * Return the table user belongs to, of the tables indexed by id_offset.
+ */
+static const UserTable *table_of(const User *user, UserTable *const *tables) {
+    return tables[user->id % tables[0]->id_stride];
+}
+
+
+/*
+ * Return whether posts on user's profile are left out of the timelines of
+ * their friends, for having more friends than table's fanout_limit, where
+ * table is the one user belongs to. Once a user is, they stay so.
+ */
+int is_heavy_poster(const User *user, const UserTable *table) {
+    return (unsigned int)__atomic_load_n(&user->num_friends, __ATOMIC_RELAXED) >
+           table->fanout_limit;
+}
+
+
+/*
+ * Add the post of table with this id, which is on the profile of one of
+ * user's friends, to user's timeline, dropping the oldest post in it if
+ * it is full. Does nothing if user's timeline is not built, as it will
+ * be built from their friends' profiles, or already has the post.
+ */
+void push_timeline(User *user, const UserTable *table, unsigned int post_id) {
+    if (user->timeline == NULL) {
+        return;
+    }
+    // a post made while the timeline was being built may have been merged
+    // into it before it arrives from another thread
+    for (int i = 0; i < user->timeline_count; i++) {
+        FeedEntry *entry = &user->timeline[(user->timeline_start + i) % FEED_TIMELINE_SIZE];
+        if (entry->id == post_id && entry->table == table) {
+            return;
+        }
+    }
+
+    FeedEntry *entry = &user->timeline[(user->timeline_start + user->timeline_count) %
+                                       FEED_TIMELINE_SIZE];
+    if (user->timeline_count == FEED_TIMELINE_SIZE) {
+        user->timeline_start = (user->timeline_start + 1) % FEED_TIMELINE_SIZE;
+    } else {
+        user->timeline_count++;
+    }
+    entry->table = table;
+    entry->id = post_id;
+}
+
+
+/*
+ * One of the sequences of posts, newest first, merged into a feed: a
+ * profile, or an array of posts.
+ */
+typedef struct feed_cursor {
+    const Post *post;           // the next post, NULL once there are none
+    int left;                   // posts after it
+    const Post *const *array;   // the posts after it, or NULL for a profile
+} FeedCursor;
+
+
+/*
+ * Start a cursor at the newest post on user's profile.
+ */
+static void start_profile_cursor(FeedCursor *cursor, const User *user) {
+    // as in render_posts_section, the newest post and the count pin down
+    // the whole list
+    unsigned long version;
+    do {
+        version = read_begin(&user->posts_version);
+        cursor->post = __atomic_load_n(&user->first_post, __ATOMIC_ACQUIRE);
+        cursor->left = __atomic_load_n(&user->num_posts, __ATOMIC_RELAXED) - 1;
+    } while (read_retry(&user->posts_version, version));
+    cursor->array = NULL;
+}
+
+
+/*
+ * Move cursor to its next post.
+ */
+static void advance_cursor(FeedCursor *cursor) {
+    if (cursor->left <= 0) {
+        cursor->post = NULL;
+    } else if (cursor->array != NULL) {
+        cursor->left--;
+        cursor->post = *cursor->array++;
+    } else {
+        // the oldest posts may expire while they are read, ending the
+        // profile early
+        cursor->left--;
+        cursor->post = __atomic_load_n(&cursor->post->next, __ATOMIC_ACQUIRE);
+    }
+}
+
+
+/*
+ * Restore the heap order of heap, a max-heap of n cursors by the date of
+ * their next post, after the date of the one at i went down.
+ */
+static void sift_cursors(FeedCursor **heap, int n, int i) {
+    while (1) {
+        int newest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+            if (heap[child]->post->date > heap[newest]->post->date) {
+                newest = child;
+            }
+        }
+        if (newest == i) {
+            return;
+        }
+        FeedCursor *tmp = heap[i];
+        heap[i] = heap[newest];
+        heap[newest] = tmp;
+        i = newest;
+    }
+}
+
+
+/*
+ * Store in posts, newest first, up to limit of the newest posts of
+ * num_cursors cursors, merged by a heap over them, and return how many
+ * were stored.
+ */
+static int merge_posts(FeedCursor *cursors, int num_cursors, const Post **posts, int limit) {
+    // room for at least one, since malloc(0) may return NULL
+    FeedCursor **heap = malloc((num_cursors > 0 ? num_cursors : 1) * sizeof(FeedCursor *));
+    if (heap == NULL) {
         perror("malloc");
         exit(1);
     }
-    strncpy(new_post->author, author->name, MAX_NAME);
-    new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
+    int n = 0;
+    for (int i = 0; i < num_cursors; i++) {
+        if (cursors[i].post != NULL) {
+            heap[n++] = &cursors[i];
+        }
+    }
+    // heapify: sift down every parent, last first
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        sift_cursors(heap, n, i);
+    }
+
+    int found = 0;
+    while (found < limit && n > 0) {
+        posts[found++] = heap[0]->post;
+        advance_cursor(heap[0]);
+        if (heap[0]->post == NULL) {
+            heap[0] = heap[--n];
+        }
+        sift_cursors(heap, n, 0);
+    }
+    free(heap);
+    return found;
+}
+
+
+/*
+ * Build user's timeline from the newest posts on the profiles of their
+ * friends who are not heavy posters.
+ */
+static void build_timeline(User *user, UserTable *const *tables) {
+    // room for at least one, since malloc(0) may return NULL
+    FeedCursor *cursors = malloc((user->num_friends > 0 ? user->num_friends : 1) *
+                                 sizeof(FeedCursor));
+    const Post **posts = malloc(FEED_TIMELINE_SIZE * sizeof(Post *));
+    user->timeline = malloc(FEED_TIMELINE_SIZE * sizeof(FeedEntry));
+    if (cursors == NULL || posts == NULL || user->timeline == NULL) {
         perror("malloc");
         exit(1);
     }
-    time(new_post->date);
-    new_post->next = target->first_post;
-    target->first_post = new_post;
 
-    return 0;
+    int num_cursors = 0;
+    for (int i = 0; i < user->num_friends; i++) {
+        const User *friend = user->friends[i];
+        if (!is_heavy_poster(friend, table_of(friend, tables))) {
+            start_profile_cursor(&cursors[num_cursors++], friend);
+        }
+    }
+    int count = merge_posts(cursors, num_cursors, posts, FEED_TIMELINE_SIZE);
+
+    // oldest first, as if each had been pushed when it was made
+    for (int i = 0; i < count; i++) {
+        const Post *post = posts[count - 1 - i];
+        user->timeline[i].table = table_of(post->target, tables);
+        user->timeline[i].id = post->id;
+    }
+    user->timeline_start = 0;
+    user->timeline_count = count;
+    free(posts);
+    free(cursors);
 }
 
+
+/*
+ * Store in posts, newest first, the posts of user's timeline that are
+ * still on their profiles, but for those of heavy posters, and return how
+ * many were stored. The timeline is in the order the posts arrived in,
+ * which is nearly by date, so insertion sorts it quickly.
+ */
+static int timeline_posts(const User *user, const Post **posts) {
+    int num_posts = 0;
+    for (int i = user->timeline_count - 1; i >= 0; i--) {
+        const FeedEntry *entry = &user->timeline[(user->timeline_start + i) % FEED_TIMELINE_SIZE];
+        const Post *post = find_post(entry->table, entry->id);
+        // a friend who became a heavy poster is merged by render_feed
+        if (post == NULL || is_heavy_poster(post->target, entry->table)) {
+            continue;
+        }
+        int pos = num_posts;
+        while (pos > 0 && posts[pos - 1]->date < post->date) {
+            posts[pos] = posts[pos - 1];
+            pos--;
+        }
+        posts[pos] = post;
+        num_posts++;
+    }
+    return num_posts;
+}
+
+
+/*
+ * Pass to emit the limit newest posts on the profiles of user's friends,
+ * newest first and separated like the posts of a profile, where limit is
+ * at most FEED_TIMELINE_SIZE. Posts on the profiles of friends who are
+ * not heavy posters come from user's timeline, which is first built by
+ * merging those profiles, and rebuilt so when expired posts leave it too
+ * short; heavy posters' profiles are merged with it as the feed is read.
+ * tables are all the tables that user's friends may belong to, indexed by
+ * their id_offset. Only called by user's owner, inside an epoch if friends
+ * are owned by other threads.
+ * Return 1 if any profile had to be merged, 0 if the timeline sufficed.
+ */
+int render_feed(User *user, UserTable *const *tables, int limit, Emitter emit, void *context) {
+    int merged = 0;
+    if (user->timeline == NULL) {
+        build_timeline(user, tables);
+        merged = 1;
+    }
+
+    // a cursor for the timeline and one for each friend; room for at least
+    // one post, since malloc(0) may return NULL
+    const Post **timeline = malloc(FEED_TIMELINE_SIZE * sizeof(Post *));
+    FeedCursor *cursors = malloc((user->num_friends + 1) * sizeof(FeedCursor));
+    const Post **posts = malloc((limit > 0 ? limit : 1) * sizeof(Post *));
+    if (timeline == NULL || cursors == NULL || posts == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int num_timeline = timeline_posts(user, timeline);
+    if (num_timeline < limit && user->timeline_count == FEED_TIMELINE_SIZE && !merged) {
+        // posts that expired left holes in the full timeline, and older
+        // posts that would fill them were dropped from it
+        free(user->timeline);
+        build_timeline(user, tables);
+        merged = 1;
+        num_timeline = timeline_posts(user, timeline);
+    }
+
+    cursors[0].post = num_timeline > 0 ? timeline[0] : NULL;
+    cursors[0].left = num_timeline - 1;
+    cursors[0].array = timeline + 1;
+    int num_cursors = 1;
+    for (int i = 0; i < user->num_friends; i++) {
+        const User *friend = user->friends[i];
+        if (is_heavy_poster(friend, table_of(friend, tables))) {
+            start_profile_cursor(&cursors[num_cursors++], friend);
+            merged = 1;
+        }
+    }
+    int count = merge_posts(cursors, num_cursors, posts, limit);
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            emit_string(emit, context, "===\r\n");
+        }
+        render_post(posts[i], emit, context);
+    }
+    free(posts);
+    free(cursors);
+    free(timeline);
+    return merged;
+}
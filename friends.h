@@ -1,27 +1,246 @@
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
 #include <time.h>
 
+#include "alloc.h"
+#include "search.h"
+
 #define MAX_NAME 32     // Max username and profile_pic filename lengths
-#define MAX_FRIENDS 10  // Max number of friends a user can have
+#define MAX_FRIENDS 0   // Default max number of friends a user can have;
+                        // 0 means there is no limit
+#define FRIENDS_INITIAL_CAPACITY 4  // Initial size of a user's friends array
+#define PROFILE_PAGE_SIZE 20  // Posts rendered by a profile request without a limit
+#define POST_DATE_LEN 32  // Room for a date formatted like asctime(), without
+                          // the newline, plus the null terminator
+#define PROFILE_DASH "------------------------------------------\r\n"
+#define GALLOP_RATIO 16 // Intersect by galloping search once one friends
+                        // array is this many times longer than the other
+#define USER_TABLE_INITIAL_CAPACITY 64  // Initial number of hash index slots
+#define PROFILE_SECTIONS 2    // Cached renderings making up a profile's first page
+#define NAME_INDEX_LEVELS 16  // Levels of the sorted name index; each holds about
+                              // a quarter of the users of the level below
+#define USER_LIST_INITIAL_CAPACITY 256  // Initial bytes of a table's user list
+#define POST_IDS_INITIAL_CAPACITY 256   // Initial size of a table's posts_by_id
+#define FEED_TIMELINE_SIZE 100  // Posts kept in a user's timeline, and the most
+                                // a feed shows
+#define FEED_DEFAULT_SIZE 20    // Posts a feed shows without a count
+#define FEED_FANOUT_LIMIT 1000  // Default UserTable fanout_limit
+#define EXPIRED_BATCH_SIZE 256  // Expired posts retired together
+#define COMPACT_MIN_BYTES (1024 * 1024)  // Dead bytes in the post arena before
+                                         // it is worth compacting
+
+/*
+ * A cached rendering of one section of a profile, as of the given version
+ * of the data it shows (see User), or of a table's list of users. It is
+ * freed once the last reference to it is released: the cache holds one
+ * while it is cached, and whoever is still sending it holds another.
+ */
+typedef struct rendering {
+    unsigned long version;
+    int refs;
+    int len;
+    int capacity;       // bytes allocated for data; a user list is
+                        // appended to in place until it is full
+    char data[];
+} Rendering;
 
+/*
+ * A post in a timeline: the id of a post in table, which find_post finds
+ * for as long as it is kept.
+ */
+typedef struct feed_entry {
+    const struct user_table *table;
+    unsigned int id;
+} FeedEntry;
+
+/*
+ * A user is changed only by the thread that owns it, but may be read by
+ * reader threads at the same time (see epoch.h). The friends and the posts
+ * each have a version that is odd while they are being changed, so a
+ * reader can tell whether what it read belongs to a single version.
+ */
 typedef struct user {
     char name[MAX_NAME];
+    unsigned int hash;           // hash_name(name), computed once at creation
+    unsigned int id;             // id_offset + id_stride * position in the
+                                 // table's creation order
     char profile_pic[MAX_NAME];  // This is a *filename*, not the file contents.
     struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
+    struct post *last_post;      // the oldest, which expires first
+    int num_posts;
+    unsigned long posts_version;
+    // cached rendering of the first page of the profile, split at the end
+    // of the friends list; a section that is NULL or of an older version
+    // is re-rendered on next use
+    Rendering *cached_friends;
+    Rendering *cached_posts;
+    unsigned long friends_version;
+    struct user **friends;       // friends sorted by id, grown on demand
+    unsigned int *friend_ids;    // friends[i]->id, kept alongside so that
+                                 // searches do not dereference each friend
+    int num_friends;
+    int friends_capacity;
+    int reserved_friends;        // slots held for friendships still being
+                                 // made with users in other tables
+    struct client *sessions;     // live connections logged in as this user,
+                                 // maintained by the server
     struct user *next;
+    // the user's tower in the table's sorted name index: the next user in
+    // name order on each of the lowest levels, as many as the tower is high
+    struct user **sorted_next;
+    // the newest posts fanned out to the user from the profiles of their
+    // friends (see render_feed), oldest first, as a ring buffer of
+    // FEED_TIMELINE_SIZE entries; NULL until the user's feed is first
+    // read, and again once they make a new friend. Only the owner uses it.
+    FeedEntry *timeline;
+    int timeline_start;
+    int timeline_count;
 } User;
 
 typedef struct post {
-    char author[MAX_NAME];
-    char *contents;
-    time_t *date;
-    struct post *next;
+    const struct user *author;
+    const struct user *target;     // whose profile the post is on
+    unsigned int id;               // key in the table's posts_by_id
+    char *contents;                // stored in the table's post arena, or in
+                                   // the mapping of a loaded snapshot
+    time_t date;
+    char date_str[POST_DATE_LEN];  // date, formatted once when posted
+    struct post *next;             // the next older post on the profile
+    struct post *newer;            // the one before, used only by the owner
 } Post;
 
+/*
+ * The hash index of a UserTable. It is replaced as a whole when it grows,
+ * so readers always see a capacity that matches the slots.
+ */
+typedef struct user_index {
+    unsigned int capacity;  // number of slots, always a power of two
+    User *slots[];          // NULL marks an empty slot
+} UserIndex;
+
+/*
+ * A post kept by a PostIndex below its base, one that outlived most of
+ * the posts made around it.
+ */
+typedef struct kept_post {
+    unsigned int id;
+    Post *post;             // NULL once it expired
+} KeptPost;
 
 /*
- * Create a new user with the given name.  Insert it at the tail of the list
- * of users whose head is pointed to by *user_ptr_add.
+ * A UserTable's posts by id: those with ids from base on in posts, and
+ * the live ones below base in kept. It is replaced as a whole when it is
+ * full, or when most of it is taken by posts that expired, which moves
+ * base up, so readers look posts up with find_post.
+ */
+typedef struct post_index {
+    unsigned int base;      // id of the post in posts[0]
+    unsigned int capacity;
+    KeptPost *kept;         // ascending by id
+    unsigned int num_kept;
+    Post *posts[];          // NULL for a post that expired
+} PostIndex;
+
+/*
+ * The directory of all users. Users are kept in a linked list in insertion
+ * order and indexed by name in an open-addressing hash table with linear
+ * probing (for find_user) and in a skip list sorted by name (for pages of
+ * list_users). The usernames are also kept ready to send, in the order
+ * they were added, in user_list. All of these can be read by reader
+ * threads while the owner adds users; as users are never removed, the
+ * list and the skip list can be read without an epoch.
+ * The table owns the memory of its users and their posts: User and Post
+ * objects come from slab pools and post contents from an append-only arena.
+ */
+typedef struct user_table {
+    User *head;             // first user created
+    User *tail;             // last user created
+    UserIndex *index;
+    unsigned int count;     // number of users in the table
+    // ids of the table's users; a set of tables partitioning the users
+    // gives each a distinct offset and the same stride, so ids stay unique
+    unsigned int id_offset;
+    unsigned int id_stride;
+    unsigned int max_friends;  // max friends per user, 0 for no limit
+    // posts on the profile of a user with more friends than this are not
+    // fanned out to the friends' timelines, but merged into feeds as they
+    // are read
+    unsigned int fanout_limit;
+    Pool user_pool;
+    Pool post_pool;
+    Arena post_arena;       // post contents
+    // the first user on each level of the sorted name index, the towers of
+    // which come from index_arena, and the state picking their heights
+    User *sorted_head[NAME_INDEX_LEVELS];
+    Arena index_arena;
+    unsigned int index_seed;
+    // "name\r\n" for each user in the list; replaced by a larger copy when
+    // full, so only the first len bytes of one that was acquired are stable
+    Rendering *user_list;
+    // the words of the posts on the table's users' profiles, by post id,
+    // and the posts those ids stand for, oldest first; num_post_ids is the
+    // next id to hand out
+    SearchIndex search;
+    PostIndex *posts_by_id;
+    unsigned int num_post_ids;
+    unsigned int live_posts;    // posts given an id that have not expired
+    // retention (see expire_posts): a user keeps at most max_posts posts,
+    // and posts expire once max_post_age seconds old; 0 for no limit
+    unsigned int max_posts;
+    time_t max_post_age;
+    unsigned int expire_next;   // lowest post id not known to have expired;
+                                // readers use it as the floor of a search
+    User *cap_next;             // next user to cap after loading a snapshot
+    struct expired_posts *expired;  // expired posts not yet retired
+    // posts with ids below mapped_post_ids have their contents in the
+    // mapping of a snapshot, the others in post_arena, or in compact_arena
+    // while its live contents are copied out to post_arena: those of ids
+    // compact_next to compact_end
+    unsigned int mapped_post_ids;
+    size_t live_contents_bytes; // arena bytes of the posts not expired
+    int compacting;
+    Arena compact_arena;
+    unsigned int compact_next;
+    unsigned int compact_end;
+    unsigned long posts_expired;
+    unsigned long bytes_reclaimed;  // of expired posts, compacted arenas
+                                    // and what indexed expired posts
+    unsigned long compactions;
+    // scratch space for suggest_friends, indexed by user id
+    unsigned int *mutual_counts;
+    User **candidates;
+    unsigned int scratch_size;
+    // profile requests served by render_cached_profile, from any thread
+    unsigned long profile_cache_hits;
+    unsigned long profile_cache_misses;
+} UserTable;
+
+
+/*
+ * Initialize an empty user table whose users can have at most MAX_FRIENDS
+ * friends.
+ */
+void init_user_table(UserTable *table);
+
+
+/*
+ * Return the hash of a user name (32-bit FNV-1a).
+ */
+unsigned int hash_name(const char *name);
+
+
+/*
+ * Return which of num_shards tables owns the user whose name has this
+ * hash. The table's index uses the low bits of the hash, so the shard is
+ * chosen by the high bits.
+ */
+unsigned int shard_of(unsigned int hash, unsigned int num_shards);
+
+
+/*
+ * Create a new user with the given name.  Insert it at the tail of the
+ * table's list of users and add it to the table's name index.
  *
  * Return:
  *   - 0 if successful
@@ -29,17 +248,21 @@ typedef struct post {
  *   - 2 if the given name cannot fit in the 'name' array
  *       (don't forget about the null terminator)
  */
-int create_user(const char *name, User **user_ptr_add);
+int create_user(const char *name, UserTable *table);
 
 
 /*
- * Return a pointer to the user with this name in
- * the list starting with head. Return NULL if no such user exists.
- *
- * NOTE: You'll likely need to cast a (const User *) to a (User *)
- * to satisfy the prototype without warnings.
+ * Return a pointer to the user with this name in the table.
+ * Return NULL if no such user exists.
+ */
+User *find_user(const char *name, const UserTable *table);
+
+
+/*
+ * Return the post of table with this id, or NULL if it expired or no
+ * post has it. May be called from reader threads, inside their epoch.
  */
-User *find_user(const char *name, const User *head);
+Post *find_post(const UserTable *table, unsigned int id);
 
 
 /*
@@ -49,32 +272,155 @@ User *find_user(const char *name, const User *head);
 char *list_users(const User *curr);
 
 
+/*
+ * Return the table's user list, what list_users returns for table->head
+ * without the null terminator, with a reference for the caller to drop
+ * with release_rendering, and store its length in *len. Only the first
+ * *len bytes are part of the list the caller got, but they stay as they
+ * are. May be called from reader threads, inside their epoch.
+ */
+Rendering *acquire_user_list(UserTable *table, int *len);
+
+
+
+/*
+ * Return 1 if other is in user's friends array, 0 otherwise.
+ * Takes O(log n) time in the number of user's friends.
+ */
+int is_friend(const User *user, const User *other);
+
 
 /*
  * Make two users friends with each other.  This is symmetric - a pointer to
  * each user must be stored in the 'friends' array of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * Each 'friends' array is kept sorted by user id.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
  *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
+ *     table->max_friends friends.
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
  * Do not modify either user if the result is a failure.
  * NOTE: If multiple errors apply, return the *largest* error code that applies.
  */
-int make_friends(const char *name1, const char *name2, User *head);
+int make_friends(const char *name1, const char *name2, UserTable *table);
+
+
+/*
+ * Add other to user's friends array: one half of a friendship, for users
+ * in different tables. The other half is added by the owner of other.
+ *
+ * Return:
+ *   - 0 on success.
+ *   - 1 if other is already user's friend.
+ *   - 2 if user already has max_friends friends (counting reserved ones);
+ *     0 means no limit.
+ */
+int add_friend(User *user, User *other, unsigned int max_friends);
+
+
+/*
+ * Store in result the friends that user1 and user2 have in common, sorted
+ * by id, and return how many there are. result must have room for the
+ * smaller of the two users' num_friends.
+ *
+ * The friends arrays are intersected with a sorted merge, or by galloping
+ * through the longer array when their sizes differ by GALLOP_RATIO or more.
+ */
+int intersect_friends(const User *user1, const User *user2, User **result);
+
+
+/*
+ * Find the (at most) k users that are not yet friends with user but share
+ * the most friends with them. Store them in result, most mutual friends
+ * first (ties go to the older user), with the number of mutual friends of
+ * each in mutual_counts, and return how many were found.
+ * result and mutual_counts must have room for k entries.
+ */
+int suggest_friends(const User *user, UserTable *table, int k, User **result,
+                    unsigned int *mutual_counts);
+
+
+/*
+ * Return a pointer to a dynamically allocated string listing the mutual
+ * friends of user1 and user2.
+ */
+char *list_mutual_friends(const User *user1, const User *user2);
+
+
+/*
+ * Return a pointer to a dynamically allocated string listing up to k
+ * friend suggestions for user, with their number of mutual friends.
+ */
+char *list_suggestions(const User *user, UserTable *table, int k);
+
+
+/*
+ * Called with each piece of rendered output, in order. context is passed
+ * through unchanged from the render call.
+ */
+typedef void (*Emitter)(void *context, const char *bytes, int len);
+
+
+/*
+ * Pass to emit the usernames, each followed by "\r\n", of the users of
+ * num_tables tables whose names start with prefix, in name order,
+ * skipping the first offset and stopping after limit of them (limit < 0
+ * for no limit). Takes O(log n) time to find the first name in each table
+ * and O(num_tables) time per user skipped or emitted after that. May be
+ * called from any thread.
+ */
+void render_sorted_users(UserTable *const *tables, int num_tables, const char *prefix,
+                         int offset, int limit, Emitter emit, void *context);
+
+
+/*
+ * Render user's profile, showing at most limit of their posts starting
+ * with the offset'th newest (limit < 0 shows every post from offset on),
+ * and pass the output piece by piece to emit. Nothing is buffered or sized
+ * up front, so the cost is proportional to the page, not the whole profile.
+ * For an example of the output format, see the example output linked from
+ * the handout.
+ */
+void render_profile(const User *user, int offset, int limit, Emitter emit, void *context);
+
+
+/*
+ * Emit the first page of user's profile (what render_profile emits for
+ * offset 0 and limit PROFILE_PAGE_SIZE) from the user's cached rendering,
+ * re-rendering only the sections that changed since the last call.
+ * make_friends and make_post invalidate the sections they affect.
+ * Counts a hit in table if nothing had to be rendered, a miss otherwise.
+ * May be called from reader threads.
+ */
+void render_cached_profile(User *user, UserTable *table, Emitter emit, void *context);
+
+
+/*
+ * Store in sections the cached renderings that render_cached_profile
+ * emits, in order, without copying them: each comes with a reference that
+ * the caller must drop with release_rendering once done with it, so the
+ * bytes can be sent straight from the cache. May be called from reader
+ * threads, inside their epoch.
+ */
+void acquire_cached_profile(User *user, UserTable *table, Rendering **sections);
+
+
+/*
+ * Drop a reference to rendering, freeing it if it was the last. May be
+ * called from any thread.
+ */
+void release_rendering(Rendering *rendering);
 
 
 /*
  * Return a pointer to a dynamically allocated string containing
- * a user profile.
- * For an example of the required output format, see the example output
- * linked from the handout.
+ * a user's whole profile (see render_profile), or an empty string if user
+ * is NULL.
  */
 char *print_user(const User *user);
 
@@ -87,14 +433,107 @@ char *print_user(const User *user);
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * The post and a copy of 'contents' are allocated from table, which
+ * target must belong to. If target then has more than table->max_posts
+ * posts, the oldest expires (see expire_posts).
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents);
+int make_post(const User *author, User *target, const char *contents, UserTable *table);
+
 
+/*
+ * Like make_post, but the post is dated date instead of the current time
+ * (used to replay posts from the write-ahead log).
+ */
+int make_post_at(const User *author, User *target, const char *contents, time_t date,
+                 UserTable *table);
+
+
+/*
+ * Add the posts on the profiles of table's users to its search index, in
+ * the order of the ids they were loaded with, and give them new ids in
+ * that order. Called once, after loading them from a snapshot; posts made
+ * with make_post are indexed as they are made. The loaded users are then
+ * capped to max_posts by expire_posts.
+ */
+void index_posts(UserTable *table);
+
+
+/*
+ * Do up to budget steps of the work of keeping table's posts within its
+ * retention limits, each looking at one post or user: expire posts older
+ * than max_post_age, oldest first, cap the users loaded from a snapshot
+ * to max_posts (make_post caps the others as it goes), and once more of
+ * post_arena is taken by expired posts than by the others, copy the live
+ * contents to a new arena and free the old one. Expired posts are taken
+ * off their profile and out of posts_by_id, so search and feeds skip them,
+ * and freed once no reader can hold them. Once most of posts_by_id is
+ * expired posts, its base is moved up to about twice as many ids as there
+ * are live posts, and the expired ids below it are pruned from the search
+ * index.
+ * Return 1 if the budget ran out before the work did, 0 otherwise.
+ */
+int expire_posts(UserTable *table, time_t now, int budget);
+
+
+/*
+ * Store in hits, newest first, up to limit of the newest posts in table
+ * that contain every one of the num_terms words in terms (as next_term
+ * splits them), and return how many were stored. May be called from
+ * reader threads, inside their epoch.
+ */
+int search_posts(const UserTable *table, char terms[][SEARCH_MAX_TERM], int num_terms,
+                 const Post **hits, int limit);
+
+
+/*
+ * Pass to emit a post as a search result: its author, the user it was
+ * posted to, its date and its contents.
+ */
+void render_post(const Post *post, Emitter emit, void *context);
+
+
+/*
+ * Return whether posts on user's profile are left out of the timelines of
+ * their friends, for having more friends than table's fanout_limit, where
+ * table is the one user belongs to. Once a user is, they stay so.
+ */
+int is_heavy_poster(const User *user, const UserTable *table);
+
+
+/*
+ * Add the post of table with this id, which is on the profile of one of
+ * user's friends, to user's timeline, dropping the oldest post in it if
+ * it is full. Does nothing if user's timeline is not built, as it will
+ * be built from their friends' profiles, or already has the post.
+ */
+void push_timeline(User *user, const UserTable *table, unsigned int post_id);
+
+
+/*
+ * Pass to emit the limit newest posts on the profiles of user's friends,
+ * newest first and separated like the posts of a profile, where limit is
+ * at most FEED_TIMELINE_SIZE. Posts on the profiles of friends who are
+ * not heavy posters come from user's timeline, which is first built by
+ * merging those profiles, and rebuilt so when expired posts leave it too
+ * short; heavy posters' profiles are merged with it as the feed is read.
+ * tables are all the tables that user's friends may belong to, indexed by
+ * their id_offset. Only called by user's owner, inside an epoch if friends
+ * are owned by other threads.
+ * Return 1 if any profile had to be merged, 0 if the timeline sufficed.
+ */
+int render_feed(User *user, UserTable *const *tables, int limit, Emitter emit, void *context);
+
+
+/*
+ * Store in date_str the local time date formatted like asctime(), without
+ * the trailing newline. Consecutive calls for the same second are served
+ * from a cache instead of calling into libc.
+ */
+void format_post_date(time_t date, char *date_str);
 
+#endif
@@ -0,0 +1,65 @@
+#include "mailbox.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/eventfd.h>
+
+
+/*
+ * Initialize an empty mailbox.
+ */
+void mailbox_init(Mailbox *mailbox) {
+    mailbox->head = NULL;
+    mailbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mailbox->event_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+}
+
+
+/*
+ * Post a chain of messages, linked from the newest to the oldest,
+ * and wake the owner if the mailbox was empty. Posting a chain built up
+ * during a batch of work costs the same as posting one message.
+ */
+void mailbox_post(Mailbox *mailbox, Mail *newest, Mail *oldest) {
+    Mail *head = __atomic_load_n(&mailbox->head, __ATOMIC_RELAXED);
+    do {
+        oldest->next = head;
+    } while (!__atomic_compare_exchange_n(&mailbox->head, &head, newest, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // a non-empty mailbox already has a wakeup pending
+    if (head == NULL) {
+        uint64_t one = 1;
+        while (write(mailbox->event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+
+/*
+ * Take every message in the mailbox, oldest first (messages from any one
+ * sender arrive in the order they were posted). Only called by the owner.
+ */
+Mail *mailbox_take(Mailbox *mailbox) {
+    // reset the wakeup before emptying the stack, so that mail posted
+    // after the exchange wakes the owner again
+    uint64_t count;
+    while (read(mailbox->event_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+
+    Mail *mail = __atomic_exchange_n(&mailbox->head, NULL, __ATOMIC_ACQUIRE);
+    Mail *oldest_first = NULL;
+    while (mail != NULL) {
+        Mail *next = mail->next;
+        mail->next = oldest_first;
+        oldest_first = mail;
+        mail = next;
+    }
+    return oldest_first;
+}
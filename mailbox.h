@@ -0,0 +1,47 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+/*
+ * A link embedded at the start of every message passed through a Mailbox.
+ */
+typedef struct mail {
+    struct mail *next;
+} Mail;
+
+/*
+ * A lock-free queue of messages from any number of threads to the one
+ * thread that owns the mailbox.
+ *
+ * Senders push onto a stack with a single compare-and-swap, and the owner
+ * takes the whole stack with a single exchange and reverses it, so neither
+ * side ever waits for the other. An eventfd, which the owner registers
+ * with its epoll instance, becomes readable when mail arrives in an empty
+ * mailbox.
+ */
+typedef struct mailbox {
+    Mail *head;          // most recently posted message
+    int event_fd;
+} Mailbox;
+
+
+/*
+ * Initialize an empty mailbox.
+ */
+void mailbox_init(Mailbox *mailbox);
+
+
+/*
+ * Post a chain of messages, linked from the newest to the oldest,
+ * and wake the owner if the mailbox was empty. Posting a chain built up
+ * during a batch of work costs the same as posting one message.
+ */
+void mailbox_post(Mailbox *mailbox, Mail *newest, Mail *oldest);
+
+
+/*
+ * Take every message in the mailbox, oldest first (messages from any one
+ * sender arrive in the order they were posted). Only called by the owner.
+ */
+Mail *mailbox_take(Mailbox *mailbox);
+
+#endif
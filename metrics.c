@@ -0,0 +1,124 @@
+#include "metrics.h"
+#include <time.h>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+
+/*
+ * Return the monotonic time in nanoseconds, for timing what is recorded.
+ */
+unsigned long metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+/*
+ * Return the bucket of value. Values below SUB_BUCKETS have a bucket each;
+ * above that, the bucket is picked by the position of the highest set bit
+ * and the HISTOGRAM_SUB_BITS bits below it.
+ */
+static int bucket_of(unsigned long value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzl(value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+
+/*
+ * Return the middle of the range of values in bucket.
+ */
+static unsigned long bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    unsigned long lowest = (unsigned long)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    return lowest + ((1UL << shift) >> 1);
+}
+
+
+/*
+ * Record value in h.
+ */
+void histogram_record(Histogram *h, unsigned long value) {
+    h->counts[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+}
+
+
+/*
+ * Return the value below which a fraction q of the values recorded in h
+ * fall, to the precision of its buckets, or 0 if h is empty.
+ */
+unsigned long histogram_quantile(const Histogram *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    unsigned long rank = (unsigned long)(q * h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            return bucket_value(i);
+        }
+    }
+    return bucket_value(HISTOGRAM_BUCKETS - 1);
+}
+
+
+/*
+ * Write the HELP and TYPE lines of a metric in the Prometheus text format,
+ * ending each line with eol.
+ */
+void metrics_describe(FILE *out, const char *name, const char *type, const char *help,
+                      const char *eol) {
+    fprintf(out, "# HELP %s %s%s# TYPE %s %s%s", name, help, eol, name, type, eol);
+}
+
+
+/*
+ * Write a sample of a metric, with labels (such as `shard="0"`) in braces
+ * unless they are empty.
+ */
+void metrics_sample(FILE *out, const char *name, const char *labels, double value,
+                    const char *eol) {
+    if (labels[0] == '\0') {
+        fprintf(out, "%s %.15g%s", name, value, eol);
+    } else {
+        fprintf(out, "%s{%s} %.15g%s", name, labels, value, eol);
+    }
+}
+
+
+/*
+ * Write the samples of a summary of the nanosecond values in h, in
+ * seconds: the 0.5, 0.9, 0.99 and 0.999 quantiles, the sum and the count.
+ */
+void metrics_summary(FILE *out, const char *name, const char *labels, const Histogram *h,
+                     const char *eol) {
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    const char *comma = labels[0] == '\0' ? "" : ",";
+    for (int i = 0; i < 4; i++) {
+        fprintf(out, "%s{%s%squantile=\"%s\"} %.9f%s", name, labels, comma, quantiles[i],
+                histogram_quantile(h, fractions[i]) / 1e9, eol);
+    }
+    if (labels[0] == '\0') {
+        fprintf(out, "%s_sum %.9f%s%s_count %lu%s", name, h->sum / 1e9, eol, name, h->count, eol);
+    } else {
+        fprintf(out, "%s_sum{%s} %.9f%s%s_count{%s} %lu%s", name, labels, h->sum / 1e9, eol,
+                name, labels, h->count, eol);
+    }
+}
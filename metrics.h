@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+// A histogram splits each power of two into 2^HISTOGRAM_SUB_BITS buckets,
+// so a recorded value is off by at most 1 / 2^HISTOGRAM_SUB_BITS (6%).
+// Values of 2^(HISTOGRAM_MAX_EXPONENT + 1) and more share the last bucket.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS)
+
+/*
+ * A log-linear histogram of non-negative integer values (in the manner of
+ * HdrHistogram): recording is a shift and an increment, with no search
+ * and no allocation, and quantiles are computed from the buckets when they
+ * are reported. Not thread-safe; each thread records into its own.
+ */
+typedef struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long count;        // values recorded
+    unsigned long sum;          // of the values recorded
+} Histogram;
+
+
+/*
+ * Return the monotonic time in nanoseconds, for timing what is recorded.
+ */
+unsigned long metrics_now();
+
+
+/*
+ * Record value in h.
+ */
+void histogram_record(Histogram *h, unsigned long value);
+
+
+/*
+ * Return the value below which a fraction q of the values recorded in h
+ * fall, to the precision of its buckets, or 0 if h is empty.
+ */
+unsigned long histogram_quantile(const Histogram *h, double q);
+
+
+/*
+ * Write the HELP and TYPE lines of a metric in the Prometheus text format,
+ * ending each line with eol.
+ */
+void metrics_describe(FILE *out, const char *name, const char *type, const char *help,
+                      const char *eol);
+
+
+/*
+ * Write a sample of a metric, with labels (such as `shard="0"`) in braces
+ * unless they are empty.
+ */
+void metrics_sample(FILE *out, const char *name, const char *labels, double value,
+                    const char *eol);
+
+
+/*
+ * Write the samples of a summary of the nanosecond values in h, in
+ * seconds: the 0.5, 0.9, 0.99 and 0.999 quantiles, the sum and the count.
+ */
+void metrics_summary(FILE *out, const char *name, const char *labels, const Histogram *h,
+                     const char *eol);
+
+#endif
@@ -0,0 +1,568 @@
+#include "search.h"
+#include "epoch.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define VARINT_MAX_BYTES 5      // Bytes of the longest encoded unsigned int
+
+/*
+ * A position in a posting list during a query, moving from the highest id
+ * down, with the ids of the block it is in decoded.
+ */
+typedef struct posting_cursor {
+    PostingBlock *const *blocks;
+    int num_blocks;
+    int block;                  // index of the decoded block, -1 if none
+    int count;                  // ids decoded from it
+    unsigned int ids[POSTING_BLOCK_BYTES + 1];
+} PostingCursor;
+
+
+/*
+ * A posting list replaced or removed by search_index_prune, with how many
+ * of its blocks, from the first, were dropped along with it.
+ */
+typedef struct pruned_list {
+    PostingList *list;
+    int num_dropped;
+} PrunedList;
+
+
+// marks the dictionary slot of a pruned term, which lookups probe past
+static PostingList tombstone;
+
+
+/*
+ * Return a new, empty dictionary with the given number of slots.
+ */
+static TermIndex *new_term_index(unsigned int capacity) {
+    TermIndex *terms = calloc(1, sizeof(TermIndex) + capacity * sizeof(PostingList *));
+    if (terms == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    terms->capacity = capacity;
+    return terms;
+}
+
+
+/*
+ * Initialize an empty index.
+ */
+void init_search_index(SearchIndex *index) {
+    index->terms = new_term_index(TERM_INDEX_INITIAL_CAPACITY);
+    index->num_terms = 0;
+    index->num_tombstones = 0;
+    index->postings = 0;
+    index->bytes = sizeof(TermIndex) + TERM_INDEX_INITIAL_CAPACITY * sizeof(PostingList *);
+    index->prune_next = TERM_INDEX_INITIAL_CAPACITY;
+    index->prune_floor = 0;
+}
+
+
+/*
+ * Return whether c is part of a word.
+ */
+static int is_term_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c >= 0x80;
+}
+
+
+/*
+ * Store in term the next word of the text at *text, lowercased and
+ * truncated to SEARCH_MAX_TERM - 1 characters, and advance *text past it.
+ * Return 0 if there are no words left, 1 otherwise.
+ */
+int next_term(const char **text, char *term) {
+    const unsigned char *p = (const unsigned char *)*text;
+    while (*p != '\0' && !is_term_char(*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        *text = (const char *)p;
+        return 0;
+    }
+
+    int len = 0;
+    while (is_term_char(*p)) {
+        if (len < SEARCH_MAX_TERM - 1) {
+            term[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+        }
+        p++;
+    }
+    term[len] = '\0';
+    *text = (const char *)p;
+    return 1;
+}
+
+
+/*
+ * Return the hash of a term (32-bit FNV-1a).
+ */
+static unsigned int hash_term(const char *term) {
+    unsigned int hash = 2166136261u;
+    while (*term != '\0') {
+        hash ^= (unsigned char)*term++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Return the index of the slot holding term, which has this hash, or of
+ * the empty slot where it would be inserted.
+ */
+static unsigned int find_term_slot(const TermIndex *terms, const char *term, unsigned int hash) {
+    unsigned int mask = terms->capacity - 1;
+    unsigned int i = hash & mask;
+    PostingList *list;
+    while ((list = __atomic_load_n(&terms->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (list != &tombstone && list->hash == hash && strcmp(list->term, term) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+
+/*
+ * Return the number of slots of a dictionary for num_terms terms: a power
+ * of two, at least twice num_terms.
+ */
+static unsigned int term_index_capacity(unsigned int num_terms) {
+    unsigned int capacity = TERM_INDEX_INITIAL_CAPACITY;
+    while (capacity < num_terms * 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+
+/*
+ * Replace the index's dictionary with one of capacity slots, leaving the
+ * tombstones behind. Readers may still be searching the old one, so it is
+ * retired rather than freed. A pass of search_index_prune under way starts
+ * over, since the terms have moved.
+ */
+static void resize_term_index(SearchIndex *index, unsigned int capacity) {
+    TermIndex *old_terms = index->terms;
+    TermIndex *terms = new_term_index(capacity);
+    unsigned int mask = terms->capacity - 1;
+
+    for (unsigned int i = 0; i < old_terms->capacity; i++) {
+        if (old_terms->slots[i] != NULL && old_terms->slots[i] != &tombstone) {
+            unsigned int j = old_terms->slots[i]->hash & mask;
+            while (terms->slots[j] != NULL) {
+                j = (j + 1) & mask;
+            }
+            terms->slots[j] = old_terms->slots[i];
+        }
+    }
+    __atomic_store_n(&index->terms, terms, __ATOMIC_RELEASE);
+    index->num_tombstones = 0;
+    index->prune_next = index->prune_next < old_terms->capacity ? 0 : capacity;
+    index->bytes -= old_terms->capacity * sizeof(PostingList *);
+    index->bytes += capacity * sizeof(PostingList *);
+    epoch_retire(old_terms, free);
+}
+
+
+/*
+ * Return the posting list of term, adding an empty one if there is none.
+ */
+static PostingList *add_term(SearchIndex *index, const char *term) {
+    unsigned int hash = hash_term(term);
+    unsigned int slot = find_term_slot(index->terms, term, hash);
+    if (index->terms->slots[slot] != NULL) {
+        return index->terms->slots[slot];
+    }
+
+    PostingList *list = malloc(sizeof(PostingList));
+    if (list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    strcpy(list->term, term);
+    list->hash = hash;
+    list->count = 0;
+    list->blocks = NULL;
+    list->num_blocks = 0;
+    list->blocks_capacity = 0;
+    __atomic_store_n(&index->terms->slots[slot], list, __ATOMIC_RELEASE);
+    index->num_terms++;
+    index->bytes += sizeof(PostingList);
+
+    // keep the load factor, tombstones included, at or below 3/4
+    if ((index->num_terms + index->num_tombstones) * 4 > index->terms->capacity * 3) {
+        resize_term_index(index, term_index_capacity(index->num_terms));
+    }
+    return list;
+}
+
+
+/*
+ * Add block to the end of list, growing its array of blocks as needed.
+ */
+static void push_posting_block(SearchIndex *index, PostingList *list, PostingBlock *block) {
+    if (list->num_blocks == list->blocks_capacity) {
+        int capacity = list->blocks_capacity == 0 ? 4 : list->blocks_capacity * 2;
+        PostingBlock **blocks = malloc(capacity * sizeof(PostingBlock *));
+        if (blocks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (list->num_blocks > 0) {
+            memcpy(blocks, list->blocks, list->num_blocks * sizeof(PostingBlock *));
+        }
+        PostingBlock **old_blocks = list->blocks;
+        __atomic_store_n(&list->blocks, blocks, __ATOMIC_RELEASE);
+        epoch_retire(old_blocks, free);
+        index->bytes += (capacity - list->blocks_capacity) * sizeof(PostingBlock *);
+        list->blocks_capacity = capacity;
+    }
+    list->blocks[list->num_blocks] = block;
+    __atomic_store_n(&list->num_blocks, list->num_blocks + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Add a block holding only id to the end of list.
+ */
+static void add_posting_block(SearchIndex *index, PostingList *list, unsigned int id) {
+    PostingBlock *block = malloc(sizeof(PostingBlock));
+    if (block == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    block->first = id;
+    block->last = id;
+    block->count = 1;
+    block->len = 0;
+    index->bytes += sizeof(PostingBlock);
+    push_posting_block(index, list, block);
+}
+
+
+/*
+ * Append id, which is not lower than any id in list, to list.
+ */
+static void append_posting(SearchIndex *index, PostingList *list, unsigned int id) {
+    PostingBlock *block = list->num_blocks > 0 ? list->blocks[list->num_blocks - 1] : NULL;
+    if (block != NULL && block->last == id) {
+        // the word was used more than once in the document
+        return;
+    }
+
+    if (block == NULL || POSTING_BLOCK_BYTES - block->len < VARINT_MAX_BYTES) {
+        add_posting_block(index, list, id);
+    } else {
+        unsigned int delta = id - block->last;
+        while (delta >= 0x80) {
+            block->deltas[block->len++] = (delta & 0x7f) | 0x80;
+            delta >>= 7;
+        }
+        block->deltas[block->len++] = delta;
+        __atomic_store_n(&block->last, id, __ATOMIC_RELAXED);
+        // publishes the bytes of the delta
+        __atomic_store_n(&block->count, block->count + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELAXED);
+    index->postings++;
+}
+
+
+/*
+ * Add document id, which must be higher than any added before, to the
+ * posting list of every word of text.
+ */
+void search_index_add(SearchIndex *index, unsigned int id, const char *text) {
+    char term[SEARCH_MAX_TERM];
+    while (next_term(&text, term)) {
+        append_posting(index, add_term(index, term), id);
+    }
+}
+
+
+/*
+ * Return the posting list of term, or NULL if no document uses it.
+ */
+static const PostingList *find_term(const SearchIndex *index, const char *term) {
+    const TermIndex *terms = __atomic_load_n(&index->terms, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&terms->slots[find_term_slot(terms, term, hash_term(term))],
+                           __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Start a cursor above the highest id of list.
+ */
+static void start_cursor(PostingCursor *cursor, const PostingList *list) {
+    cursor->num_blocks = __atomic_load_n(&list->num_blocks, __ATOMIC_ACQUIRE);
+    cursor->blocks = __atomic_load_n(&list->blocks, __ATOMIC_ACQUIRE);
+    cursor->block = -1;
+    cursor->count = 0;
+}
+
+
+/*
+ * Decode the ids of block b into the cursor.
+ */
+static void decode_block(PostingCursor *cursor, int b) {
+    const PostingBlock *block = cursor->blocks[b];
+    int count = __atomic_load_n(&block->count, __ATOMIC_ACQUIRE);
+    const unsigned char *p = block->deltas;
+    unsigned int id = block->first;
+    cursor->ids[0] = id;
+    for (int i = 1; i < count; i++) {
+        unsigned int delta = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            delta |= (unsigned int)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (unsigned int)*p++ << shift;
+        id += delta;
+        cursor->ids[i] = id;
+    }
+    cursor->block = b;
+    cursor->count = count;
+}
+
+
+/*
+ * Store in *id the highest id in the cursor's list that is not above
+ * target, which must not be above any target the cursor was moved to
+ * before. Return 0 if there is none, 1 otherwise.
+ */
+static int seek_at_most(PostingCursor *cursor, unsigned int target, unsigned int *id) {
+    // find the last block starting at or below target, galloping down from
+    // the current one: blocks[below] starts at or below target (-1 if no
+    // block does), blocks[above] above it
+    int above = cursor->block == -1 ? cursor->num_blocks : cursor->block + 1;
+    int below = above - 1;
+    int step = 1;
+    while (below >= 0 && cursor->blocks[below]->first > target) {
+        above = below;
+        below -= step;
+        step *= 2;
+    }
+    if (below < 0) {
+        below = -1;
+    }
+    while (above - below > 1) {
+        int mid = below + (above - below) / 2;
+        if (cursor->blocks[mid]->first <= target) {
+            below = mid;
+        } else {
+            above = mid;
+        }
+    }
+    if (below == -1) {
+        return 0;
+    }
+
+    if (below != cursor->block) {
+        decode_block(cursor, below);
+    }
+    // the block's first id is at or below target, so one is found
+    int lo = 0;
+    int hi = cursor->count;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (cursor->ids[mid] <= target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    *id = cursor->ids[lo];
+    return 1;
+}
+
+
+/*
+ * Store in ids, highest first, up to limit of the highest ids, not below
+ * min_id, of documents that use all num_terms terms and for which
+ * accept(context, id) returns nonzero, and return how many were stored.
+ */
+int search_index_query(const SearchIndex *index, char terms[][SEARCH_MAX_TERM], int num_terms,
+                       unsigned int *ids, int limit, unsigned int min_id,
+                       int (*accept)(void *context, unsigned int id), void *context) {
+    if (num_terms < 1 || num_terms > SEARCH_MAX_QUERY_TERMS) {
+        return 0;
+    }
+
+    // shortest list first, since it rules out the most candidates
+    const PostingList *lists[SEARCH_MAX_QUERY_TERMS];
+    for (int i = 0; i < num_terms; i++) {
+        const PostingList *list = find_term(index, terms[i]);
+        if (list == NULL) {
+            return 0;
+        }
+        int j = i;
+        while (j > 0 && __atomic_load_n(&lists[j - 1]->count, __ATOMIC_RELAXED) >
+                             __atomic_load_n(&list->count, __ATOMIC_RELAXED)) {
+            lists[j] = lists[j - 1];
+            j--;
+        }
+        lists[j] = list;
+    }
+    PostingCursor cursors[SEARCH_MAX_QUERY_TERMS];
+    for (int i = 0; i < num_terms; i++) {
+        start_cursor(&cursors[i], lists[i]);
+    }
+
+    // leapfrog: move each cursor to the candidate in turn, lowering the
+    // candidate whenever a list does not have it, until all agree
+    int found = 0;
+    unsigned int candidate = UINT_MAX;
+    while (found < limit) {
+        int agreed = 0;
+        for (int i = 0; agreed < num_terms; i = (i + 1) % num_terms) {
+            unsigned int id;
+            if (!seek_at_most(&cursors[i], candidate, &id) || id < min_id) {
+                return found;
+            }
+            if (id == candidate) {
+                agreed++;
+            } else {
+                candidate = id;
+                agreed = 1;
+            }
+        }
+        if (accept(context, candidate)) {
+            ids[found++] = candidate;
+        }
+        if (candidate == min_id) {
+            break;
+        }
+        candidate--;
+    }
+    return found;
+}
+
+
+/*
+ * Free a posting list replaced or removed by search_index_prune, with the
+ * blocks dropped from it (an epoch_retire destroy function).
+ */
+static void free_pruned_list(void *ptr) {
+    PrunedList *pruned = ptr;
+    for (int i = 0; i < pruned->num_dropped; i++) {
+        free(pruned->list->blocks[i]);
+    }
+    free(pruned->list->blocks);
+    free(pruned->list);
+    free(pruned);
+}
+
+
+/*
+ * Drop from the posting list in the given slot of the dictionary the ids
+ * below min_id that accept(context, id) rejects. Only the blocks starting
+ * below min_id are looked at, and only if one of their ids is rejected.
+ * Readers may be going through the list, so it is replaced by a copy, the
+ * ids left in those blocks packed into new ones, or by a tombstone if no
+ * ids are left, and retired.
+ */
+static void prune_list(SearchIndex *index, unsigned int slot, unsigned int min_id,
+                       int (*accept)(void *context, unsigned int id), void *context) {
+    PostingList *list = index->terms->slots[slot];
+    PostingCursor cursor;
+    start_cursor(&cursor, list);
+    int dropped = 0;
+    unsigned int dropped_ids = 0;
+    unsigned int kept_ids = 0;
+    while (dropped < list->num_blocks && list->blocks[dropped]->first < min_id) {
+        decode_block(&cursor, dropped);
+        for (int i = 0; i < cursor.count; i++) {
+            kept_ids += cursor.ids[i] >= min_id || accept(context, cursor.ids[i]);
+        }
+        dropped_ids += cursor.count;
+        dropped++;
+    }
+    if (kept_ids == dropped_ids) {
+        return;
+    }
+
+    PrunedList *pruned = malloc(sizeof(PrunedList));
+    if (pruned == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pruned->list = list;
+    pruned->num_dropped = dropped;
+    index->postings -= dropped_ids;
+    index->bytes -= dropped * sizeof(PostingBlock) + list->blocks_capacity * sizeof(PostingBlock *);
+
+    if (kept_ids == 0 && dropped == list->num_blocks) {
+        __atomic_store_n(&index->terms->slots[slot], &tombstone, __ATOMIC_RELEASE);
+        index->num_terms--;
+        index->num_tombstones++;
+        index->bytes -= sizeof(PostingList);
+    } else {
+        PostingList *rest = malloc(sizeof(PostingList));
+        if (rest == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        strcpy(rest->term, list->term);
+        rest->hash = list->hash;
+        rest->count = 0;
+        rest->blocks = NULL;
+        rest->num_blocks = 0;
+        rest->blocks_capacity = 0;
+        for (int b = 0; b < dropped; b++) {
+            decode_block(&cursor, b);
+            for (int i = 0; i < cursor.count; i++) {
+                if (cursor.ids[i] >= min_id || accept(context, cursor.ids[i])) {
+                    append_posting(index, rest, cursor.ids[i]);
+                }
+            }
+        }
+        for (int b = dropped; b < list->num_blocks; b++) {
+            push_posting_block(index, rest, list->blocks[b]);
+            rest->count += list->blocks[b]->count;
+        }
+        __atomic_store_n(&index->terms->slots[slot], rest, __ATOMIC_RELEASE);
+    }
+    epoch_retire(pruned, free_pruned_list);
+}
+
+
+/*
+ * Do up to budget steps, each looking at one slot of the dictionary, of a
+ * pass dropping the ids below min_id that accept(context, id) rejects, and
+ * the terms left with none. Return the steps left of the budget.
+ */
+int search_index_prune(SearchIndex *index, unsigned int min_id,
+                       int (*accept)(void *context, unsigned int id), void *context,
+                       int budget) {
+    if (index->prune_next == index->terms->capacity) {
+        if (min_id <= index->prune_floor) {
+            return budget;
+        }
+        index->prune_next = 0;
+    }
+    index->prune_floor = min_id;
+
+    while (budget > 0 && index->prune_next < index->terms->capacity) {
+        PostingList *list = index->terms->slots[index->prune_next];
+        if (list != NULL && list != &tombstone) {
+            prune_list(index, index->prune_next, min_id, accept, context);
+        }
+        index->prune_next++;
+        budget--;
+    }
+    if (index->prune_next == index->terms->capacity &&
+            term_index_capacity(index->num_terms) < index->terms->capacity) {
+        // few terms are left: move them to a smaller dictionary
+        resize_term_index(index, term_index_capacity(index->num_terms));
+    }
+    return budget;
+}
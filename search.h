@@ -0,0 +1,120 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#define SEARCH_MAX_TERM 32          // Longer words are indexed by their first
+                                    // SEARCH_MAX_TERM - 1 characters
+#define SEARCH_MAX_QUERY_TERMS 8    // Words a query may have
+#define POSTING_BLOCK_BYTES 112     // Bytes of compressed ids in a posting block
+#define TERM_INDEX_INITIAL_CAPACITY 64  // Initial number of term slots
+
+/*
+ * A block of a posting list: ascending ids, the first stored as is and each
+ * of the others as the varint-encoded difference from the one before, so
+ * the ids of a common word take a byte or two each. The owner appends to
+ * the last block in place; a reader decodes only the first count ids.
+ */
+typedef struct posting_block {
+    unsigned int first;
+    unsigned int last;          // may be ahead of count for a reader
+    int count;                  // ids in the block
+    int len;                    // bytes of deltas in use
+    unsigned char deltas[POSTING_BLOCK_BYTES];
+} PostingBlock;
+
+/*
+ * The ids of the documents using a term, in ascending order. The array of
+ * blocks is replaced as a whole when it grows, so readers load num_blocks
+ * before blocks. When blocks are pruned off its front, the whole list is
+ * replaced by a copy holding the rest.
+ */
+typedef struct posting_list {
+    char term[SEARCH_MAX_TERM];
+    unsigned int hash;
+    unsigned int count;         // ids in the list
+    PostingBlock **blocks;
+    int num_blocks;
+    int blocks_capacity;
+} PostingList;
+
+/*
+ * The dictionary of a SearchIndex, an open-addressing hash table with
+ * linear probing. It is replaced as a whole when it grows, or shrinks
+ * after pruning.
+ */
+typedef struct term_index {
+    unsigned int capacity;      // number of slots, always a power of two
+    PostingList *slots[];       // NULL marks an empty slot, and a tombstone
+                                // one whose term was pruned
+} TermIndex;
+
+/*
+ * An inverted index from words to the ids of the documents using them.
+ * Ids are added in ascending order, so the highest ids are the newest
+ * documents. Only its owner adds to it, but reader threads may query it
+ * at the same time (see epoch.h); what the owner replaces is retired.
+ */
+typedef struct search_index {
+    TermIndex *terms;
+    unsigned int num_terms;
+    unsigned int num_tombstones;
+    unsigned long postings;     // ids in all the posting lists
+    unsigned long bytes;        // memory taken by the lists and dictionary
+    // the pass of search_index_prune under way: the next slot it looks at,
+    // terms->capacity if none, and the lowest id it keeps
+    unsigned int prune_next;
+    unsigned int prune_floor;
+} SearchIndex;
+
+
+/*
+ * Initialize an empty index.
+ */
+void init_search_index(SearchIndex *index);
+
+
+/*
+ * Store in term the next word of the text at *text, lowercased and
+ * truncated to SEARCH_MAX_TERM - 1 characters, and advance *text past it.
+ * Words are runs of letters, digits and non-ASCII bytes.
+ * Return 0 if there are no words left, 1 otherwise.
+ */
+int next_term(const char **text, char *term);
+
+
+/*
+ * Add document id, which must be higher than any added before, to the
+ * posting list of every word of text.
+ */
+void search_index_add(SearchIndex *index, unsigned int id, const char *text);
+
+
+/*
+ * Store in ids, highest first, up to limit of the highest ids, not below
+ * min_id, of documents that use all num_terms terms and for which
+ * accept(context, id) returns nonzero, and return how many were stored.
+ * The posting lists are intersected newest first from the shortest,
+ * skipping whole blocks and galloping over the block index of the others,
+ * so the cost depends on how far back the matches are rather than on how
+ * long the lists are. May be called from reader threads, inside their
+ * epoch.
+ */
+int search_index_query(const SearchIndex *index, char terms[][SEARCH_MAX_TERM], int num_terms,
+                       unsigned int *ids, int limit, unsigned int min_id,
+                       int (*accept)(void *context, unsigned int id), void *context);
+
+
+/*
+ * Do up to budget steps, each looking at one slot of the dictionary, of a
+ * pass dropping the ids below min_id that accept(context, id) rejects, and
+ * the terms left with none. Only the posting blocks starting below min_id
+ * are looked at, and the ids they keep are packed into new blocks. A pass
+ * starts once min_id is above the one the last pass used, and goes over
+ * every term; the dictionary shrinks at its end if few terms are left.
+ * What readers may hold is retired.
+ * Return the steps left of the budget.
+ */
+int search_index_prune(SearchIndex *index, unsigned int min_id,
+                       int (*accept)(void *context, unsigned int id), void *context,
+                       int budget);
+
+#endif
@@ -0,0 +1,274 @@
+#include "snapshot.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_WRITE_BUFFER (1 << 20)
+
+
+/*
+ * Round size up to a multiple of 8.
+ */
+static size_t pad8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+
+/*
+ * Write table to a snapshot at path, covering the log generations before
+ * wal_generation. The snapshot is written to a temporary file, synced and
+ * renamed over path, so path always holds a complete snapshot.
+ * Return -1 on failure (with errno set), 0 otherwise.
+ */
+int snapshot_write(const char *path, const UserTable *table, unsigned long wal_generation) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, SNAPSHOT_MAGIC);
+    header.wal_generation = wal_generation;
+    header.id_offset = table->id_offset;
+    header.id_stride = table->id_stride;
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        header.num_users++;
+        header.num_friend_ids += user->num_friends;
+        header.num_posts += user->num_posts;
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            header.contents_size += strlen(post->contents) + 1;
+        }
+    }
+
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    SnapshotUser snap_user;
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        memset(&snap_user, 0, sizeof(snap_user));
+        strcpy(snap_user.name, user->name);
+        snap_user.num_friends = user->num_friends;
+        snap_user.num_posts = user->num_posts;
+        fwrite(&snap_user, sizeof(snap_user), 1, file);
+    }
+
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        // a user without friends may have no friend_ids array
+        if (user->num_friends > 0) {
+            fwrite(user->friend_ids, sizeof(unsigned int), user->num_friends, file);
+        }
+    }
+    static const char zeros[8];
+    size_t ids_size = header.num_friend_ids * sizeof(uint32_t);
+    fwrite(zeros, 1, pad8(ids_size) - ids_size, file);
+
+    SnapshotPost snap_post;
+    uint64_t offset = 0;
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            memset(&snap_post, 0, sizeof(snap_post));
+            snap_post.author = post->author->id;
+            snap_post.contents_len = strlen(post->contents);
+            snap_post.date = post->date;
+            snap_post.contents = offset;
+            snap_post.id = post->id;
+            memcpy(snap_post.date_str, post->date_str, POST_DATE_LEN);
+            fwrite(&snap_post, sizeof(snap_post), 1, file);
+            offset += snap_post.contents_len + 1;
+        }
+    }
+
+    for (const User *user = table->head; user != NULL; user = user->next) {
+        for (const Post *post = user->first_post; post != NULL; post = post->next) {
+            fwrite(post->contents, 1, strlen(post->contents) + 1, file);
+        }
+    }
+
+    // fwrite errors are sticky, so checking once after the last write and
+    // flush covers every write
+    if (fflush(file) == EOF || ferror(file) || fsync(fileno(file)) == -1) {
+        int saved_errno = errno;
+        fclose(file);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (fclose(file) == EOF || rename(tmp_path, path) == -1) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Report a snapshot that cannot be loaded and exit: starting without it
+ * would silently lose every change it holds.
+ */
+static void corrupt(const Snapshot *snapshot, const char *reason) {
+    fprintf(stderr, "snapshot %s: %s\n", snapshot->path, reason);
+    exit(1);
+}
+
+
+/*
+ * Map the snapshot at path and check its layout.
+ * Return -1 if there is no snapshot, 0 otherwise.
+ */
+int snapshot_open(const char *path, Snapshot *snapshot) {
+    snapshot->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return -1;
+        }
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(SnapshotHeader)) {
+        corrupt(snapshot, "truncated header");
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        corrupt(snapshot, "bad magic");
+    }
+    // bound each count by the file size before computing the layout, so
+    // the offsets cannot overflow
+    if (header->num_users > size / sizeof(SnapshotUser) ||
+            header->num_friend_ids > size / sizeof(uint32_t) ||
+            header->num_posts > size / sizeof(SnapshotPost) || header->contents_size > size) {
+        corrupt(snapshot, "section sizes do not match the file size");
+    }
+    size_t users_offset = sizeof(SnapshotHeader);
+    size_t ids_offset = users_offset + header->num_users * sizeof(SnapshotUser);
+    size_t posts_offset = ids_offset + pad8(header->num_friend_ids * sizeof(uint32_t));
+    size_t contents_offset = posts_offset + header->num_posts * sizeof(SnapshotPost);
+    if (contents_offset + header->contents_size != size) {
+        corrupt(snapshot, "section sizes do not match the file size");
+    }
+
+    snapshot->header = header;
+    snapshot->users = (const SnapshotUser *)(map + users_offset);
+    snapshot->friend_ids = (const uint32_t *)(map + ids_offset);
+    snapshot->posts = (const SnapshotPost *)(map + posts_offset);
+    snapshot->contents = map + contents_offset;
+    return 0;
+}
+
+
+/*
+ * Create the snapshot's users in table, which must be empty and have the
+ * id offset and stride the snapshot was written with (so every user gets
+ * back the id that friendships and posts refer to it by).
+ * Return the number of users created.
+ */
+long snapshot_load_users(const Snapshot *snapshot, UserTable *table) {
+    const SnapshotHeader *header = snapshot->header;
+    if (header->id_offset != table->id_offset || header->id_stride != table->id_stride) {
+        corrupt(snapshot, "written for a different number of shards");
+    }
+    for (uint64_t i = 0; i < header->num_users; i++) {
+        if (snapshot->users[i].name[MAX_NAME - 1] != '\0' ||
+                create_user(snapshot->users[i].name, table) != 0) {
+            corrupt(snapshot, "bad or duplicate user name");
+        }
+    }
+    return header->num_users;
+}
+
+
+/*
+ * Give the users created by snapshot_load_users their friends and posts,
+ * and index the posts for search. users_by_id maps each of the num_ids
+ * ids in use, in any table, to its user (NULL for unused ids).
+ */
+void snapshot_load_links(const Snapshot *snapshot, UserTable *table, User **users_by_id,
+                         unsigned long num_ids) {
+    const SnapshotHeader *header = snapshot->header;
+    uint64_t next_id = 0;
+    uint64_t next_post = 0;
+    User *user = table->head;
+    for (uint64_t i = 0; i < header->num_users; i++, user = user->next) {
+        int num_friends = snapshot->users[i].num_friends;
+        int num_posts = snapshot->users[i].num_posts;
+        if (next_id + num_friends > header->num_friend_ids ||
+                next_post + num_posts > header->num_posts) {
+            corrupt(snapshot, "user counts do not match the section sizes");
+        }
+
+        if (num_friends > 0) {
+            user->friends = malloc(num_friends * sizeof(User *));
+            user->friend_ids = malloc(num_friends * sizeof(unsigned int));
+            if (user->friends == NULL || user->friend_ids == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            for (int j = 0; j < num_friends; j++) {
+                uint32_t id = snapshot->friend_ids[next_id++];
+                if (id >= num_ids || users_by_id[id] == NULL) {
+                    corrupt(snapshot, "friend id out of range");
+                }
+                user->friends[j] = users_by_id[id];
+                user->friend_ids[j] = id;
+            }
+            user->num_friends = num_friends;
+            user->friends_capacity = num_friends;
+        }
+
+        Post **link = &user->first_post;
+        Post *newer = NULL;
+        for (int j = 0; j < num_posts; j++) {
+            const SnapshotPost *snap_post = &snapshot->posts[next_post++];
+            if (snap_post->author >= num_ids || users_by_id[snap_post->author] == NULL ||
+                    snap_post->contents >= header->contents_size ||
+                    header->contents_size - snap_post->contents <= snap_post->contents_len ||
+                    snapshot->contents[snap_post->contents + snap_post->contents_len] != '\0') {
+                corrupt(snapshot, "post out of range");
+            }
+            Post *post = pool_alloc(&table->post_pool);
+            post->author = users_by_id[snap_post->author];
+            post->target = user;
+            post->contents = snapshot->contents + snap_post->contents;
+            post->date = snap_post->date;
+            post->id = snap_post->id;
+            memcpy(post->date_str, snap_post->date_str, POST_DATE_LEN);
+            post->date_str[POST_DATE_LEN - 1] = '\0';
+            post->newer = newer;
+            newer = post;
+            *link = post;
+            link = &post->next;
+        }
+        *link = NULL;
+        user->last_post = newer;
+        user->num_posts = num_posts;
+    }
+    if (next_id != header->num_friend_ids || next_post != header->num_posts) {
+        corrupt(snapshot, "user counts do not match the section sizes");
+    }
+    index_posts(table);
+}
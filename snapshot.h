@@ -0,0 +1,99 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "friends.h"
+
+#define SNAPSHOT_DEFAULT_PATH "friend_server.snap"
+#define SNAPSHOT_DEFAULT_INTERVAL 300  // Seconds between background snapshots
+#define SNAPSHOT_MAGIC "FSNAP03"
+
+/*
+ * A snapshot is a single file holding a UserTable in a flat binary form
+ * that can be mapped and loaded without parsing:
+ *
+ *   header
+ *   users       num_users SnapshotUser's, in creation order (so a user's
+ *               id is id_offset + id_stride * its index)
+ *   friend ids  each user's friend ids in turn, sorted as in User
+ *   posts       each user's posts in turn, newest first
+ *   contents    the null-terminated contents of every post
+ *
+ * Sections start at multiples of 8 bytes.
+ */
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t wal_generation;     // first log generation not in the snapshot
+    uint64_t num_users;
+    uint64_t num_friend_ids;
+    uint64_t num_posts;
+    uint64_t contents_size;
+    uint32_t id_offset;          // of the table written
+    uint32_t id_stride;
+} SnapshotHeader;
+
+typedef struct snapshot_user {
+    char name[MAX_NAME];
+    uint32_t num_friends;
+    uint32_t num_posts;
+} SnapshotUser;
+
+typedef struct snapshot_post {
+    uint32_t author;             // id of the author, possibly in another table
+    uint32_t contents_len;
+    int64_t date;
+    uint64_t contents;           // offset into the contents section
+    uint32_t id;                 // orders the table's posts for search
+    char date_str[POST_DATE_LEN];
+} SnapshotPost;
+
+
+/*
+ * Write table to a snapshot at path, covering the log generations before
+ * wal_generation. The snapshot is written to a temporary file, synced and
+ * renamed over path, so path always holds a complete snapshot.
+ * Return -1 on failure (with errno set), 0 otherwise.
+ */
+int snapshot_write(const char *path, const UserTable *table, unsigned long wal_generation);
+
+
+/*
+ * A snapshot mapped for loading. The mapping is never unmapped: post
+ * contents are not copied but point into it.
+ */
+typedef struct snapshot {
+    const char *path;
+    const SnapshotHeader *header;
+    const SnapshotUser *users;
+    const uint32_t *friend_ids;
+    const SnapshotPost *posts;
+    char *contents;
+} Snapshot;
+
+
+/*
+ * Map the snapshot at path and check its layout.
+ * Return -1 if there is no snapshot, 0 otherwise.
+ */
+int snapshot_open(const char *path, Snapshot *snapshot);
+
+
+/*
+ * Create the snapshot's users in table, which must be empty and have the
+ * id offset and stride the snapshot was written with (so every user gets
+ * back the id that friendships and posts refer to it by).
+ * Return the number of users created.
+ */
+long snapshot_load_users(const Snapshot *snapshot, UserTable *table);
+
+
+/*
+ * Give the users created by snapshot_load_users their friends and posts,
+ * and index the posts for search. users_by_id maps each of the num_ids
+ * ids in use, in any table, to its user (NULL for unused ids).
+ */
+void snapshot_load_links(const Snapshot *snapshot, UserTable *table, User **users_by_id,
+                         unsigned long num_ids);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Test of retention by count alone (-K without -E).
+ *
+ * Keeps one old post live on carol's profile while alice makes 20000
+ * posts to bob, who keeps only the 2 newest, sweeping as the server does.
+ * Checks that posts_by_id and the search index stay about the size of the
+ * live posts rather than growing with every post made, and that searches
+ * still find the old post and the newest ones. Exits with 1 on failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../friends.h"
+
+#define NUM_POSTS 20000
+#define MAX_POSTS 2
+#define SWEEP_EVERY 100     // posts between sweeps
+#define MAX_INDEX_IDS 1024  // most ids posts_by_id and the postings may hold
+
+
+int failures = 0;
+
+
+/*
+ * Report a failed check.
+ */
+void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+
+/*
+ * Sweep table until the work of retention is done.
+ */
+void sweep(UserTable *table) {
+    while (expire_posts(table, time(NULL), 1000)) {
+    }
+}
+
+
+/*
+ * Return how many posts of table contain word.
+ */
+int count_hits(UserTable *table, const char *word) {
+    char terms[1][SEARCH_MAX_TERM];
+    strcpy(terms[0], word);
+    const Post *hits[NUM_POSTS];
+    return search_posts(table, terms, 1, hits, NUM_POSTS);
+}
+
+
+int main() {
+    UserTable table;
+    init_user_table(&table);
+    table.max_posts = MAX_POSTS;
+    create_user("alice", &table);
+    create_user("bob", &table);
+    create_user("carol", &table);
+    make_friends("alice", "bob", &table);
+    make_friends("alice", "carol", &table);
+    User *alice = find_user("alice", &table);
+    User *bob = find_user("bob", &table);
+    User *carol = find_user("carol", &table);
+
+    make_post(alice, carol, "an old post that stays", &table);
+    for (int i = 0; i < NUM_POSTS; i++) {
+        char contents[64];
+        snprintf(contents, sizeof(contents), "post %d to bob", i);
+        make_post(alice, bob, contents, &table);
+        if (i % SWEEP_EVERY == 0) {
+            sweep(&table);
+        }
+    }
+    // one sweep moves posts_by_id up, the next prunes the search index
+    sweep(&table);
+    sweep(&table);
+
+    check(table.live_posts == MAX_POSTS + 1, "live_posts is the posts kept");
+    check(table.posts_expired == NUM_POSTS - MAX_POSTS, "posts_expired counts the others");
+    check(table.num_post_ids - table.posts_by_id->base <= MAX_INDEX_IDS,
+          "posts_by_id holds few ids above its base");
+    check(table.posts_by_id->num_kept <= MAX_POSTS + 1, "posts_by_id keeps only live posts");
+    check(table.search.postings <= MAX_INDEX_IDS * 4, "search postings are bounded");
+    check(count_hits(&table, "old") == 1, "the old post is found");
+    check(count_hits(&table, "bob") == MAX_POSTS, "only the live posts to bob are found");
+    check(find_post(&table, 0) != NULL && strcmp(find_post(&table, 0)->contents,
+                                                 "an old post that stays") == 0,
+          "the old post is found by id");
+    check(find_post(&table, 1) == NULL, "an expired post is not found by id");
+
+    printf("posts_by_id: base %u, capacity %u, kept %u; postings %lu, index bytes %lu\n",
+           table.posts_by_id->base, table.posts_by_id->capacity, table.posts_by_id->num_kept,
+           table.search.postings, table.search.bytes);
+    if (failures > 0) {
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,565 @@
+#include "wal.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORD_HEADER_SIZE 8  // payload length and CRC-32
+
+// Record types, the first byte of every payload
+#define RECORD_USER 1       // name
+#define RECORD_FRIENDS 2    // name1, name2
+#define RECORD_POST 3       // author, target, date, contents
+#define RECORD_GENERATION 4 // generation, the first record of a log
+#define RECORD_FRIEND 5     // name, friend name: one half of a friendship
+
+
+/*
+ * Return the monotonic time in seconds.
+ */
+static double monotonic_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Fill in crc_table, once per process (every server thread logs).
+ */
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+
+/*
+ * Return the CRC-32 (IEEE 802.3) of the len bytes at data.
+ */
+static uint32_t crc32(const unsigned char *data, size_t len) {
+    pthread_once(&crc_table_once, init_crc_table);
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+
+static void put_u32(Wal *wal, uint32_t value);
+static size_t begin_record(Wal *wal, unsigned char type);
+static void end_record(Wal *wal, size_t start);
+static void sync_log(Wal *wal);
+
+
+/*
+ * Open (creating if needed) the log at wal->path. A new log is started
+ * with a record of wal->generation, synced so that the log is never found
+ * without one.
+ */
+static void open_log(Wal *wal) {
+    wal->fd = open(wal->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (wal->fd == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(wal->fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        size_t start = begin_record(wal, RECORD_GENERATION);
+        put_u32(wal, wal->generation & 0xFFFFFFFFu);
+        put_u32(wal, (uint64_t)wal->generation >> 32);
+        end_record(wal, start);
+        wal->records--;
+        wal_commit(wal);
+        sync_log(wal);
+    }
+}
+
+
+/*
+ * Open (creating if needed) the log at path for appending. A new log is
+ * started at the given generation; an existing one keeps its own.
+ */
+void wal_open(Wal *wal, const char *path, unsigned long generation, int sync_policy,
+              int sync_interval) {
+    wal->path = path;
+    wal->generation = generation;
+    wal->sync_policy = sync_policy;
+    wal->sync_interval = sync_interval;
+    wal->capacity = WAL_BUFFER_SIZE;
+    wal->len = 0;
+    wal->buf = malloc(wal->capacity);
+    if (wal->buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    wal->unsynced = 0;
+    wal->last_sync = monotonic_now();
+    wal->records = 0;
+    wal->commits = 0;
+    wal->syncs = 0;
+    wal->bytes = 0;
+    open_log(wal);
+}
+
+
+/*
+ * Write the path of the log segment of the given generation into buf.
+ */
+void wal_segment_path(char *buf, size_t size, const char *path, unsigned long generation) {
+    snprintf(buf, size, "%s.%lu", path, generation);
+}
+
+
+/*
+ * Commit and sync the log, rename it to its segment path and start a new
+ * log of the next generation in its place.
+ */
+void wal_rotate(Wal *wal) {
+    wal_commit(wal);
+    sync_log(wal);
+    if (close(wal->fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+
+    char segment[WAL_MAX_PATH];
+    wal_segment_path(segment, sizeof(segment), wal->path, wal->generation);
+    if (rename(wal->path, segment) == -1) {
+        perror("rename");
+        exit(1);
+    }
+    wal->generation++;
+    open_log(wal);
+}
+
+
+/*
+ * Make room for len more bytes in the commit buffer.
+ */
+static void reserve(Wal *wal, size_t len) {
+    if (wal->len + len > wal->capacity) {
+        while (wal->len + len > wal->capacity) {
+            wal->capacity *= 2;
+        }
+        wal->buf = realloc(wal->buf, wal->capacity);
+        if (wal->buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+}
+
+
+/*
+ * Append a 32-bit little-endian integer to the commit buffer.
+ */
+static void put_u32(Wal *wal, uint32_t value) {
+    reserve(wal, 4);
+    unsigned char *out = (unsigned char *)wal->buf + wal->len;
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (8 * i);
+    }
+    wal->len += 4;
+}
+
+
+/*
+ * Append a length-prefixed string to the commit buffer.
+ */
+static void put_string(Wal *wal, const char *str) {
+    uint32_t len = strlen(str);
+    put_u32(wal, len);
+    reserve(wal, len);
+    memcpy(wal->buf + wal->len, str, len);
+    wal->len += len;
+}
+
+
+/*
+ * Start a record of the given type. Return the offset of its header, to
+ * be passed to end_record once the fields are appended.
+ */
+static size_t begin_record(Wal *wal, unsigned char type) {
+    size_t start = wal->len;
+    reserve(wal, RECORD_HEADER_SIZE + 1);
+    wal->len += RECORD_HEADER_SIZE;
+    wal->buf[wal->len++] = type;
+    return start;
+}
+
+
+/*
+ * Fill in the length and CRC-32 of the record whose header is at start.
+ */
+static void end_record(Wal *wal, size_t start) {
+    size_t payload_len = wal->len - start - RECORD_HEADER_SIZE;
+    uint32_t crc = crc32((unsigned char *)wal->buf + start + RECORD_HEADER_SIZE, payload_len);
+
+    size_t end = wal->len;
+    wal->len = start;
+    put_u32(wal, payload_len);
+    put_u32(wal, crc);
+    wal->len = end;
+    wal->records++;
+}
+
+
+/*
+ * Append a record of a successful create_user.
+ */
+void wal_log_user(Wal *wal, const char *name) {
+    size_t start = begin_record(wal, RECORD_USER);
+    put_string(wal, name);
+    end_record(wal, start);
+}
+
+
+/*
+ * Append a record of a successful make_friends.
+ */
+void wal_log_friends(Wal *wal, const char *name1, const char *name2) {
+    size_t start = begin_record(wal, RECORD_FRIENDS);
+    put_string(wal, name1);
+    put_string(wal, name2);
+    end_record(wal, start);
+}
+
+
+/*
+ * Append a record of friend_name being added to the friends of name, one
+ * half of a friendship between users owned by different tables.
+ */
+void wal_log_friend(Wal *wal, const char *name, const char *friend_name) {
+    size_t start = begin_record(wal, RECORD_FRIEND);
+    put_string(wal, name);
+    put_string(wal, friend_name);
+    end_record(wal, start);
+}
+
+
+/*
+ * Append a record of a successful make_post.
+ */
+void wal_log_post(Wal *wal, const char *author, const char *target, time_t date,
+                  const char *contents) {
+    size_t start = begin_record(wal, RECORD_POST);
+    put_string(wal, author);
+    put_string(wal, target);
+    uint64_t when = date;
+    put_u32(wal, when & 0xFFFFFFFFu);
+    put_u32(wal, when >> 32);
+    put_string(wal, contents);
+    end_record(wal, start);
+}
+
+
+/*
+ * Return 1 if records have been appended since the last commit.
+ */
+int wal_pending(const Wal *wal) {
+    return wal->len > 0;
+}
+
+
+/*
+ * Sync the log to disk.
+ */
+static void sync_log(Wal *wal) {
+    if (fdatasync(wal->fd) == -1) {
+        perror("fdatasync");
+        exit(1);
+    }
+    wal->unsynced = 0;
+    wal->last_sync = monotonic_now();
+    wal->syncs++;
+}
+
+
+/*
+ * Write every appended record to the log, then sync it if the policy
+ * calls for it.
+ */
+void wal_commit(Wal *wal) {
+    if (wal->len == 0) {
+        return;
+    }
+
+    size_t written = 0;
+    while (written < wal->len) {
+        ssize_t num = write(wal->fd, wal->buf + written, wal->len - written);
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        written += num;
+    }
+    wal->bytes += wal->len;
+    wal->len = 0;
+    wal->commits++;
+    wal->unsynced = 1;
+
+    if (wal->sync_policy == WAL_SYNC_ALWAYS) {
+        sync_log(wal);
+    } else if (wal->sync_policy == WAL_SYNC_INTERVAL) {
+        wal_tick(wal);
+    }
+}
+
+
+/*
+ * Return the number of milliseconds until an interval sync is due, or -1
+ * if none is pending.
+ */
+int wal_sync_timeout(const Wal *wal) {
+    if (wal->sync_policy != WAL_SYNC_INTERVAL || !wal->unsynced) {
+        return -1;
+    }
+    double due = wal->last_sync + wal->sync_interval / 1000.0;
+    double remaining = due - monotonic_now();
+    return remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+}
+
+
+/*
+ * Sync the log if an interval sync is due.
+ */
+void wal_tick(Wal *wal) {
+    if (wal_sync_timeout(wal) == 0) {
+        sync_log(wal);
+    }
+}
+
+
+/*
+ * A cursor over the records of a mapped log.
+ */
+typedef struct reader {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} Reader;
+
+
+/*
+ * Read a 32-bit little-endian integer at the reader's position into
+ * *value. Return -1 if the record is too short, 0 otherwise.
+ */
+static int get_u32(Reader *reader, size_t end, uint32_t *value) {
+    if (end - reader->pos < 4) {
+        return -1;
+    }
+    const unsigned char *in = reader->data + reader->pos;
+    *value = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+    reader->pos += 4;
+    return 0;
+}
+
+
+/*
+ * Copy a length-prefixed string at the reader's position into buf (of
+ * size buf_size, null terminated). Return -1 if the record is too short
+ * or the string does not fit, 0 otherwise.
+ */
+static int get_string(Reader *reader, size_t end, char *buf, size_t buf_size) {
+    uint32_t len;
+    if (get_u32(reader, end, &len) == -1 || end - reader->pos < len || len >= buf_size) {
+        return -1;
+    }
+    memcpy(buf, reader->data + reader->pos, len);
+    buf[len] = '\0';
+    reader->pos += len;
+    return 0;
+}
+
+
+/*
+ * Return the table among num_tables that owns the user called name.
+ */
+static UserTable *owner(const char *name, UserTable *tables, int num_tables) {
+    return &tables[shard_of(hash_name(name), num_tables)];
+}
+
+
+/*
+ * Parse the record whose payload spans [reader->pos, end) and, if it
+ * belongs to this pass, apply it to the tables that own its users. A
+ * generation record's value is stored in *generation in either pass.
+ * contents is scratch space of contents_size bytes for post contents.
+ * Return -1 if the payload is malformed, 1 if the record was applied and
+ * 0 otherwise.
+ */
+static int apply_record(Reader *reader, size_t end, int pass, UserTable *tables, int num_tables,
+                        unsigned long *generation, char *contents, size_t contents_size) {
+    char name1[MAX_NAME];
+    char name2[MAX_NAME];
+    unsigned char type = reader->data[reader->pos++];
+
+    if (type == RECORD_USER) {
+        if (get_string(reader, end, name1, MAX_NAME) == -1) {
+            return -1;
+        }
+        if (pass == WAL_REPLAY_USERS) {
+            create_user(name1, owner(name1, tables, num_tables));
+            return 1;
+        }
+    } else if (type == RECORD_FRIENDS || type == RECORD_FRIEND) {
+        if (get_string(reader, end, name1, MAX_NAME) == -1 ||
+                get_string(reader, end, name2, MAX_NAME) == -1) {
+            return -1;
+        }
+        if (pass == WAL_REPLAY_CHANGES) {
+            User *user1 = find_user(name1, owner(name1, tables, num_tables));
+            User *user2 = find_user(name2, owner(name2, tables, num_tables));
+            // friendships were bound by the friend limit in force at the
+            // time, so none is applied here
+            if (user1 != NULL && user2 != NULL && user1 != user2) {
+                add_friend(user1, user2, 0);
+                if (type == RECORD_FRIENDS) {
+                    add_friend(user2, user1, 0);
+                }
+            }
+            return 1;
+        }
+    } else if (type == RECORD_POST) {
+        uint32_t low, high;
+        if (get_string(reader, end, name1, MAX_NAME) == -1 ||
+                get_string(reader, end, name2, MAX_NAME) == -1 ||
+                get_u32(reader, end, &low) == -1 || get_u32(reader, end, &high) == -1 ||
+                get_string(reader, end, contents, contents_size) == -1) {
+            return -1;
+        }
+        if (pass == WAL_REPLAY_CHANGES) {
+            time_t date = ((uint64_t)high << 32) | low;
+            UserTable *table = owner(name2, tables, num_tables);
+            make_post_at(find_user(name1, owner(name1, tables, num_tables)),
+                         find_user(name2, table), contents, date, table);
+            return 1;
+        }
+    } else if (type == RECORD_GENERATION) {
+        uint32_t low, high;
+        if (get_u32(reader, end, &low) == -1 || get_u32(reader, end, &high) == -1) {
+            return -1;
+        }
+        *generation = ((uint64_t)high << 32) | low;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Apply the records of the given pass in the log at path to the tables
+ * that own their users (tables[shard_of(hash, num_tables)]). In the
+ * WAL_REPLAY_USERS pass, the log is first truncated after its last intact
+ * record. A missing log is treated as empty. If the log records its
+ * generation, *generation is set to it.
+ * Return the number of records applied.
+ */
+long wal_replay(const char *path, int pass, UserTable *tables, int num_tables,
+                unsigned long *generation) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    Reader reader;
+    reader.len = st.st_size;
+    reader.pos = 0;
+    reader.data = mmap(NULL, reader.len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (reader.data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise((void *)reader.data, reader.len, MADV_SEQUENTIAL);
+
+    // post contents are copied out here; a record's contents never exceed
+    // its payload, so the buffer grows to the largest payload seen
+    size_t contents_size = 0;
+    char *contents = NULL;
+
+    long applied = 0;
+    while (reader.len - reader.pos >= RECORD_HEADER_SIZE) {
+        size_t start = reader.pos;
+        uint32_t payload_len, crc;
+        get_u32(&reader, reader.len, &payload_len);
+        get_u32(&reader, reader.len, &crc);
+
+        // a torn or corrupt record ends the log
+        if (payload_len == 0 || reader.len - reader.pos < payload_len ||
+                crc32(reader.data + reader.pos, payload_len) != crc) {
+            reader.pos = start;
+            break;
+        }
+        if (payload_len >= contents_size) {
+            contents_size = payload_len + 1;
+            contents = realloc(contents, contents_size);
+            if (contents == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        int result = apply_record(&reader, reader.pos + payload_len, pass, tables, num_tables,
+                                  generation, contents, contents_size);
+        if (result == -1) {
+            reader.pos = start;
+            break;
+        }
+        reader.pos = start + RECORD_HEADER_SIZE + payload_len;
+        applied += result;
+    }
+
+    if (reader.pos < reader.len) {
+        fprintf(stderr, "wal: dropping %zu bytes after the last intact record of %s\n",
+                reader.len - reader.pos, path);
+        if (ftruncate(fd, reader.pos) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+
+    free(contents);
+    munmap((void *)reader.data, reader.len);
+    close(fd);
+    return applied;
+}
@@ -0,0 +1,143 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <time.h>
+
+#include "friends.h"
+
+#define WAL_DEFAULT_PATH "friend_server.wal"
+#define WAL_BUFFER_SIZE (64 * 1024)   // Initial size of the commit buffer
+#define WAL_DEFAULT_SYNC_INTERVAL 1000  // Milliseconds between interval syncs
+#define WAL_MAX_PATH 4096
+
+// Passes of wal_replay: every user is created before any friendship or
+// post, which may refer to users whose records are in another log
+#define WAL_REPLAY_USERS 0
+#define WAL_REPLAY_CHANGES 1
+
+// When wal_commit makes written records durable
+#define WAL_SYNC_ALWAYS 0     // fdatasync on every commit
+#define WAL_SYNC_INTERVAL 1   // fdatasync at most every sync_interval ms
+#define WAL_SYNC_NEVER 2      // leave it to the operating system
+
+/*
+ * An append-only write-ahead log of every change to a UserTable: created
+ * users, friendships and posts.
+ *
+ * Records are appended to an in-memory buffer as changes are made and
+ * written out together by wal_commit, which the server calls once per
+ * batch of events (group commit) and always before sending any reply that
+ * depends on them.
+ *
+ * Each record is framed as a 32-bit payload length, a CRC-32 of the
+ * payload and the payload itself (a type byte and its fields), so replay
+ * can detect and drop a record torn by a crash.
+ *
+ * Every log starts with a record of its generation. When a snapshot is
+ * taken the log is rotated: the current log is renamed to a segment
+ * "<path>.<generation>" and a new log of the next generation is started,
+ * so the snapshot holds exactly the changes in the segments before it.
+ */
+typedef struct wal {
+    const char *path;
+    unsigned long generation;
+    int fd;
+    int sync_policy;
+    int sync_interval;      // milliseconds, for WAL_SYNC_INTERVAL
+    char *buf;              // records not yet written
+    size_t len;
+    size_t capacity;
+    int unsynced;           // records were written but not synced
+    double last_sync;       // monotonic time of the last sync, in seconds
+    long records;           // records appended since opening
+    long commits;           // write() calls made by wal_commit
+    long syncs;             // fdatasync() calls
+    size_t bytes;           // bytes written since opening
+} Wal;
+
+
+/*
+ * Open (creating if needed) the log at path for appending. A new log is
+ * started at the given generation; an existing one keeps its own.
+ */
+void wal_open(Wal *wal, const char *path, unsigned long generation, int sync_policy,
+              int sync_interval);
+
+
+/*
+ * Apply the records of the given pass in the log at path to the tables
+ * that own their users (tables[shard_of(hash, num_tables)]). In the
+ * WAL_REPLAY_USERS pass, the log is first truncated after its last intact
+ * record. A missing log is treated as empty. If the log records its
+ * generation, *generation is set to it.
+ * Return the number of records applied.
+ */
+long wal_replay(const char *path, int pass, UserTable *tables, int num_tables,
+                unsigned long *generation);
+
+
+/*
+ * Write the path of the log segment of the given generation into buf.
+ */
+void wal_segment_path(char *buf, size_t size, const char *path, unsigned long generation);
+
+
+/*
+ * Commit and sync the log, rename it to its segment path and start a new
+ * log of the next generation in its place.
+ */
+void wal_rotate(Wal *wal);
+
+
+/*
+ * Append a record of a successful create_user.
+ */
+void wal_log_user(Wal *wal, const char *name);
+
+
+/*
+ * Append a record of a successful make_friends.
+ */
+void wal_log_friends(Wal *wal, const char *name1, const char *name2);
+
+
+/*
+ * Append a record of friend_name being added to the friends of name, one
+ * half of a friendship between users owned by different tables.
+ */
+void wal_log_friend(Wal *wal, const char *name, const char *friend_name);
+
+
+/*
+ * Append a record of a successful make_post.
+ */
+void wal_log_post(Wal *wal, const char *author, const char *target, time_t date,
+                  const char *contents);
+
+
+/*
+ * Return 1 if records have been appended since the last commit.
+ */
+int wal_pending(const Wal *wal);
+
+
+/*
+ * Write every appended record to the log, then sync it if the policy
+ * calls for it.
+ */
+void wal_commit(Wal *wal);
+
+
+/*
+ * Return the number of milliseconds until an interval sync is due, or -1
+ * if none is pending.
+ */
+int wal_sync_timeout(const Wal *wal);
+
+
+/*
+ * Sync the log if an interval sync is due.
+ */
+void wal_tick(Wal *wal);
+
+#endif